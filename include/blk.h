@@ -5,11 +5,14 @@
 struct blkdev {
     void *dev_data;
 
-    ssize_t (*read) (struct blkdev *blk, void *buf, size_t off, size_t count);
-    ssize_t (*write) (struct blkdev *blk, const void *buf, size_t off, size_t count);
+    ssize_t (*read) (struct blkdev *blk, void *buf, uint64_t off, size_t count);
+    ssize_t (*write) (struct blkdev *blk, const void *buf, uint64_t off, size_t count);
+    // Wait until the written data is on stable storage, optional
+    int (*flush) (struct blkdev *blk);
 
     void (*destroy) (struct blkdev *blk);
 };
 
-ssize_t blk_read(struct blkdev *blk, void *buf, size_t off, size_t count);
-ssize_t blk_write(struct blkdev *blk, const void *buf, size_t off, size_t count);
+ssize_t blk_read(struct blkdev *blk, void *buf, uint64_t off, size_t count);
+ssize_t blk_write(struct blkdev *blk, const void *buf, uint64_t off, size_t count);
+int blk_flush(struct blkdev *blk);
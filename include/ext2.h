@@ -1,6 +1,12 @@
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "fs.h"
+#include "hash.h"
+#include "rbtree.h"
 
 #define EXT2_MAGIC      ((uint16_t) 0xEF53)
 
@@ -20,6 +26,45 @@
 #define EXT2_TYPE_DIR   ((uint16_t) 0x4000)
 #define EXT2_TYPE_LNK   ((uint16_t) 0xA000)
 
+// Inode flags
+#define EXT2_INODE_INLINE       ((uint32_t) 0x10000000)
+#define EXT2_INODE_EXTENTS      ((uint32_t) 0x00080000)
+
+// Optional features
+// The fs has a JBD2 journal in sb->journal_inode
+#define EXT2_OPT_HAS_JOURNAL    ((uint32_t) 0x0004)
+
+// Required features
+#define EXT2_REQ_FILETYPE       ((uint32_t) 0x0002)
+// The journal has to be replayed before the fs can be used
+#define EXT2_REQ_RECOVER        ((uint32_t) 0x0004)
+// Files may map their blocks with extent trees instead of block maps
+#define EXT2_REQ_EXTENTS        ((uint32_t) 0x0040)
+// Bitmaps and inode tables of a flex group may be packed together
+// anywhere in it, the descriptors tell where
+#define EXT2_REQ_FLEX_BG        ((uint32_t) 0x0200)
+// Tiny files and directories may keep their data in the inode
+#define EXT2_REQ_INLINE_DATA    ((uint32_t) 0x8000)
+#define EXT2_REQ_SUPPORTED      (EXT2_REQ_FILETYPE | EXT2_REQ_RECOVER | EXT2_REQ_EXTENTS | \
+                                 EXT2_REQ_FLEX_BG | EXT2_REQ_INLINE_DATA)
+
+// Features required for writing
+#define EXT2_RO_SPARSE_SUPER    ((uint32_t) 0x0001)
+// Regular files may be 2GiB or larger, size_upper holds the high
+// half of their size
+#define EXT2_RO_LARGE_FILE      ((uint32_t) 0x0002)
+#define EXT2_RO_SUPPORTED       (EXT2_RO_SPARSE_SUPER | EXT2_RO_LARGE_FILE)
+
+// Directory entry type indicators (only valid with EXT2_REQ_FILETYPE)
+#define EXT2_FT_UNKNOWN ((uint8_t) 0)
+#define EXT2_FT_REG     ((uint8_t) 1)
+#define EXT2_FT_DIR     ((uint8_t) 2)
+#define EXT2_FT_CHR     ((uint8_t) 3)
+#define EXT2_FT_BLK     ((uint8_t) 4)
+#define EXT2_FT_FIFO    ((uint8_t) 5)
+#define EXT2_FT_SOCK    ((uint8_t) 6)
+#define EXT2_FT_LNK     ((uint8_t) 7)
+
 struct ext2_sb {
     uint32_t inode_count;
     uint32_t block_count;
@@ -41,6 +86,7 @@ struct ext2_sb {
     uint16_t error_action;
     uint16_t version_minor;
     uint32_t last_fsck_time;
+    uint32_t fsck_interval;
     uint32_t os_id;
     uint32_t version_major;
     uint16_t su_uid;
@@ -66,13 +112,50 @@ struct ext2_extsb {
     uint32_t journal_inode;
     uint32_t journal_dev;
     uint32_t orphan_inode_head;
+    uint32_t hash_seed[4];
+    uint8_t def_hash_version;
+    uint8_t journal_backup_type;
+    uint16_t group_desc_size;
+    uint32_t default_mount_opts;
+    uint32_t first_meta_bg;
+    uint32_t mkfs_time;
+    uint32_t journal_blocks[17];
+    uint32_t block_count_hi;
+    uint32_t reserved_block_count_hi;
+    uint32_t free_block_count_hi;
+    uint16_t min_extra_isize;
+    uint16_t want_extra_isize;
+    uint32_t flags;
+    uint16_t raid_stride;
+    uint16_t mmp_interval;
+    uint64_t mmp_block;
+    uint32_t raid_stripe_width;
+    // Groups per flex group, with EXT2_REQ_FLEX_BG
+    uint8_t log_groups_per_flex;
+    uint8_t checksum_type;
+    uint16_t __un2;
+    char __un1[EXT2_SBSIZ - 376];
 
-    // driver-specific info
+    // driver-specific info, not part of the on-disk superblock
     uint32_t block_size;
     uint32_t block_group_count;
     uint32_t block_group_descriptor_table_block;
     uint32_t block_group_descriptor_table_size_blocks;
     struct ext2_grp_desc *block_group_descriptor_table;
+    // Which BGDT blocks were read, see ext2_group_desc()
+    atomic_uchar *bgdt_loaded;
+    // Largest file the block map can describe
+    uint64_t max_file_size;
+    // ino -> struct ext2_inode_info of the inodes in use or with
+    // cached data
+    hash_t *inode_info;
+    // Reservation windows of the inodes being written, sorted by start
+    struct ext2_rsv_window *rsv_windows;
+    struct ext2_cache *cache;
+    // NULL until the first allocation needing it
+    struct ext2_fext_index *fext;
+    // NULL if the fs has no journal
+    struct ext2_journal *journal;
 } __attribute__((packed));
 
 struct ext2_grp_desc {
@@ -112,6 +195,57 @@ struct ext2_inode {
     char os_value_2[12];
 } __attribute__((packed));
 
+// Extended attribute entry, as stored in the inode past its
+// i_extra_isize bytes, after a magic. Values are at value_offs
+// from the first entry
+struct ext2_xattr_entry {
+    uint8_t name_len;
+    uint8_t name_index;
+    uint16_t value_offs;
+    uint32_t value_inum;
+    uint32_t value_size;
+    uint32_t hash;
+    char name[];
+} __attribute__((packed));
+
+#define EXT2_XATTR_MAGIC        ((uint32_t) 0xEA020000)
+#define EXT2_XATTR_SYSTEM       7
+#define EXT2_XATTR_LEN(n)       ((sizeof(struct ext2_xattr_entry) + (n) + 3) & ~3)
+
+// Inline data goes into the block pointers, anything past them into the
+// value of the "system.data" attribute, which exists even if empty
+#define EXT2_INLINE_SIZE        60
+// i_extra_isize of the inodes made inline here
+#define EXT2_INODE_EXTRA_ISIZE  32
+
+// Extent tree node header, at the start of i_block[] and of the tree
+// blocks. Index entries follow it, or extents in the leaves
+struct ext2_ext_header {
+    uint16_t magic;
+    uint16_t entries;
+    uint16_t max;
+    uint16_t depth;
+    uint32_t generation;
+} __attribute__((packed));
+
+// len blocks of the file from block on are at start on disk
+struct ext2_extent {
+    uint32_t block;
+    uint16_t len;
+    uint16_t start_hi;
+    uint32_t start;
+} __attribute__((packed));
+
+// The node in the leaf block maps the file from block on
+struct ext2_ext_idx {
+    uint32_t block;
+    uint32_t leaf;
+    uint16_t leaf_hi;
+    uint16_t __un0;
+} __attribute__((packed));
+
+#define EXT2_EXT_MAGIC          ((uint16_t) 0xF30A)
+
 struct ext2_dirent {
     uint32_t ino;
     uint16_t len;
@@ -120,28 +254,521 @@ struct ext2_dirent {
     char name[];
 } __attribute__((packed));
 
+// Range of free blocks reserved for the future writes of an inode,
+// other allocations skip it. Never crosses a block group
+struct ext2_rsv_window {
+    // start == 0 when there's no window
+    uint32_t start;
+    uint32_t end;
+    // Size of the next window, grows as windows get used up
+    uint32_t size;
+    struct ext2_rsv_window *next;
+};
+
+#define EXT2_RSV_DEFAULT_WINDOW     8
+#define EXT2_RSV_MAX_WINDOW         1024
+
+// Run of free blocks in the free extent index, never crosses a block
+// group
+struct ext2_fext {
+    uint32_t start;
+    uint32_t count;
+    struct rb_node by_start;
+    struct rb_node by_count;
+};
+
+// Free space of the fs as extents sorted both by start and by length,
+// built from the bitmaps by the flusher once first needed. It is a hint for
+// placing allocations, the bitmaps have the last word. Blocks freed by a
+// journal transaction only show up once it commits
+struct ext2_fext_index {
+    rb_tree_t by_start;
+    // By length, then by start
+    rb_tree_t by_count;
+    size_t nexts;
+};
+
+// Allocations of this many blocks or more are placed with the free
+// extent index
+#define EXT2_FEXT_MIN_COUNT         16
+
+// Driver state of an inode, shared by all of its vnodes
+struct ext2_inode_info {
+    uint32_t ino;
+    uint32_t refcount;
+    // Protects the fields below and the inode itself
+    pthread_mutex_t lock;
+    struct ext2_inode *inode;
+    struct ext2_rsv_window rsv;
+    // index -> struct ext2_page
+    hash_t *pages;
+    // Most recently used page first
+    struct ext2_page *lru_head, *lru_tail;
+    size_t ndirty;
+    // When the oldest dirty page got dirty
+    time_t dirty_since;
+    // Size or block map changed since the inode was last written
+    uint8_t inode_dirty;
+    // The inode is being read, under cache->lock
+    uint8_t loading;
+    // Where the next O_APPEND write goes, not less than the size.
+    // Bumped by appenders without the lock
+    _Atomic uint64_t append_end;
+};
+
+// A cached block of file data. Allocation of the block on disk is
+// delayed until the page is written back
+struct ext2_page {
+    uint32_t index;
+    uint8_t dirty;
+    // Dirty page which has no block on disk yet
+    uint8_t delayed;
+    // Dropped from the cache while pinned, freed on last unpin
+    uint8_t detached;
+    // Read-only views handed out by vfs_view()
+    uint32_t pins;
+    struct ext2_page *prev, *next;
+    char data[];
+};
+
+// Cached data (clean and dirty) past which clean pages get evicted,
+// least recently used first
+#define EXT2_CACHE_MAX_PAGES        8192
+// Pages a reader evicts from its own file at once when over the limit
+#define EXT2_CACHE_SHRINK_BATCH     32
+
+// Dirty data past which writers write back their own pages and the
+// flusher is kicked to write back everything
+#define EXT2_DIRTY_MAX_PAGES        4096
+// Dirty pages older than this (seconds) get written back by the flusher
+#define EXT2_DIRTY_EXPIRE           5
+#define EXT2_FLUSH_INTERVAL         1
+// Max blocks written back with a single device write
+#define EXT2_FLUSH_MAX_RUN          64
+// Max metadata blocks read ahead at once: the block and inode bitmaps
+// of a flex group of 16
+#define EXT2_META_RA_MAX            32
+
+// Locks protecting the block groups, a group uses the one at its
+// number modulo this
+#define EXT2_GROUP_LOCKS            32
+// Allocating threads are spread over this many slots
+#define EXT2_ALLOC_SLOTS            16
+// Blocks of an unlinked inode the reclaimer frees per journal handle
+#define EXT2_RECLAIM_BATCH          32768
+
+// Allocator state of the threads sharing a slot: the free counts they
+// changed which are not in the superblock yet, their change to the
+// directory count, and the group goal-less block allocations start
+// from. Padded to a cache line so the slots don't share one
+struct ext2_alloc_slot {
+    atomic_long free_blocks;
+    atomic_long free_inodes;
+    atomic_long dirs;
+    atomic_uint group;
+    char pad[64 - 3 * sizeof(atomic_long) - sizeof(atomic_uint)];
+};
+
+// Per-mount write-back state
+struct ext2_cache {
+    // Protects the inode info hash and flusher fields
+    pthread_mutex_t lock;
+    // Protects the superblock and writing back the BGDT
+    pthread_mutex_t meta_lock;
+    // Protect the bitmaps, descriptor and inode table blocks of the
+    // groups using them, see ext2_group_lock(). Taken after meta_lock,
+    // one at a time except by ext2_write_meta()
+    pthread_mutex_t group_locks[EXT2_GROUP_LOCKS];
+    // Protects the list of reservation windows, taken after a group lock
+    pthread_mutex_t rsv_lock;
+    // Serializes loading the BGDT blocks, taken after the group locks
+    pthread_mutex_t bgdt_lock;
+    // Protects the free extent index, taken after all the others
+    // including the journal's lock
+    pthread_mutex_t fext_lock;
+    // Serializes changes to the orphan list, taken before the inode
+    // info locks
+    pthread_mutex_t orphan_lock;
+
+    // Signalled once an inode info is loaded
+    pthread_cond_t load_cond;
+
+    pthread_t flusher;
+    pthread_cond_t flusher_cond;
+    int flusher_stop;
+    int flush_all;
+    // Evict clean pages of all the inodes
+    int shrink;
+    // BGDT or superblock need to be written back
+    atomic_int meta_dirty;
+    // The flusher loads the BGDT blocks not loaded yet when it starts
+    int bgdt_prefetch;
+    // The flusher builds the free extent index
+    int fext_build;
+
+    // Frees the unlinked inodes, see ext2orphan.c
+    pthread_t reclaimer;
+    pthread_mutex_t reclaim_lock;
+    pthread_cond_t reclaim_cond;
+    int reclaimer_stop;
+    // Orphans may have been released since the last pass
+    int reclaim;
+
+    // Metadata blocks read ahead, see ext2_meta_readahead(). Taken
+    // before the journal's lock
+    pthread_mutex_t ra_lock;
+    uint32_t ra_start;
+    uint32_t ra_count;
+    uint32_t ra_max;
+    char *ra_data;
+
+    struct ext2_alloc_slot slots[EXT2_ALLOC_SLOTS];
+    // Directories in all the groups, less the changes in the slots.
+    // The superblock has no such count: it is summed up from the BGDT
+    // the first time the Orlov allocator needs it
+    long dirs_base;
+    atomic_int dirs_loaded;
+
+    atomic_size_t cached_pages;
+    atomic_size_t dirty_pages;
+    atomic_size_t delayed_pages;
+};
+
+// JBD2 journal blocks start with this header, all the journal
+// structures are big-endian
+struct ext2_jheader {
+    uint32_t magic;
+    uint32_t blocktype;
+    uint32_t sequence;
+} __attribute__((packed));
+
+#define EXT2_JMAGIC             ((uint32_t) 0xC03B3998)
+
+#define EXT2_JDESCRIPTOR        1
+#define EXT2_JCOMMIT            2
+#define EXT2_JSB_V1             3
+#define EXT2_JSB_V2             4
+#define EXT2_JREVOKE            5
+
+// First block of the journal, only the fields used here
+struct ext2_jsb {
+    struct ext2_jheader header;
+    uint32_t blocksize;
+    uint32_t maxlen;
+    uint32_t first;
+    // First transaction expected in the log and where it starts,
+    // start is 0 if the log is empty
+    uint32_t sequence;
+    uint32_t start;
+    uint32_t error;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+    char uuid[16];
+} __attribute__((packed));
+
+#define EXT2_JFEATURE_INCOMPAT_REVOKE   ((uint32_t) 0x0001)
+#define EXT2_JFEATURE_INCOMPAT_64BIT    ((uint32_t) 0x0002)
+#define EXT2_JFEATURE_INCOMPAT_SUPPORTED \
+    (EXT2_JFEATURE_INCOMPAT_REVOKE | EXT2_JFEATURE_INCOMPAT_64BIT)
+
+// Descriptor blocks list the blocks following them with these tags.
+// The first tag is followed by the journal UUID
+struct ext2_jtag {
+    uint32_t block_no;
+    uint16_t checksum;
+    uint16_t flags;
+    // Only with EXT2_JFEATURE_INCOMPAT_64BIT
+    uint32_t block_no_hi;
+} __attribute__((packed));
+
+// The block started with EXT2_JMAGIC, the copy has zeroes there
+#define EXT2_JTAG_ESCAPE        ((uint16_t) 1)
+#define EXT2_JTAG_SAME_UUID     ((uint16_t) 2)
+#define EXT2_JTAG_LAST          ((uint16_t) 8)
+
+// Revoke blocks: count is the number of bytes used, header included
+struct ext2_jrevoke {
+    struct ext2_jheader header;
+    uint32_t count;
+} __attribute__((packed));
+
+// Commit blocks: only the time is filled in
+struct ext2_jcommit {
+    struct ext2_jheader header;
+    uint8_t checksum_type;
+    uint8_t checksum_size;
+    uint8_t __un0[2];
+    uint32_t checksum[8];
+    uint64_t sec;
+    uint32_t nsec;
+} __attribute__((packed));
+
+// In-memory copy of a metadata block written since the last checkpoint,
+// reads of the block are served from it
+struct ext2_jbuf {
+    uint32_t block_no;
+    // Changed by the running transaction
+    int running;
+    // Logged by a committed transaction since the last checkpoint
+    int logged;
+    struct ext2_jbuf *prev, *next;
+    char data[];
+};
+
+struct ext2_freed_run {
+    uint32_t start;
+    uint32_t count;
+};
+
+// Blocks collected while a file is truncated, freed at once by
+// ext2_free_batch_apply(). Runs never cross a group
+struct ext2_free_batch {
+    struct ext2_freed_run *runs;
+    size_t count;
+    size_t cap;
+};
+
+// A commit is asked for once the running transaction has this part of
+// the journal (1/n) in it
+#define EXT2_JOURNAL_TRANSACTION_PART   8
+// The log is checkpointed once less than this part of it is free
+#define EXT2_JOURNAL_RESERVE_PART       2
+// Defaults of the commit=, max_batch_time= and max_batch= mount
+// options. Transactions are committed after commit seconds at most. A
+// sync commit waits up to max_batch_time microseconds for the operations
+// in flight to join it, unless max_batch operations already have
+#define EXT2_JOURNAL_COMMIT_INTERVAL    5
+#define EXT2_JOURNAL_MAX_BATCH_TIME     15000
+#define EXT2_JOURNAL_MAX_BATCH          256
+
+// Counters of the commits done since mount
+struct ext2_journal_stats {
+    uint64_t commits;
+    // Operations and blocks in the committed transactions
+    uint64_t ops;
+    uint64_t blocks;
+    uint64_t max_ops;
+    // From the start of the commit until it is durable, in microseconds
+    uint64_t latency;
+    uint64_t max_latency;
+};
+
+// Per-mount journal state
+struct ext2_journal {
+    // Protects all the fields below
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Operations running in the current transaction
+    int handles;
+    // EXT2_JOURNAL_IDLE, _DRAIN or _WRITE
+    int state;
+
+    // Commits are done by this thread, others ask for them and wait
+    pthread_t thread;
+    int thread_stop;
+    // Commits done so far, and the one some caller waits for
+    uint64_t commit_gen;
+    uint64_t commit_wanted;
+    struct timespec wanted_since;
+    // Result of the last commit
+    int commit_res;
+    unsigned int commit_interval;
+    unsigned int max_batch_time;
+    unsigned int max_batch;
+    // Operations which joined the running transaction
+    size_t nops;
+    struct ext2_journal_stats stats;
+
+    // Journal block -> device block
+    uint32_t *map;
+    uint32_t first;
+    uint32_t maxlen;
+    // Where the log starts (0 if empty) and the next block to write
+    uint32_t start;
+    uint32_t head;
+    // Sequence number of the running transaction
+    uint32_t sequence;
+    size_t tag_size;
+    // Copy of the journal superblock
+    char *jsb;
+
+    // block_no -> struct ext2_jbuf
+    hash_t *bufs;
+    // The blocks of the running transaction
+    struct ext2_jbuf *running;
+    size_t nrunning;
+    time_t running_since;
+    // Blocks logged before, freed by the running transaction
+    uint32_t *revoked;
+    size_t nrevoked;
+    size_t revoked_cap;
+    // Blocks freed by the running transaction. They can't be allocated
+    // before it commits: their old owner still has them after a crash
+    struct ext2_freed_run *freed;
+    size_t nfreed;
+    size_t freed_cap;
+};
+
+// Nothing to wait for
+#define EXT2_JOURNAL_IDLE       0
+// A commit waits for the operations to end, no new ones start
+#define EXT2_JOURNAL_DRAIN      1
+// A commit is being written, metadata can't change
+#define EXT2_JOURNAL_WRITE      2
+
+#define ext2_vnode_info(vn)     ((struct ext2_inode_info *) (vn)->fs_data)
+#define ext2_vnode_inode(vn)    (ext2_vnode_info(vn)->inode)
+
+// i_block[]: direct block pointers followed by L1, L2 and L3
+// indirect block pointers
+#define ext2_inode_block_ptrs(i)    ((uint32_t *) ((char *) (i) + offsetof(struct ext2_inode, direct_blocks)))
+// The data is in the inode, i_block[] holds no block pointers
+#define ext2_inode_inline(i)        ((i)->flags & EXT2_INODE_INLINE)
+// i_block[] is the root of an extent tree
+#define ext2_inode_extents(i)       ((i)->flags & EXT2_INODE_EXTENTS)
+
 void ext2_class_init(void);
 enum vnode_type ext2_inode_type(struct ext2_inode *i);
+uint64_t ext2_inode_size(const struct ext2_inode *inode);
+int ext2_inode_set_size(fs_t *ext2, struct ext2_inode *inode, uint64_t size);
+uint8_t ext2_dirent_type(fs_t *ext2, enum vnode_type type);
+unsigned char ext2_dirent_dtype(fs_t *ext2, const struct ext2_dirent *ent);
 
 // Implemented in ext2blk.c
 int ext2_write_superblock(fs_t *ext2);
+void ext2_meta_dirty(fs_t *ext2);
+int ext2_write_meta(fs_t *ext2);
+int ext2_group_desc(fs_t *ext2, uint32_t group_no, struct ext2_grp_desc **desc);
+int ext2_bgdt_load(fs_t *ext2, uint32_t index);
+int ext2_meta_readahead(fs_t *ext2, uint32_t block_no, uint32_t count);
+void ext2_ra_update(fs_t *ext2, uint32_t block_no, uint32_t count, const void *buf);
+void ext2_bgdt_prefetch(fs_t *ext2);
+void ext2_bgdt_invalidate(fs_t *ext2);
 int ext2_read_block(fs_t *ext2, uint32_t block_no, void *buf);
+int ext2_read_blocks(fs_t *ext2, uint32_t block_no, uint32_t count, void *buf);
 int ext2_write_block(fs_t *ext2, uint32_t block_no, const void *buf);
+int ext2_write_blocks(fs_t *ext2, uint32_t block_no, uint32_t count, const void *buf);
+int ext2_block_map_path(fs_t *ext2, uint32_t index, uint32_t *offsets);
+int ext2_inode_get_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t *block_no);
+int ext2_inode_lookup_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t *block_no, int *uninit);
+int ext2_inode_lookup_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count,
+                             uint32_t *blocks, char *uninit);
 int ext2_read_inode_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, void *buf);
+int ext2_zero_blocks(fs_t *ext2, uint32_t block_no, uint32_t count);
 int ext2_write_inode_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, const void *buf);
+int ext2_inode_location(fs_t *ext2, uint32_t ino, uint32_t *block_no, uint32_t *offset);
 int ext2_read_inode(fs_t *ext2, struct ext2_inode *inode, uint32_t ino);
 int ext2_write_inode(fs_t *ext2, const struct ext2_inode *inode, uint32_t ino);
 
 // Implemented in ext2alloc.c
 int ext2_alloc_block(fs_t *ext2, uint32_t *block_no);
+int ext2_alloc_blocks(fs_t *ext2, uint32_t goal, uint32_t count, uint32_t *block_no, uint32_t *got);
+int ext2_rsv_alloc_blocks(fs_t *ext2, struct ext2_rsv_window *rsv, uint32_t goal, uint32_t count,
+                          uint32_t *block_no, uint32_t *got);
+void ext2_rsv_discard(fs_t *ext2, struct ext2_rsv_window *rsv);
 int ext2_free_block(fs_t *ext2, uint32_t block_no);
-int ext2_inode_alloc_block(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index);
-int ext2_free_inode_block(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index);
-int ext2_free_inode(fs_t *ext2, uint32_t ino);
-int ext2_alloc_inode(fs_t *ext2, uint32_t *ino);
+uint32_t ext2_inode_goal(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index);
+int ext2_inode_map_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t block_no);
+int ext2_inode_map_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t block_no, uint32_t count);
+int ext2_inode_alloc_block(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index, uint32_t *block_no);
+int ext2_free_batch_add(fs_t *ext2, struct ext2_free_batch *batch, uint32_t start, uint32_t count);
+int ext2_free_batch_apply(fs_t *ext2, struct ext2_free_batch *batch);
+int ext2_free_inode_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count);
+int ext2_inode_map_end(fs_t *ext2, struct ext2_inode *inode, uint64_t *end);
+int ext2_free_inode(fs_t *ext2, uint32_t ino, enum vnode_type type);
+int ext2_alloc_inode(fs_t *ext2, uint32_t parent, enum vnode_type type, uint32_t *ino);
+int ext2_read_block_bitmap(fs_t *ext2, uint32_t group_no, char *bitmap_block);
+uint32_t ext2_group_blocks(struct ext2_extsb *sb, uint32_t group);
+void ext2_group_lock(fs_t *ext2, uint32_t group_no);
+void ext2_group_unlock(fs_t *ext2, uint32_t group_no);
+void ext2_counts_fold(fs_t *ext2);
+uint32_t ext2_free_blocks_count(fs_t *ext2);
+uint32_t ext2_free_inodes_count(fs_t *ext2);
+
+// Implemented in ext2fext.c
+int ext2_fext_build(fs_t *ext2);
+int ext2_fext_goal(fs_t *ext2, uint32_t goal, uint32_t count, uint32_t *best);
+void ext2_fext_insert(fs_t *ext2, uint32_t start, uint32_t count);
+void ext2_fext_remove(fs_t *ext2, uint32_t start, uint32_t count);
+void ext2_fext_release(fs_t *ext2);
+
+// Implemented in ext2orphan.c
+int ext2_orphan_init(fs_t *ext2);
+void ext2_orphan_release(fs_t *ext2);
+int ext2_orphan_add(fs_t *ext2, struct ext2_inode_info *info);
+void ext2_orphan_kick(fs_t *ext2);
+
+// Implemented in ext2info.c
+void ext2_inode_info_init(fs_t *ext2);
+void ext2_inode_info_release(fs_t *ext2);
+void ext2_inode_info_prune(fs_t *ext2);
+struct ext2_inode_info *ext2_inode_info_get(fs_t *ext2, uint32_t ino);
+int ext2_inode_info_copy(fs_t *ext2, uint32_t ino, struct ext2_inode *inode);
+int ext2_inode_info_dtime(fs_t *ext2, uint32_t ino, uint32_t *dtime);
+int ext2_inode_info_put(fs_t *ext2, struct ext2_inode_info *info);
+
+// Implemented in ext2cache.c
+int ext2_cache_init(fs_t *ext2);
+void ext2_cache_stop(fs_t *ext2);
+void ext2_cache_release(fs_t *ext2);
+void ext2_cache_prefetch(fs_t *ext2);
+void ext2_cache_fext(fs_t *ext2);
+struct ext2_page *ext2_page_find(struct ext2_inode_info *info, uint32_t index);
+int ext2_page_get(fs_t *ext2, struct ext2_inode_info *info, uint32_t index, int fill, struct ext2_page **page);
+void ext2_page_dirty(fs_t *ext2, struct ext2_inode_info *info, struct ext2_page *page, int mapped);
+int ext2_page_reserve(fs_t *ext2, struct ext2_inode_info *info);
+void ext2_page_unpin(struct ext2_page *page);
+void ext2_pages_truncate(fs_t *ext2, struct ext2_inode_info *info, uint32_t index);
+size_t ext2_pages_shrink(fs_t *ext2, struct ext2_inode_info *info, size_t count);
+int ext2_inode_flush_pages(fs_t *ext2, struct ext2_inode_info *info);
+int ext2_inode_flush(fs_t *ext2, struct ext2_inode_info *info);
+int ext2_cache_sync(fs_t *ext2);
+int ext2_cache_throttle(fs_t *ext2, struct ext2_inode_info *info);
+
+int ext2_inline_promote(fs_t *ext2, struct ext2_inode_info *info);
 
 // Implemented in ext2dir.c
-int ext2_dir_add_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino);
+uint64_t ext2_dir_size(fs_t *ext2, const struct ext2_inode *inode);
+int ext2_dirent_valid(fs_t *ext2, const void *block, size_t off);
+int ext2_dir_read_block(fs_t *ext2, vnode_t *dir, uint32_t index, void *buf);
+int ext2_dir_add_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino, enum vnode_type type);
 int ext2_dir_remove_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino);
 
+// Implemented in ext2inline.c
+int ext2_inline_enabled(fs_t *ext2);
+int ext2_inline_init(fs_t *ext2, struct ext2_inode *inode);
+int ext2_inline_fits(fs_t *ext2, struct ext2_inode *inode, uint64_t size);
+int ext2_inline_read(fs_t *ext2, struct ext2_inode *inode, void *buf);
+void ext2_inline_store(struct ext2_inode *inode, const void *data, size_t size);
+void ext2_inline_drop(fs_t *ext2, struct ext2_inode *inode);
+int ext2_inline_dir_read(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, void *buf);
+int ext2_inline_dir_store(fs_t *ext2, struct ext2_inode *inode, const void *buf);
+
+// Implemented in ext2extent.c
+int ext2_ext_enabled(fs_t *ext2);
+void ext2_ext_init(struct ext2_inode *inode);
+int ext2_ext_get_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t *block_no, int *uninit);
+int ext2_ext_get_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count,
+                        uint32_t *blocks, char *uninit);
+int ext2_ext_map_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t block_no, uint32_t count,
+                        int uninit);
+int ext2_ext_free_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count,
+                         struct ext2_free_batch *batch);
+int ext2_ext_mark_init(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count);
+int ext2_ext_map_end(fs_t *ext2, struct ext2_inode *inode, uint64_t *end);
+
+// Implemented in ext2journal.c
+int ext2_journal_load(fs_t *ext2, const char *opt);
+int ext2_journal_release(fs_t *ext2);
+void ext2_journal_start(fs_t *ext2);
+void ext2_journal_stop(fs_t *ext2);
+int ext2_journal_commit(fs_t *ext2);
+int ext2_journal_stats(fs_t *ext2, struct ext2_journal_stats *st);
+int ext2_journal_read(fs_t *ext2, uint32_t block_no, void *buf);
+void ext2_journal_overlay(fs_t *ext2, uint32_t block_no, uint32_t count, void *buf);
+int ext2_journal_write(fs_t *ext2, uint32_t block_no, const void *buf);
+int ext2_journal_forget(fs_t *ext2, uint32_t block_no, uint32_t count);
+void ext2_journal_mask_freed(fs_t *ext2, uint32_t base, uint32_t count, char *bitmap, int set);
+
 extern struct vnode_operations ext2_vnode_ops;
@@ -10,6 +10,7 @@ struct fs_class {
     vnode_t *(*get_root) (fs_t *fs);
     int (*mount) (fs_t *fs, const char *opt);
     int (*umount) (fs_t *fs);
+    int (*sync) (fs_t *fs);
     int (*statvfs) (fs_t *fs, struct statvfs *st);
 
     struct vnode_operations op;
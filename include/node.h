@@ -9,9 +9,11 @@
 #if !defined(__linux__)
 #include "dirent.h"
 #include "stat.h"
+#include "uio.h"
 #else
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/uio.h>
 #endif
 
 // O_EXEC is a special one for opening a node for
@@ -19,6 +21,7 @@
 #define O_EXEC      (1 << 2)
 
 struct ofile;
+struct vfs_view;
 struct vfs_ioctx;
 typedef struct vnode vnode_t;
 typedef struct fs fs_t;
@@ -55,13 +58,27 @@ struct vnode_operations {
     // Directory access
     int (*opendir) (vnode_t *node, int opt);
     int (*readdir) (struct ofile *fd);
+    ssize_t (*getdents) (struct ofile *fd, void *buf, size_t count);
+    ssize_t (*readdirplus) (struct ofile *fd, void *buf, size_t count);
 
     // File access
     int (*open) (vnode_t *node, int opt);
     void (*close) (struct ofile *fd);
     ssize_t (*read) (struct ofile *fd, void *buf, size_t count);
+    ssize_t (*view) (struct ofile *fd, size_t count, struct vfs_view *view);
+    void (*view_put) (struct ofile *fd, struct vfs_view *view);
     ssize_t (*write) (struct ofile *fd, const void *buf, size_t count);
-    int (*truncate) (struct ofile *fd, size_t length);
+    // write() of several buffers at once
+    ssize_t (*writev) (struct ofile *fd, const struct iovec *iov, int iovcnt);
+    // Positional I/O, these don't use or change fd->pos. With O_APPEND,
+    // pwritev() ignores offset and appends like write()
+    ssize_t (*preadv) (struct ofile *fd, const struct iovec *iov, int iovcnt, uint64_t offset);
+    ssize_t (*pwritev) (struct ofile *fd, const struct iovec *iov, int iovcnt, uint64_t offset);
+    int (*truncate) (struct ofile *fd, uint64_t length);
+    int (*fallocate) (struct ofile *fd, int mode, uint64_t offset, uint64_t length);
+    // Both files are on the same filesystem
+    ssize_t (*copy_range) (struct ofile *src, uint64_t src_off, struct ofile *dst, uint64_t dst_off, size_t count);
+    int (*fsync) (struct ofile *fd, int datasync);
 };
 
 struct vnode {
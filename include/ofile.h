@@ -5,7 +5,11 @@
 struct ofile {
     int flags;
     vnode_t *vnode;
-    size_t pos;
+    uint64_t pos;
+    // Position/fill level of dirent_buf when it's
+    // filled by getdents()
+    size_t dirent_off;
+    size_t dirent_len;
     // Dirent buffer
     char dirent_buf[512];
 };
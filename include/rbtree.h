@@ -0,0 +1,29 @@
+#pragma once
+#include <stddef.h>
+
+// Intrusive red-black tree: the nodes are embedded into the items,
+// lookups walk rb_tree.root with the item's own ordering
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left, *right;
+    int red;
+};
+
+typedef struct rb_tree {
+    struct rb_node *root;
+} rb_tree_t;
+
+#define rb_entry(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+// Insert the node under parent (NULL for an empty tree) as its left
+// child if left is set, then rebalance
+void rb_link(rb_tree_t *t, struct rb_node *node, struct rb_node *parent, int left);
+// Insert the node before the first one cmp() says it is less than
+void rb_insert(rb_tree_t *t, struct rb_node *node, int (*cmp) (const struct rb_node *, const struct rb_node *));
+void rb_erase(rb_tree_t *t, struct rb_node *node);
+
+struct rb_node *rb_first(const rb_tree_t *t);
+struct rb_node *rb_last(const rb_tree_t *t);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
@@ -51,9 +51,9 @@ struct stat {
     uid_t st_uid;
     gid_t st_gid;
     uint32_t st_rdev;
-    uint32_t st_size;
+    uint64_t st_size;
     uint32_t st_blksize;
-    uint32_t st_blocks;
+    uint64_t st_blocks;
     uint32_t st_atime;
     uint32_t st_mtime;
     uint32_t st_ctime;
@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+
+#if !defined(__linux__)
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+#endif
@@ -4,6 +4,43 @@
 #include "ofile.h"
 #include "stat.h"
 
+#include <stddef.h>
+
+// Size of a packed struct dirent record returned by getdents(),
+// aligned so the next record's fields are properly aligned too
+#define VFS_DIRENT_RECLEN(name_len) \
+    ((offsetof(struct dirent, d_name) + (name_len) + 1 + 7) & ~7)
+
+// Entry returned by readdirplus(): directory entry along with
+// the stat of the node it refers to. dp_dirent.d_reclen is the
+// size of the whole record
+struct dirent_plus {
+    struct stat dp_stat;
+    struct dirent dp_dirent;
+};
+
+#define VFS_DIRENT_PLUS_RECLEN(name_len) \
+    ((offsetof(struct dirent_plus, dp_dirent.d_name) + (name_len) + 1 + 7) & ~7)
+
+// vfs_fallocate() mode: don't change the file size even if the
+// range extends past EOF
+#define VFS_FALLOC_KEEP_SIZE        (1 << 0)
+
+// Max buffers passed to vfs_readv()/vfs_writev()
+#define VFS_IOV_MAX                 1024
+// vfs_copy_file_range() buffer size for filesystems which can't copy
+// by themselves
+#define VFS_COPY_BUFSIZE            65536
+
+// Read-only view of cached file data returned by vfs_view(). The
+// contents change if the file is written to meanwhile
+struct vfs_view {
+    const void *data;
+    size_t length;
+    // Owned by the filesystem
+    void *priv;
+};
+
 // Internal VFS tree node
 struct vfs_node {
     char name[256];
@@ -65,13 +102,26 @@ int vfs_readlinkat(struct vfs_ioctx *ctx, vnode_t *at, const char *path, char *b
 int vfs_symlink(struct vfs_ioctx *ctx, const char *target, const char *linkpath);
 
 // File ops
-int vfs_truncate(struct vfs_ioctx *ctx, struct ofile *fd, size_t length);
+int vfs_truncate(struct vfs_ioctx *ctx, struct ofile *fd, off_t length);
+int vfs_fallocate(struct vfs_ioctx *ctx, struct ofile *fd, int mode, off_t offset, off_t length);
+ssize_t vfs_copy_file_range(struct vfs_ioctx *ctx, struct ofile *src, off_t *src_off,
+                            struct ofile *dst, off_t *dst_off, size_t count, int flags);
+int vfs_fsync(struct vfs_ioctx *ctx, struct ofile *fd);
+int vfs_fdatasync(struct vfs_ioctx *ctx, struct ofile *fd);
+int vfs_sync(struct vfs_ioctx *ctx);
 int vfs_creat(struct vfs_ioctx *ctx, struct ofile *fd, const char *path, int mode, int opt);
 int vfs_open(struct vfs_ioctx *ctx, struct ofile *fd, const char *path, int mode, int opt);
 int vfs_open_node(struct vfs_ioctx *ctx, struct ofile *fd, vnode_t *vn, int opt);
 void vfs_close(struct vfs_ioctx *ctx, struct ofile *fd);
 ssize_t vfs_read(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t count);
+ssize_t vfs_view(struct vfs_ioctx *ctx, struct ofile *fd, size_t count, struct vfs_view *view);
+void vfs_view_put(struct vfs_ioctx *ctx, struct ofile *fd, struct vfs_view *view);
 ssize_t vfs_write(struct vfs_ioctx *ctx, struct ofile *fd, const void *buf, size_t count);
+ssize_t vfs_pread(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t count, off_t offset);
+ssize_t vfs_pwrite(struct vfs_ioctx *ctx, struct ofile *fd, const void *buf, size_t count, off_t offset);
+ssize_t vfs_readv(struct vfs_ioctx *ctx, struct ofile *fd, const struct iovec *iov, int iovcnt);
+ssize_t vfs_writev(struct vfs_ioctx *ctx, struct ofile *fd, const struct iovec *iov, int iovcnt);
+off_t vfs_lseek(struct vfs_ioctx *ctx, struct ofile *fd, off_t offset, int whence);
 int vfs_unlink(struct vfs_ioctx *ctx, const char *path);
 
 int vfs_stat(struct vfs_ioctx *ctx, const char *path, struct stat *st);
@@ -82,5 +132,7 @@ int vfs_access(struct vfs_ioctx *ctx, const char *path, int mode);
 // Directroy ops
 int vfs_mkdir(struct vfs_ioctx *ctx, const char *path, mode_t mode);
 struct dirent *vfs_readdir(struct vfs_ioctx *ctx, struct ofile *fd);
+ssize_t vfs_getdents(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t count);
+ssize_t vfs_readdirplus(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t count);
 
 int vfs_statvfs(struct vfs_ioctx *ctx, const char *path, struct statvfs *st);
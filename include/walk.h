@@ -0,0 +1,42 @@
+#pragma once
+#include "vfs.h"
+
+// Call stat for every entry (uses readdirplus when available)
+#define VFS_WALK_STAT       (1 << 0)
+// Spread subdirectories across worker threads
+#define VFS_WALK_PARALLEL   (1 << 1)
+
+// Returned by a pre callback to not descend into a directory
+#define VFS_WALK_SKIP       1
+
+struct vfs_walk_ent {
+    // Path of the entry, starting with the walk root path
+    const char *path;
+    // Name of the entry inside its parent directory
+    const char *name;
+    // 0 for the walk root
+    int depth;
+    // DT_* type of the entry
+    unsigned char type;
+    // Only set when VFS_WALK_STAT is requested
+    const struct stat *st;
+};
+
+/**
+ * @brief Walk callback. Returning a negative value aborts the walk
+ *        and makes vfs_walk() return it.
+ *
+ * In VFS_WALK_PARALLEL mode callbacks are called concurrently from
+ * the worker threads.
+ */
+typedef int (*vfs_walk_fn) (const struct vfs_walk_ent *ent, void *arg);
+
+/**
+ * @brief Recursively walk the directory tree at path.
+ *
+ * pre is called for every entry before its children (if any), post
+ * is called for directories once all of their children are done.
+ * Symlinks are reported but not followed. Either callback may be NULL.
+ */
+int vfs_walk(struct vfs_ioctx *ctx, const char *path, int flags, int nthreads,
+             vfs_walk_fn pre, vfs_walk_fn post, void *arg);
@@ -3,7 +3,7 @@
 #include <assert.h>
 #include <errno.h>
 
-ssize_t blk_read(struct blkdev *blk, void *buf, size_t off, size_t lim) {
+ssize_t blk_read(struct blkdev *blk, void *buf, uint64_t off, size_t lim) {
     assert(blk);
 
     if (blk->read) {
@@ -13,7 +13,7 @@ ssize_t blk_read(struct blkdev *blk, void *buf, size_t off, size_t lim) {
     }
 }
 
-ssize_t blk_write(struct blkdev *blk, const void *buf, size_t off, size_t lim) {
+ssize_t blk_write(struct blkdev *blk, const void *buf, uint64_t off, size_t lim) {
     assert(blk);
 
     if (blk->write) {
@@ -22,3 +22,16 @@ ssize_t blk_write(struct blkdev *blk, const void *buf, size_t off, size_t lim) {
         return -EINVAL;
     }
 }
+
+// Writes issued before the flush are durable once it returns, so it
+// also orders them before any writes issued after it
+int blk_flush(struct blkdev *blk) {
+    assert(blk);
+
+    if (blk->flush) {
+        return blk->flush(blk);
+    } else {
+        // Nothing is cached by the device
+        return 0;
+    }
+}
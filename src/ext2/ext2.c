@@ -23,13 +23,126 @@ enum vnode_type ext2_inode_type(struct ext2_inode *i) {
     }
 }
 
+// Regular files keep the high half of their size in size_upper
+uint64_t ext2_inode_size(const struct ext2_inode *inode) {
+    if ((inode->type_perm & 0xF000) == EXT2_TYPE_REG) {
+        return inode->size_lower | ((uint64_t) inode->size_upper << 32);
+    }
+    return inode->size_lower;
+}
+
+// Set the size of a regular file. The first file reaching 2GiB marks
+// the fs as having large files, older drivers would truncate it
+int ext2_inode_set_size(fs_t *ext2, struct ext2_inode *inode, uint64_t size) {
+    struct ext2_extsb *sb = ext2->fs_private;
+    int res = 0;
+
+    if (size > sb->max_file_size) {
+        return -EFBIG;
+    }
+
+    if (size > INT32_MAX && !(sb->ro_required_features & EXT2_RO_LARGE_FILE)) {
+        pthread_mutex_lock(&sb->cache->meta_lock);
+        if (!(sb->ro_required_features & EXT2_RO_LARGE_FILE)) {
+            // Written right away: it must reach the disk before the inode
+            sb->ro_required_features |= EXT2_RO_LARGE_FILE;
+            if ((res = ext2_write_superblock(ext2)) < 0) {
+                sb->ro_required_features &= ~EXT2_RO_LARGE_FILE;
+            }
+        }
+        pthread_mutex_unlock(&sb->cache->meta_lock);
+
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    inode->size_lower = (uint32_t) size;
+    inode->size_upper = (uint32_t) (size >> 32);
+
+    return 0;
+}
+
+// Get the on-disk directory entry type indicator for a node type
+uint8_t ext2_dirent_type(fs_t *ext2, enum vnode_type type) {
+    struct ext2_extsb *sb = ext2->fs_private;
+
+    if (!(sb->required_features & EXT2_REQ_FILETYPE)) {
+        // The field is a part of name length then
+        return 0;
+    }
+
+    switch (type) {
+    case VN_REG:
+        return EXT2_FT_REG;
+    case VN_DIR:
+        return EXT2_FT_DIR;
+    case VN_LNK:
+        return EXT2_FT_LNK;
+    case VN_BLK:
+        return EXT2_FT_BLK;
+    case VN_CHR:
+        return EXT2_FT_CHR;
+    default:
+        return EXT2_FT_UNKNOWN;
+    }
+}
+
+// Get the d_type of a directory entry, DT_UNKNOWN if the fs does
+// not store entry types
+unsigned char ext2_dirent_dtype(fs_t *ext2, const struct ext2_dirent *ent) {
+    struct ext2_extsb *sb = ext2->fs_private;
+
+    if (!(sb->required_features & EXT2_REQ_FILETYPE)) {
+        return DT_UNKNOWN;
+    }
+
+    switch (ent->type_ind) {
+    case EXT2_FT_REG:
+        return DT_REG;
+    case EXT2_FT_DIR:
+        return DT_DIR;
+    case EXT2_FT_CHR:
+        return DT_CHR;
+    case EXT2_FT_BLK:
+        return DT_BLK;
+    case EXT2_FT_FIFO:
+        return DT_FIFO;
+    case EXT2_FT_SOCK:
+        return DT_SOCK;
+    case EXT2_FT_LNK:
+        return DT_LNK;
+    default:
+        return DT_UNKNOWN;
+    }
+}
+
+// Whether the comma-separated mount options include name
+static int ext2_opt_flag(const char *opt, const char *name) {
+    size_t name_len = strlen(name);
+
+    while (opt && *opt) {
+        size_t len = strcspn(opt, ",");
+
+        if (len == name_len && !strncmp(opt, name, len)) {
+            return 1;
+        }
+        opt += len;
+        if (*opt == ',') {
+            ++opt;
+        }
+    }
+
+    return 0;
+}
+
 static int ext2_fs_mount(fs_t *fs, const char *opt) {
     int res;
     printf("ext2_fs_mount()\n");
     struct ext2_extsb *sb = fs->fs_private;
 
     // ext2's private data is its superblock structure
-    sb = malloc(EXT2_SBSIZ);
+    sb = malloc(sizeof(struct ext2_extsb));
     fs->fs_private = sb;
 
     // Read the superblock from blkdev
@@ -53,66 +166,178 @@ static int ext2_fs_mount(fs_t *fs, const char *opt) {
         // Initialize params which are missing in non-extended sbs
         sb->inode_struct_size = 128;
         sb->first_non_reserved = 11;
+        sb->required_features = 0;
+        sb->ro_required_features = 0;
+    }
+
+    if (sb->required_features & ~EXT2_REQ_SUPPORTED) {
+        printf("ext2: unsupported required features: %08x\n", sb->required_features & ~EXT2_REQ_SUPPORTED);
+        free(sb);
+        return -EINVAL;
+    }
+    // Only read-write mounts exist
+    if (sb->ro_required_features & ~EXT2_RO_SUPPORTED) {
+        printf("ext2: unsupported read-only features: %08x\n", sb->ro_required_features & ~EXT2_RO_SUPPORTED);
+        free(sb);
+        return -EROFS;
     }
     sb->block_size = 1024 << sb->sb.block_size_log;
 
-    // Load block group descriptor table
-    // Get descriptor table size
-    uint32_t block_group_descriptor_table_length = sb->sb.block_count / sb->sb.block_group_size_blocks;
-    if (block_group_descriptor_table_length * sb->sb.block_group_size_blocks < sb->sb.block_count) {
-        ++block_group_descriptor_table_length;
+    if (sb->sb.version_major == 0) {
+        // Revision 0 has no size_upper
+        sb->max_file_size = INT32_MAX;
+    } else {
+        // Limited by the block map, by 32-bit block indices and by the
+        // sector count of the inode, which covers indirect blocks too
+        uint64_t ptrs = sb->block_size / 4;
+        uint64_t blocks = 12 + ptrs + ptrs * ptrs + ptrs * ptrs * ptrs;
+        uint64_t sector_blocks = UINT32_MAX / (sb->block_size / 512);
+
+        if (blocks > UINT32_MAX) {
+            blocks = UINT32_MAX;
+        }
+        if (blocks > sector_blocks - sector_blocks / ptrs - 3) {
+            blocks = sector_blocks - sector_blocks / ptrs - 3;
+        }
+        sb->max_file_size = blocks * sb->block_size;
     }
+
+    // Load block group descriptor table
+    // Get descriptor table size: groups start from the block holding
+    // the superblock
+    uint32_t block_group_descriptor_table_length = (sb->sb.block_count - sb->sb.sb_block_number +
+                                                    sb->sb.block_group_size_blocks - 1) /
+                                                   sb->sb.block_group_size_blocks;
     sb->block_group_count = block_group_descriptor_table_length;
 
-    uint32_t block_group_descriptor_table_size_blocks = 32 * block_group_descriptor_table_length /
-                                                        sb->block_size + 1;
+    uint32_t block_group_descriptor_table_size_blocks = (sizeof(struct ext2_grp_desc) * block_group_descriptor_table_length +
+                                                         sb->block_size - 1) / sb->block_size;
 
-    uint32_t block_group_descriptor_table_block = 2;
-    if (sb->block_size > 1024) {
-        block_group_descriptor_table_block = 1;
-    }
+    // The BGDT follows the superblock, meta_bg is not supported
+    uint32_t block_group_descriptor_table_block = sb->sb.sb_block_number + 1;
     sb->block_group_descriptor_table_block = block_group_descriptor_table_block;
     sb->block_group_descriptor_table_size_blocks = block_group_descriptor_table_size_blocks;
 
-    // Load all block group descriptors into memory
+    // Block group descriptors are loaded on demand, see ext2_group_desc()
     printf("Allocating %u bytes for BGDT\n", sb->block_group_descriptor_table_size_blocks * sb->block_size);
-    sb->block_group_descriptor_table = (struct ext2_grp_desc *) malloc(sb->block_group_descriptor_table_size_blocks * sb->block_size);
+    sb->block_group_descriptor_table = (struct ext2_grp_desc *) calloc(sb->block_group_descriptor_table_size_blocks, sb->block_size);
+    sb->bgdt_loaded = (atomic_uchar *) calloc(sb->block_group_descriptor_table_size_blocks, sizeof(atomic_uchar));
+    sb->journal = NULL;
 
-    for (size_t i = 0; i < sb->block_group_descriptor_table_size_blocks; ++i) {
-        ext2_read_block(fs, i + sb->block_group_descriptor_table_block,
-                        (void *) (((uintptr_t) sb->block_group_descriptor_table) + i * sb->block_size));
+    if (!sb->block_group_descriptor_table || !sb->bgdt_loaded) {
+        free(sb->block_group_descriptor_table);
+        free(sb->bgdt_loaded);
+        free(sb);
+        return -ENOMEM;
+    }
+
+    ext2_inode_info_init(fs);
+    sb->rsv_windows = NULL;
+    sb->fext = NULL;
+    if ((res = ext2_cache_init(fs)) < 0) {
+        free(sb->block_group_descriptor_table);
+        free(sb->bgdt_loaded);
+        free(sb);
+        return res;
+    }
+
+    // The root inode's descriptor is needed right away. The journal
+    // loads the one of its inode, and replays the journal if the fs
+    // was not unmounted cleanly
+    if ((res = ext2_bgdt_load(fs, (EXT2_ROOTINO - 1) / sb->sb.block_group_size_inodes *
+                                  sizeof(struct ext2_grp_desc) / sb->block_size)) < 0 ||
+        (res = ext2_journal_load(fs, opt)) < 0) {
+        ext2_cache_stop(fs);
+        ext2_cache_release(fs);
+        ext2_inode_info_release(fs);
+        free(sb->block_group_descriptor_table);
+        free(sb->bgdt_loaded);
+        free(sb);
+        return res;
+    }
+
+    // Orphans are freed once the journal is replayed
+    if ((res = ext2_orphan_init(fs)) < 0) {
+        ext2_cache_stop(fs);
+        ext2_journal_release(fs);
+        ext2_cache_release(fs);
+        ext2_inode_info_release(fs);
+        free(sb->block_group_descriptor_table);
+        free(sb->bgdt_loaded);
+        free(sb);
+        return res;
+    }
+
+    if (ext2_opt_flag(opt, "prefetch_bgdt")) {
+        ext2_cache_prefetch(fs);
     }
 
     return 0;
 }
 
+// Make everything written so far durable
+static int ext2_fs_sync(fs_t *fs) {
+    int res;
+
+    if ((res = ext2_cache_sync(fs)) < 0) {
+        return res;
+    }
+    // A commit flushes the device too
+    if ((res = ext2_journal_commit(fs)) != 0) {
+        return res < 0 ? res : 0;
+    }
+
+    return blk_flush(fs->blk);
+}
+
 static int ext2_fs_umount(fs_t *fs) {
     struct ext2_extsb *sb = (struct ext2_extsb *) fs->fs_private;
+    int res, err;
+
+    // File data is written back by the time the last vnode is gone,
+    // but for the write-backs which failed: they get a last try. The
+    // orphans are freed, the journal is emptied and the fs marked clean.
+    // The flusher stops first, it would start journal handles
+    ext2_orphan_release(fs);
+    ext2_cache_stop(fs);
+    res = ext2_cache_sync(fs);
+    if ((err = ext2_journal_release(fs)) < 0 && !res) {
+        res = err;
+    }
+    if (!res) {
+        res = blk_flush(fs->blk);
+    }
+    if (res < 0) {
+        fprintf(stderr, "ext2: failed to sync on umount\n");
+    }
+
+    ext2_fext_release(fs);
+    ext2_cache_release(fs);
+    ext2_inode_info_release(fs);
     // Free block group descriptor table
     free(sb->block_group_descriptor_table);
+    free(sb->bgdt_loaded);
     // Free superblock
     free(sb);
     return 0;
 }
 
 static vnode_t *ext2_fs_get_root(fs_t *fs) {
-    struct ext2_extsb *sb = fs->fs_private;
     printf("ext2_fs_get_root()\n");
 
-    struct ext2_inode *inode = (struct ext2_inode *) malloc(sb->inode_struct_size);
     // Read root inode (2)
-    if (ext2_read_inode(fs, inode, EXT2_ROOTINO) != 0) {
-        free(inode);
+    struct ext2_inode_info *info = ext2_inode_info_get(fs, EXT2_ROOTINO);
+    if (!info) {
         return NULL;
     }
 
     vnode_t *res = (vnode_t *) malloc(sizeof(vnode_t));
 
     res->fs = fs;
-    res->fs_data = inode;
+    res->fs_data = info;
     res->fs_number = EXT2_ROOTINO;
     res->op = &ext2_vnode_ops;
-    res->type = ext2_inode_type(inode);
+    res->type = ext2_inode_type(info->inode);
 
     return res;
 }
@@ -121,11 +346,11 @@ static int ext2_fs_statvfs(fs_t *fs, struct statvfs *st) {
     struct ext2_extsb *sb = fs->fs_private;
 
     st->f_blocks = sb->sb.block_count;
-    st->f_bfree = sb->sb.free_block_count;
+    st->f_bfree = ext2_free_blocks_count(fs);
     st->f_bavail = sb->sb.block_count - sb->sb.su_reserved;
 
     st->f_files = sb->sb.inode_count;
-    st->f_ffree = sb->sb.free_inode_count;
+    st->f_ffree = ext2_free_inodes_count(fs);
     st->f_favail = sb->sb.inode_count - sb->first_non_reserved + 1;
 
     st->f_bsize = sb->block_size;
@@ -145,6 +370,7 @@ static struct fs_class ext2_class = {
     .get_root = ext2_fs_get_root,
     .mount = ext2_fs_mount,
     .umount = ext2_fs_umount,
+    .sync = ext2_fs_sync,
     .statvfs = ext2_fs_statvfs
 };
 
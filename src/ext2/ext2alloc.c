@@ -3,315 +3,1406 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <stdio.h>
 
-int ext2_alloc_block(fs_t *ext2, uint32_t *block_no) {
+#define MIN(x, y) ((x) > (y) ? (y) : (x))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+void ext2_group_lock(fs_t *ext2, uint32_t group_no) {
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
-    char block_buffer[sb->block_size];
-    uint32_t res_block_no = 0;
-    uint32_t res_group_no = 0;
-    uint32_t res_block_no_in_group = 0;
-    int found = 0;
-    int res;
+    pthread_mutex_lock(&sb->cache->group_locks[group_no % EXT2_GROUP_LOCKS]);
+}
 
-    for (size_t i = 0; i < sb->block_group_count; ++i) {
-        if (sb->block_group_descriptor_table[i].free_blocks > 0) {
-            // Found a free block here
-            printf("Allocating a block in group #%zu\n", i);
+void ext2_group_unlock(fs_t *ext2, uint32_t group_no) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    pthread_mutex_unlock(&sb->cache->group_locks[group_no % EXT2_GROUP_LOCKS]);
+}
 
-            if ((res = ext2_read_block(ext2,
-                                       sb->block_group_descriptor_table[i].block_usage_bitmap_block,
-                                       block_buffer)) < 0) {
-                return res;
-            }
+// Threads get a slot the first time they allocate, round robin
+static atomic_uint ext2_next_slot;
+static __thread int ext2_slot = -1;
+
+static struct ext2_alloc_slot *ext2_alloc_slot(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    if (ext2_slot < 0) {
+        ext2_slot = atomic_fetch_add_explicit(&ext2_next_slot, 1, memory_order_relaxed) % EXT2_ALLOC_SLOTS;
+    }
+    return &sb->cache->slots[ext2_slot];
+}
+
+// The free counts of the superblock and the directory count are only
+// changed through the slots, so that allocating threads don't all write
+// the same cache line. Done under the lock of the group changed
+static void ext2_counts_add(fs_t *ext2, long blocks, long inodes, long dirs) {
+    struct ext2_alloc_slot *slot = ext2_alloc_slot(ext2);
+
+    if (blocks) {
+        atomic_fetch_add_explicit(&slot->free_blocks, blocks, memory_order_relaxed);
+    }
+    if (inodes) {
+        atomic_fetch_add_explicit(&slot->free_inodes, inodes, memory_order_relaxed);
+    }
+    if (dirs) {
+        atomic_fetch_add_explicit(&slot->dirs, dirs, memory_order_relaxed);
+    }
+}
+
+// Move the changes of the slots into the superblock. The caller holds
+// meta_lock and all the group locks
+void ext2_counts_fold(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    for (size_t i = 0; i < EXT2_ALLOC_SLOTS; ++i) {
+        sb->sb.free_block_count += atomic_exchange_explicit(&sb->cache->slots[i].free_blocks, 0,
+                                                            memory_order_relaxed);
+        sb->sb.free_inode_count += atomic_exchange_explicit(&sb->cache->slots[i].free_inodes, 0,
+                                                            memory_order_relaxed);
+    }
+}
+
+// Current free counts, approximate while allocations are running.
+// meta_lock keeps ext2_counts_fold() from moving a change between the
+// slots and the superblock while they are added up
+uint32_t ext2_free_blocks_count(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int64_t count;
+
+    pthread_mutex_lock(&sb->cache->meta_lock);
+    count = sb->sb.free_block_count;
+    for (size_t i = 0; i < EXT2_ALLOC_SLOTS; ++i) {
+        count += atomic_load_explicit(&sb->cache->slots[i].free_blocks, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&sb->cache->meta_lock);
+    return count < 0 ? 0 : (uint32_t) count;
+}
 
-            for (size_t j = 0; j < sb->block_size / sizeof(uint64_t); ++j) {
-                uint64_t qw = ((uint64_t *) block_buffer)[j];
-                if (qw != (uint64_t) -1) {
-                    for (size_t k = 0; k < 64; ++k) {
-                        if (!(qw & (1 << k))) {
-                            res_block_no_in_group = k + j * 64;
-                            res_group_no = i;
-                            // XXX: had to increment the resulting block_no
-                            //      because for some reason linux's ext2
-                            //      impl hasn't marked #531 as used in one
-                            //      case, but it was actually a L1-indirect
-                            //      block. So I just had to make it allocate
-                            //      #532 instead as a workaround (though
-                            //      block numbering should start with 0)
-                            res_block_no = res_block_no_in_group + i * sb->sb.block_group_size_blocks + 1;
-                            found = 1;
-                            break;
-                        }
-                    }
-
-                    if (found) {
-                        break;
-                    }
+uint32_t ext2_free_inodes_count(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int64_t count;
+
+    pthread_mutex_lock(&sb->cache->meta_lock);
+    count = sb->sb.free_inode_count;
+    for (size_t i = 0; i < EXT2_ALLOC_SLOTS; ++i) {
+        count += atomic_load_explicit(&sb->cache->slots[i].free_inodes, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&sb->cache->meta_lock);
+    return count < 0 ? 0 : (uint32_t) count;
+}
+
+// Directories in all the groups, approximate while allocations are
+// running. The first call sums up the BGDT with all the group locks
+// held, so that no change is counted twice
+static int ext2_dirs_count(fs_t *ext2, uint32_t *count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_cache *cache = sb->cache;
+    int64_t dirs;
+    int res = 0;
+
+    if (!atomic_load_explicit(&cache->dirs_loaded, memory_order_acquire)) {
+        for (uint32_t i = 0; i < EXT2_GROUP_LOCKS; ++i) {
+            ext2_group_lock(ext2, i);
+        }
+        if (!atomic_load_explicit(&cache->dirs_loaded, memory_order_relaxed)) {
+            struct ext2_grp_desc *desc;
+
+            dirs = 0;
+            for (uint32_t i = 0; i < sb->block_group_count && res >= 0; ++i) {
+                if ((res = ext2_group_desc(ext2, i, &desc)) >= 0) {
+                    dirs += desc->dir_count;
                 }
             }
-            if (found) {
-                break;
+            for (size_t i = 0; i < EXT2_ALLOC_SLOTS; ++i) {
+                dirs -= atomic_load_explicit(&cache->slots[i].dirs, memory_order_relaxed);
             }
+            if (res >= 0) {
+                cache->dirs_base = dirs;
+                atomic_store_explicit(&cache->dirs_loaded, 1, memory_order_release);
+            }
+        }
+        for (uint32_t i = 0; i < EXT2_GROUP_LOCKS; ++i) {
+            ext2_group_unlock(ext2, i);
+        }
+        if (res < 0) {
+            return res;
         }
     }
 
-    if (!found) {
-        return -ENOSPC;
+    dirs = cache->dirs_base;
+    for (size_t i = 0; i < EXT2_ALLOC_SLOTS; ++i) {
+        dirs += atomic_load_explicit(&cache->slots[i].dirs, memory_order_relaxed);
     }
+    *count = dirs < 0 ? 0 : (uint32_t) dirs;
+    return 0;
+}
+
+// First block at or after block_no not reserved by a window other
+// than own. The caller holds rsv_lock
+static uint32_t ext2_rsv_skip(struct ext2_extsb *sb, const struct ext2_rsv_window *own, uint32_t block_no) {
+    for (struct ext2_rsv_window *w = sb->rsv_windows; w && w->start <= block_no; w = w->next) {
+        if (w != own && block_no <= w->end) {
+            block_no = w->end + 1;
+        }
+    }
+    return block_no;
+}
+
+// Number of blocks in the block group
+uint32_t ext2_group_blocks(struct ext2_extsb *sb, uint32_t group) {
+    // The last group may be shorter than the others
+    if (group == sb->block_group_count - 1) {
+        return sb->sb.block_count - sb->sb.sb_block_number - group * sb->sb.block_group_size_blocks;
+    }
+    return sb->sb.block_group_size_blocks;
+}
+
+#define ext2_bit_test(bitmap, bit)  (((uint64_t *) (bitmap))[(bit) / 64] & (1ULL << ((bit) % 64)))
+
+// With flex_bg, the bitmaps of a flex group are usually packed
+// together, block bitmaps followed by inode bitmaps: read all of them
+// with one request when one is needed. The caller holds the group lock
+static void ext2_group_readahead(fs_t *ext2, uint32_t group_no, int inodes) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
 
-    // Write block usage bitmap
-    ((uint64_t *) block_buffer)[res_block_no_in_group / 64] |= (1 << (res_block_no_in_group % 64));
-    if ((res = ext2_write_block(ext2,
-                                sb->block_group_descriptor_table[res_group_no].block_usage_bitmap_block,
-                                block_buffer)) < 0) {
+    if (!(sb->required_features & EXT2_REQ_FLEX_BG) || sb->log_groups_per_flex > 16) {
+        return;
+    }
+
+    uint32_t flex = 1u << sb->log_groups_per_flex;
+    if (flex > EXT2_META_RA_MAX / 2) {
+        flex = EXT2_META_RA_MAX / 2;
+    }
+    uint32_t first = group_no & ~(flex - 1);
+    uint32_t n = sb->block_group_count - first < flex ? sb->block_group_count - first : flex;
+    struct ext2_grp_desc *desc;
+
+    // Only a hint: the reads that follow report the errors
+    if (ext2_group_desc(ext2, first, &desc) < 0) {
+        return;
+    }
+    uint32_t bb = desc->block_usage_bitmap_block;
+    uint32_t ib = desc->inode_usage_bitmap_block;
+    int bb_run = 1, ib_run = 1;
+
+    for (uint32_t i = 1; i < n; ++i) {
+        if (ext2_group_desc(ext2, first + i, &desc) < 0) {
+            return;
+        }
+        bb_run &= desc->block_usage_bitmap_block == bb + i;
+        ib_run &= desc->inode_usage_bitmap_block == ib + i;
+    }
+
+    if (bb_run && ib_run && ib == bb + n) {
+        ext2_meta_readahead(ext2, bb, 2 * n);
+    } else if (!inodes && bb_run) {
+        ext2_meta_readahead(ext2, bb, n);
+    } else if (inodes && ib_run) {
+        ext2_meta_readahead(ext2, ib, n);
+    }
+}
+
+// Read the block bitmap of the group for allocating from it: the blocks
+// freed by the running transaction of the journal show up as used
+int ext2_read_block_bitmap(fs_t *ext2, uint32_t group_no, char *bitmap_block) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_grp_desc *desc;
+    int res;
+
+    ext2_group_readahead(ext2, group_no, 0);
+    if ((res = ext2_group_desc(ext2, group_no, &desc)) < 0 ||
+        (res = ext2_read_block(ext2, desc->block_usage_bitmap_block, bitmap_block)) < 0) {
         return res;
     }
+    ext2_journal_mask_freed(ext2, group_no * sb->sb.block_group_size_blocks + sb->sb.sb_block_number,
+                            ext2_group_blocks(sb, group_no), bitmap_block, 1);
 
-    // Update BGDT
-    --sb->block_group_descriptor_table[res_group_no].free_blocks;
-    for (size_t i = 0; i < sb->block_group_descriptor_table_size_blocks; ++i) {
-        void *blk_ptr = (void *) (((uintptr_t) sb->block_group_descriptor_table) + i * sb->block_size);
+    return 0;
+}
 
-        if ((res = ext2_write_block(ext2, sb->block_group_descriptor_table_block + i, blk_ptr)) < 0) {
+// Find the first free block starting from goal which is not reserved by
+// somebody else's window. On success the group's lock is held and its
+// bitmap left in bitmap_block
+static int ext2_find_free_block(fs_t *ext2, uint32_t goal, const struct ext2_rsv_window *own,
+                                char *bitmap_block, uint32_t *group_no, uint32_t *bit_no) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t bpg = sb->sb.block_group_size_blocks;
+    int res;
+
+    if (goal < sb->sb.sb_block_number || goal >= sb->sb.block_count) {
+        goal = sb->sb.sb_block_number;
+    }
+    uint32_t goal_group = (goal - sb->sb.sb_block_number) / bpg;
+
+    // Look in the goal's group first, then wrap around
+    for (size_t n = 0; n <= sb->block_group_count; ++n) {
+        size_t i = (goal_group + n) % sb->block_group_count;
+        uint32_t base = i * bpg + sb->sb.sb_block_number;
+        uint32_t limit = ext2_group_blocks(sb, i);
+        uint32_t start = 0;
+        struct ext2_grp_desc *desc;
+
+        // Checked before taking the lock, the bitmap has the last word
+        if ((res = ext2_group_desc(ext2, i, &desc)) < 0) {
+            return res;
+        }
+        if (!desc->free_blocks) {
+            continue;
+        }
+        if (n == 0) {
+            start = goal - base;
+        }
+
+        ext2_group_lock(ext2, i);
+        if ((res = ext2_read_block_bitmap(ext2, i, bitmap_block)) < 0) {
+            ext2_group_unlock(ext2, i);
             return res;
         }
+
+        pthread_mutex_lock(&sb->cache->rsv_lock);
+        for (uint32_t bit = start; bit < limit; ++bit) {
+            if (((uint64_t *) bitmap_block)[bit / 64] == (uint64_t) -1) {
+                // Skip the rest of a full qword
+                bit |= 63;
+                continue;
+            }
+            if (ext2_bit_test(bitmap_block, bit)) {
+                continue;
+            }
+
+            uint32_t next = ext2_rsv_skip(sb, own, base + bit);
+            if (next != base + bit) {
+                bit = next - base - 1;
+                continue;
+            }
+
+            pthread_mutex_unlock(&sb->cache->rsv_lock);
+            *group_no = i;
+            *bit_no = bit;
+            return 0;
+        }
+        pthread_mutex_unlock(&sb->cache->rsv_lock);
+        ext2_group_unlock(ext2, i);
     }
 
-    // Update global block count and flush superblock
-    --sb->sb.free_block_count;
-    if ((res = ext2_write_superblock(ext2)) < 0) {
+    return -ENOSPC;
+}
+
+// Mark count blocks starting from bit as used in the group's bitmap
+// and update the free counts. The caller holds the group lock
+static int ext2_claim_blocks(fs_t *ext2, uint32_t group_no, char *bitmap_block, uint32_t bit, uint32_t count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_grp_desc *desc;
+    int res;
+
+    if ((res = ext2_group_desc(ext2, group_no, &desc)) < 0) {
         return res;
     }
 
-    *block_no = res_block_no;
-    printf("Allocated block #%u\n", res_block_no);
+    printf("Allocating %u block(s) in group #%u\n", count, group_no);
+
+    // Write block usage bitmap, as it is without the blocks masked by
+    // ext2_read_block_bitmap()
+    ext2_journal_mask_freed(ext2, group_no * sb->sb.block_group_size_blocks + sb->sb.sb_block_number,
+                            ext2_group_blocks(sb, group_no), bitmap_block, 0);
+    for (uint32_t k = bit; k < bit + count; ++k) {
+        ((uint64_t *) bitmap_block)[k / 64] |= (1ULL << (k % 64));
+    }
+    if ((res = ext2_write_block(ext2, desc->block_usage_bitmap_block, bitmap_block)) < 0) {
+        return res;
+    }
+
+    // Update BGDT and global block count, these are written back later
+    desc->free_blocks -= count;
+    ext2_counts_add(ext2, -(long) count, 0, 0);
+    ext2_meta_dirty(ext2);
+
+    ext2_fext_remove(ext2, group_no * sb->sb.block_group_size_blocks + sb->sb.sb_block_number + bit, count);
     return 0;
 }
 
-int ext2_free_block(fs_t *ext2, uint32_t block_no) {
-    assert(block_no);
+// Allocate up to count contiguous blocks, looking for the first free
+// block starting from goal. Large runs start where the free extent index
+// finds enough room instead of at the first free block. Without a goal,
+// the search starts from the group the thread's slot used last, so
+// threads don't all fight over the first groups. The run never crosses
+// a block group or a reservation window
+int ext2_alloc_blocks(fs_t *ext2, uint32_t goal, uint32_t count, uint32_t *block_no, uint32_t *got) {
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_alloc_slot *slot = NULL;
     char block_buffer[sb->block_size];
+    uint32_t group_no, bit, run = 0;
     int res;
 
-    uint32_t block_group_no = (block_no - 1) / sb->sb.block_group_size_blocks;
-    uint32_t block_no_in_group = (block_no - 1) % sb->sb.block_group_size_blocks;
+    assert(count);
+    if (goal < sb->sb.sb_block_number || goal >= sb->sb.block_count) {
+        slot = ext2_alloc_slot(ext2);
+        goal = atomic_load_explicit(&slot->group, memory_order_relaxed) % sb->block_group_count *
+               sb->sb.block_group_size_blocks + sb->sb.sb_block_number;
+    }
+    if (count >= EXT2_FEXT_MIN_COUNT) {
+        // Left as it is if the index can't tell
+        ext2_fext_goal(ext2, goal, count, &goal);
+    }
+    if ((res = ext2_find_free_block(ext2, goal, NULL, block_buffer, &group_no, &bit)) < 0) {
+        return res;
+    }
+
+    uint32_t base = group_no * sb->sb.block_group_size_blocks + sb->sb.sb_block_number;
+    uint32_t limit = ext2_group_blocks(sb, group_no);
+    pthread_mutex_lock(&sb->cache->rsv_lock);
+    while (run < count && bit + run < limit &&
+           !ext2_bit_test(block_buffer, bit + run) &&
+           ext2_rsv_skip(sb, NULL, base + bit + run) == base + bit + run) {
+        ++run;
+    }
+    pthread_mutex_unlock(&sb->cache->rsv_lock);
 
-    // Read block ussge bitmap block
-    if ((res = ext2_read_block(ext2,
-                               sb->block_group_descriptor_table[block_group_no].block_usage_bitmap_block,
-                               block_buffer)) < 0) {
+    res = ext2_claim_blocks(ext2, group_no, block_buffer, bit, run);
+    ext2_group_unlock(ext2, group_no);
+    if (res < 0) {
         return res;
     }
+    if (slot) {
+        atomic_store_explicit(&slot->group, group_no, memory_order_relaxed);
+    }
 
-    // Update the bitmap
-    assert(((uint64_t *) block_buffer)[block_no_in_group / 64] & (1 << (block_no_in_group % 64)));
-    ((uint64_t *) block_buffer)[block_no_in_group / 64] &= ~(1 << (block_no_in_group % 64));
+    // Bitmap bits are relative to the first data block
+    *block_no = base + bit;
+    *got = run;
+    printf("Allocated blocks #%u..#%u\n", *block_no, *block_no + run - 1);
+    return 0;
+}
 
-    if ((res = ext2_write_block(ext2,
-                                sb->block_group_descriptor_table[block_group_no].block_usage_bitmap_block,
-                                block_buffer)) < 0) {
+// The caller holds rsv_lock
+static void ext2_rsv_discard_unlocked(fs_t *ext2, struct ext2_rsv_window *rsv) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    if (!rsv->start) {
+        return;
+    }
+
+    if (sb->rsv_windows == rsv) {
+        sb->rsv_windows = rsv->next;
+    } else {
+        struct ext2_rsv_window *prev = sb->rsv_windows;
+        while (prev->next != rsv) {
+            prev = prev->next;
+        }
+        prev->next = rsv->next;
+    }
+
+    rsv->start = 0;
+    rsv->end = 0;
+    rsv->next = NULL;
+}
+
+// Place a new window at the first free block after goal, or where the
+// free extent index finds room for a large one. On success the group's
+// lock is held as with ext2_find_free_block()
+static int ext2_rsv_new_window(fs_t *ext2, struct ext2_rsv_window *rsv, uint32_t goal, uint32_t count,
+                               char *bitmap_block, uint32_t *group_no, uint32_t *bit_no) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_rsv_window *prev = NULL, *next;
+    uint32_t want = rsv->size > count ? rsv->size : count;
+    int res;
+
+    if (want >= EXT2_FEXT_MIN_COUNT) {
+        ext2_fext_goal(ext2, goal, want, &goal);
+    }
+    if ((res = ext2_find_free_block(ext2, goal, rsv, bitmap_block, group_no, bit_no)) < 0) {
         return res;
     }
 
-    // Update BGDT
-    ++sb->block_group_descriptor_table[block_group_no].free_blocks;
-    for (size_t i = 0; i < sb->block_group_descriptor_table_size_blocks; ++i) {
-        void *blk_ptr = (void *) (((uintptr_t) sb->block_group_descriptor_table) + i * sb->block_size);
+    uint32_t base = *group_no * sb->sb.block_group_size_blocks + sb->sb.sb_block_number;
+    if (!rsv->size) {
+        rsv->size = EXT2_RSV_DEFAULT_WINDOW;
+    }
 
-        if ((res = ext2_write_block(ext2, sb->block_group_descriptor_table_block + i, blk_ptr)) < 0) {
+    pthread_mutex_lock(&sb->cache->rsv_lock);
+    rsv->start = base + *bit_no;
+    rsv->end = rsv->start + (rsv->size > count ? rsv->size : count) - 1;
+    if (rsv->end >= base + ext2_group_blocks(sb, *group_no)) {
+        rsv->end = base + ext2_group_blocks(sb, *group_no) - 1;
+    }
+
+    // Insert, stopping short of the next window
+    for (next = sb->rsv_windows; next && next->start < rsv->start; prev = next, next = next->next);
+    if (next && next->start <= rsv->end) {
+        rsv->end = next->start - 1;
+    }
+    rsv->next = next;
+    if (prev) {
+        prev->next = rsv;
+    } else {
+        sb->rsv_windows = rsv;
+    }
+    pthread_mutex_unlock(&sb->cache->rsv_lock);
+
+    return 0;
+}
+
+// Allocate up to count blocks from the inode's reservation window,
+// moving the window if the goal is outside of it or it has no free
+// blocks left. Only the inode's writer changes its window
+int ext2_rsv_alloc_blocks(fs_t *ext2, struct ext2_rsv_window *rsv, uint32_t goal, uint32_t count,
+                          uint32_t *block_no, uint32_t *got) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    char block_buffer[sb->block_size];
+    uint32_t bpg = sb->sb.block_group_size_blocks;
+    uint32_t group_no, bit, end, run = 0;
+    int res;
+
+    assert(count);
+    pthread_mutex_lock(&sb->cache->rsv_lock);
+    if (rsv->start && goal == rsv->end + 1) {
+        // Sequential writer went past its window, the next one will be larger
+        ext2_rsv_discard_unlocked(ext2, rsv);
+        if (rsv->size < EXT2_RSV_MAX_WINDOW) {
+            rsv->size *= 2;
+        }
+    } else if (rsv->start && (goal < rsv->start || goal > rsv->end)) {
+        // Writing somewhere else now
+        ext2_rsv_discard_unlocked(ext2, rsv);
+    }
+    pthread_mutex_unlock(&sb->cache->rsv_lock);
+
+    if (rsv->start) {
+        group_no = (rsv->start - sb->sb.sb_block_number) / bpg;
+        uint32_t base = group_no * bpg + sb->sb.sb_block_number;
+
+        ext2_group_lock(ext2, group_no);
+        if ((res = ext2_read_block_bitmap(ext2, group_no, block_buffer)) < 0) {
+            ext2_group_unlock(ext2, group_no);
             return res;
         }
+
+        for (bit = goal - base; bit <= rsv->end - base; ++bit) {
+            if (!ext2_bit_test(block_buffer, bit)) {
+                break;
+            }
+        }
+
+        if (bit > rsv->end - base) {
+            // The window is used up, the next one will be larger
+            ext2_group_unlock(ext2, group_no);
+            pthread_mutex_lock(&sb->cache->rsv_lock);
+            ext2_rsv_discard_unlocked(ext2, rsv);
+            pthread_mutex_unlock(&sb->cache->rsv_lock);
+            if (rsv->size < EXT2_RSV_MAX_WINDOW) {
+                rsv->size *= 2;
+            }
+        }
     }
 
-    // Update global block count
-    ++sb->sb.free_block_count;
-    if ((res = ext2_write_superblock(ext2)) < 0) {
+    if (!rsv->start && (res = ext2_rsv_new_window(ext2, rsv, goal, count, block_buffer, &group_no, &bit)) < 0) {
         return res;
     }
 
-    printf("Freed block #%u\n", block_no);
+    // Take as much of the window as possible
+    end = rsv->end - (group_no * bpg + sb->sb.sb_block_number);
+    while (run < count && bit + run <= end && !ext2_bit_test(block_buffer, bit + run)) {
+        ++run;
+    }
+
+    res = ext2_claim_blocks(ext2, group_no, block_buffer, bit, run);
+    ext2_group_unlock(ext2, group_no);
+    if (res < 0) {
+        return res;
+    }
+
+    *block_no = group_no * bpg + sb->sb.sb_block_number + bit;
+    *got = run;
+    printf("Allocated blocks #%u..#%u\n", *block_no, *block_no + run - 1);
+    return 0;
+}
+
+void ext2_rsv_discard(fs_t *ext2, struct ext2_rsv_window *rsv) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    pthread_mutex_lock(&sb->cache->rsv_lock);
+    ext2_rsv_discard_unlocked(ext2, rsv);
+    pthread_mutex_unlock(&sb->cache->rsv_lock);
+}
+
+int ext2_alloc_block(fs_t *ext2, uint32_t *block_no) {
+    uint32_t got;
+    return ext2_alloc_blocks(ext2, 0, 1, block_no, &got);
+}
+
+// Free the runs of blocks, sorted and all in group_no: its bitmap is
+// read and written once
+static int ext2_free_group_runs(fs_t *ext2, uint32_t group_no, const struct ext2_freed_run *runs, size_t nruns) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_grp_desc *desc;
+    char block_buffer[sb->block_size];
+    uint32_t base = group_no * sb->sb.block_group_size_blocks + sb->sb.sb_block_number;
+    uint32_t total = 0;
+    int res;
+
+    ext2_group_lock(ext2, group_no);
+    if ((res = ext2_group_desc(ext2, group_no, &desc)) < 0) {
+        goto out;
+    }
+
+    // Read block usage bitmap block
+    ext2_group_readahead(ext2, group_no, 0);
+    if ((res = ext2_read_block(ext2, desc->block_usage_bitmap_block, block_buffer)) < 0) {
+        goto out;
+    }
+
+    // Update the bitmap
+    for (size_t i = 0; i < nruns; ++i) {
+        for (uint32_t bit = runs[i].start - base; bit < runs[i].start - base + runs[i].count; ++bit) {
+            assert(((uint64_t *) block_buffer)[bit / 64] & (1ULL << (bit % 64)));
+            ((uint64_t *) block_buffer)[bit / 64] &= ~(1ULL << (bit % 64));
+        }
+        total += runs[i].count;
+    }
+
+    if ((res = ext2_write_block(ext2, desc->block_usage_bitmap_block, block_buffer)) < 0) {
+        goto out;
+    }
+
+    // Update BGDT and global block count
+    desc->free_blocks += total;
+    ext2_counts_add(ext2, total, 0, 0);
+    ext2_meta_dirty(ext2);
+
+    res = 0;
+    for (size_t i = 0; i < nruns && res == 0; ++i) {
+        printf("Freed %u blocks from #%u\n", runs[i].count, runs[i].start);
+
+        // With a journal, the blocks are only reusable once the
+        // transaction commits, see ext2_journal_drop_freed()
+        if (!sb->journal) {
+            ext2_fext_insert(ext2, runs[i].start, runs[i].count);
+        }
+        res = ext2_journal_forget(ext2, runs[i].start, runs[i].count);
+    }
+
+out:
+    ext2_group_unlock(ext2, group_no);
+    return res;
+}
+
+int ext2_free_block(fs_t *ext2, uint32_t block_no) {
+    assert(block_no);
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_freed_run run = { block_no, 1 };
+
+    return ext2_free_group_runs(ext2, (block_no - sb->sb.sb_block_number) / sb->sb.block_group_size_blocks, &run, 1);
+}
+
+// Add count blocks from start to the batch, extending the last run if
+// they follow it
+int ext2_free_batch_add(fs_t *ext2, struct ext2_free_batch *batch, uint32_t start, uint32_t count) {
+    assert(start);
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t bpg = sb->sb.block_group_size_blocks;
+
+    while (count) {
+        uint32_t off = (start - sb->sb.sb_block_number) % bpg;
+        uint32_t n = count < bpg - off ? count : bpg - off;
+        struct ext2_freed_run *last = batch->count ? &batch->runs[batch->count - 1] : NULL;
+
+        if (last && off && last->start + last->count == start) {
+            last->count += n;
+        } else {
+            if (batch->count == batch->cap) {
+                size_t cap = batch->cap ? batch->cap * 2 : 64;
+                struct ext2_freed_run *runs = realloc(batch->runs, cap * sizeof(struct ext2_freed_run));
+
+                if (!runs) {
+                    return -ENOMEM;
+                }
+                batch->runs = runs;
+                batch->cap = cap;
+            }
+            batch->runs[batch->count].start = start;
+            batch->runs[batch->count].count = n;
+            ++batch->count;
+        }
+
+        start += n;
+        count -= n;
+    }
 
     return 0;
 }
 
-int ext2_inode_alloc_block(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index) {
-    if (index >= 12) {
-        fprintf(stderr, "Not implemented\n");
-        abort();
+static int ext2_freed_run_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct ext2_freed_run *) a)->start;
+    uint32_t y = ((const struct ext2_freed_run *) b)->start;
+
+    return x < y ? -1 : x > y;
+}
+
+// Free the blocks of the batch, one group at a time, and empty it
+int ext2_free_batch_apply(fs_t *ext2, struct ext2_free_batch *batch) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_freed_run *runs = batch->runs;
+    size_t nruns = 0;
+    int res = 0;
+
+    // Sorted, adjacent runs of a group merge
+    qsort(runs, batch->count, sizeof(struct ext2_freed_run), ext2_freed_run_cmp);
+    for (size_t i = 0; i < batch->count; ++i) {
+        if (nruns && runs[nruns - 1].start + runs[nruns - 1].count == runs[i].start &&
+            (runs[i].start - sb->sb.sb_block_number) % sb->sb.block_group_size_blocks) {
+            runs[nruns - 1].count += runs[i].count;
+        } else {
+            runs[nruns++] = runs[i];
+        }
+    }
+
+    for (size_t i = 0; i < nruns && res == 0;) {
+        uint32_t group_no = (runs[i].start - sb->sb.sb_block_number) / sb->sb.block_group_size_blocks;
+        size_t j = i + 1;
+
+        while (j < nruns && (runs[j].start - sb->sb.sb_block_number) / sb->sb.block_group_size_blocks == group_no) {
+            ++j;
+        }
+        res = ext2_free_group_runs(ext2, group_no, &runs[i], j - i);
+        i = j;
     }
 
+    batch->count = 0;
+    return res;
+}
+
+// Put block_no into the block map of the inode at index, allocating
+// the indirect blocks needed to reach it. On failure the indirect
+// blocks allocated here are unlinked and freed again. The inode is not
+// written
+int ext2_inode_map_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t block_no) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t *ptrs = ext2_inode_block_ptrs(inode);
+    uint32_t table[sb->block_size / 4];
+    uint32_t offsets[4];
+    uint32_t block, new_block;
+    // Indirect blocks allocated so far. Only the first one is linked from
+    // a table which was there before, link_block, 0 for the inode
+    uint32_t fresh_blocks[3];
+    uint32_t link_block = 0, link_off = 0;
+    int depth, fresh = 0, nfresh = 0;
     int res;
-    uint32_t block_no;
 
-    // Allocate the block itself
-    if ((res = ext2_alloc_block(ext2, &block_no)) < 0) {
+    if (ext2_inode_extents(inode)) {
+        return ext2_ext_map_blocks(ext2, inode, index, block_no, 1, 0);
+    }
+
+    if ((depth = ext2_block_map_path(ext2, index, offsets)) < 0) {
+        return depth;
+    }
+
+    if (!depth) {
+        ptrs[offsets[0]] = block_no;
+        return 0;
+    }
+
+    if (!(block = ptrs[offsets[0]])) {
+        if ((res = ext2_alloc_block(ext2, &block)) < 0) {
+            return res;
+        }
+        ptrs[offsets[0]] = block;
+        inode->disk_sector_count += sb->block_size / 512;
+        link_off = offsets[0];
+        fresh_blocks[nfresh++] = block;
+        fresh = 1;
+    }
+
+    // Walk down the indirect blocks, allocating the missing ones
+    for (int i = 1; i <= depth; ++i) {
+        if (fresh) {
+            memset(table, 0, sb->block_size);
+        } else if ((res = ext2_read_block(ext2, block, table)) < 0) {
+            goto fail;
+        }
+
+        if (i == depth) {
+            new_block = block_no;
+            fresh = 0;
+        } else if ((new_block = table[offsets[i]])) {
+            fresh = 0;
+        } else {
+            if ((res = ext2_alloc_block(ext2, &new_block)) < 0) {
+                goto fail;
+            }
+            inode->disk_sector_count += sb->block_size / 512;
+            if (!nfresh) {
+                link_block = block;
+                link_off = offsets[i];
+            }
+            fresh_blocks[nfresh++] = new_block;
+            fresh = 1;
+        }
+
+        // Freshly allocated tables have to be written even if nothing
+        // was added to them, there's garbage on the disk otherwise
+        if (table[offsets[i]] != new_block || fresh) {
+            table[offsets[i]] = new_block;
+            if ((res = ext2_write_block(ext2, block, table)) < 0) {
+                goto fail;
+            }
+        }
+
+        block = new_block;
+    }
+
+    return 0;
+
+fail:
+    if (!nfresh) {
+        return res;
+    }
+
+    // If the link can't be taken back, the blocks are leaked rather
+    // than freed while still referenced
+    if (!link_block) {
+        ptrs[link_off] = 0;
+    } else if (ext2_read_block(ext2, link_block, table) < 0) {
+        return res;
+    } else {
+        table[link_off] = 0;
+        if (ext2_write_block(ext2, link_block, table) < 0) {
+            return res;
+        }
+    }
+
+    for (int i = 0; i < nfresh; ++i) {
+        ext2_free_block(ext2, fresh_blocks[i]);
+        inode->disk_sector_count -= sb->block_size / 512;
+    }
+    return res;
+}
+
+// Free the indirect block table_no allocated by a failed mapping, along
+// with the ones below it. Its entries map span blocks each. What can't
+// be read is leaked
+static void ext2_map_undo(fs_t *ext2, struct ext2_inode *inode, uint32_t table_no, uint64_t span) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t nptrs = sb->block_size / 4;
+
+    if (span > 1) {
+        uint32_t table[nptrs];
+
+        if (ext2_read_block(ext2, table_no, table) < 0) {
+            return;
+        }
+        for (size_t i = 0; i < nptrs; ++i) {
+            if (table[i]) {
+                ext2_map_undo(ext2, inode, table[i], span / nptrs);
+            }
+        }
+    }
+
+    ext2_free_block(ext2, table_no);
+    inode->disk_sector_count -= sb->block_size / 512;
+}
+
+// Map the run from block_no to [start, end) below the indirect block
+// table_no, whose entries map span blocks each from base. The missing
+// tables below it are allocated, fresh tells that table_no itself was
+// just allocated and is not read. Every table is read and written once.
+// On failure table_no is left as it was on the disk and the tables
+// allocated below it are freed again
+static int ext2_map_table(fs_t *ext2, struct ext2_inode *inode, uint32_t table_no, int fresh, uint64_t span,
+                          uint64_t base, uint64_t start, uint64_t end, uint32_t block_no) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t nptrs = sb->block_size / 4;
+    uint32_t table[nptrs];
+    // Tables allocated here: 1 once allocated, 2 once filled in
+    uint8_t *made = NULL;
+    int res;
+
+    if (fresh) {
+        memset(table, 0, sb->block_size);
+    } else if ((res = ext2_read_block(ext2, table_no, table)) < 0) {
         return res;
     }
+    if (span > 1 && !(made = (uint8_t *) calloc(nptrs, 1))) {
+        return -ENOMEM;
+    }
+
+    for (size_t i = (start - base) / span; i < nptrs && base + i * span < end; ++i) {
+        uint64_t from = MAX(start, base + i * span);
+        uint64_t to = MIN(end, base + (i + 1) * span);
+
+        if (span == 1) {
+            table[i] = block_no + (uint32_t) (from - start);
+            continue;
+        }
+
+        if (!table[i]) {
+            if ((res = ext2_alloc_block(ext2, &table[i])) < 0) {
+                goto fail;
+            }
+            inode->disk_sector_count += sb->block_size / 512;
+            made[i] = 1;
+        }
+        if ((res = ext2_map_table(ext2, inode, table[i], made[i], span / nptrs, base + i * span,
+                                  from, to, block_no + (uint32_t) (from - start))) < 0) {
+            goto fail;
+        }
+        if (made[i]) {
+            made[i] = 2;
+        }
+    }
+
+    if ((res = ext2_write_block(ext2, table_no, table)) < 0) {
+        goto fail;
+    }
+    free(made);
+    return 0;
+
+fail:
+    for (size_t i = 0; made && i < nptrs; ++i) {
+        if (made[i] == 2) {
+            ext2_map_undo(ext2, inode, table[i], span / nptrs);
+        } else if (made[i]) {
+            ext2_free_block(ext2, table[i]);
+            inode->disk_sector_count -= sb->block_size / 512;
+        }
+    }
+    free(made);
+    return res;
+}
+
+// Map a run of blocks to a hole of the file. Extent-mapped files get
+// them as a single extent, block maps have each indirect block along the
+// run filled in once. The inode is not written
+int ext2_inode_map_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t block_no, uint32_t count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t *ptrs = ext2_inode_block_ptrs(inode);
+    uint64_t nptrs = sb->block_size / 4;
+    uint64_t end = (uint64_t) index + count;
+    uint64_t base = 12, span = 1;
+    int res;
+
+    if (ext2_inode_extents(inode)) {
+        return ext2_ext_map_blocks(ext2, inode, index, block_no, count, 0);
+    }
+
+    if (end > base + nptrs * (1 + nptrs + nptrs * nptrs)) {
+        return -EFBIG;
+    }
+
+    for (uint64_t i = index; i < 12 && i < end; ++i) {
+        ptrs[i] = block_no + (uint32_t) (i - index);
+    }
+
+    // Singly, doubly and triply indirect blocks
+    for (int level = 0; level < 3; ++level, base += span * nptrs) {
+        uint32_t *ptr = &ptrs[12 + level];
+        uint32_t table_no = *ptr;
+        uint64_t from;
+
+        span = level ? span * nptrs : 1;
+        if (end <= base || index >= base + span * nptrs) {
+            continue;
+        }
+        if (!table_no) {
+            if ((res = ext2_alloc_block(ext2, &table_no)) < 0) {
+                return res;
+            }
+            inode->disk_sector_count += sb->block_size / 512;
+        }
+
+        from = MAX(index, base);
+        if ((res = ext2_map_table(ext2, inode, table_no, !*ptr, span, base, from,
+                                  MIN(end, base + span * nptrs), block_no + (uint32_t) (from - index))) < 0) {
+            if (!*ptr) {
+                ext2_free_block(ext2, table_no);
+                inode->disk_sector_count -= sb->block_size / 512;
+            }
+            return res;
+        }
+        *ptr = table_no;
+    }
 
-    // Write direct block list entry
-    inode->direct_blocks[index] = block_no;
+    return 0;
+}
+
+// Where to look for a block for the index of the inode: right after
+// the previous block of the file, the start of the inode's group otherwise
+uint32_t ext2_inode_goal(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t goal = 0;
+
+    if (index && ext2_inode_get_block(ext2, inode, index - 1, &goal) == 0 && goal) {
+        return goal + 1;
+    }
+
+    return ((ino - 1) / sb->sb.block_group_size_inodes) * sb->sb.block_group_size_blocks +
+           sb->sb.sb_block_number;
+}
+
+// Allocate a block for the block index of the inode, along with any
+// indirect blocks needed to reach it. Regular file data is allocated
+// at write-back instead, see ext2_inode_flush()
+int ext2_inode_alloc_block(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index, uint32_t *block_no) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t got;
+    int res;
+
+    if ((res = ext2_alloc_blocks(ext2, ext2_inode_goal(ext2, inode, ino, index), 1, block_no, &got)) < 0) {
+        return res;
+    }
+    if ((res = ext2_inode_map_block(ext2, inode, index, *block_no)) < 0) {
+        ext2_free_block(ext2, *block_no);
+        return res;
+    }
+    inode->disk_sector_count += sb->block_size / 512;
 
     // Flush changes to the device
     return ext2_write_inode(ext2, inode, ino);
 }
 
-int ext2_free_inode_block(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, uint32_t index) {
-    if (index >= 12) {
-        fprintf(stderr, "Not implemented\n");
-        abort();
+static int ext2_table_empty(const uint32_t *table, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (table[i]) {
+            return 0;
+        }
     }
-    // All sanity checks regarding whether the block is present
-    // at all are left to the caller
+    return 1;
+}
 
+// Unmap the blocks of [start, end) below the indirect block table_no,
+// whose entries map span blocks each from base, and collect them in the
+// batch. The table is written once, unless it is left empty: the caller
+// frees it then
+static int ext2_free_table(fs_t *ext2, struct ext2_inode *inode, struct ext2_free_batch *batch, uint32_t table_no,
+                           uint64_t span, uint64_t base, uint64_t start, uint64_t end, int *empty) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t nptrs = sb->block_size / 4;
+    uint32_t table[nptrs];
+    int dirty = 0;
     int res;
-    uint32_t block_no;
 
-    // Get block number
-    block_no = inode->direct_blocks[index];
+    if ((res = ext2_read_block(ext2, table_no, table)) < 0) {
+        return res;
+    }
+
+    for (size_t i = (start - base) / span; i < nptrs && base + i * span < end; ++i) {
+        uint64_t from = base + i * span;
+        int gone = 1;
+
+        if (!table[i]) {
+            continue;
+        }
+        if (span > 1 &&
+            (res = ext2_free_table(ext2, inode, batch, table[i], span / nptrs, from,
+                                   MAX(start, from), MIN(end, from + span), &gone)) < 0) {
+            return res;
+        }
+        if (!gone) {
+            continue;
+        }
 
-    // Free the block
-    if ((res = ext2_free_block(ext2, block_no)) < 0) {
+        if ((res = ext2_free_batch_add(ext2, batch, table[i], 1)) < 0) {
+            return res;
+        }
+        inode->disk_sector_count -= sb->block_size / 512;
+        table[i] = 0;
+        dirty = 1;
+    }
+
+    if (!(*empty = ext2_table_empty(table, nptrs)) && dirty &&
+        (res = ext2_write_block(ext2, table_no, table)) < 0) {
         return res;
     }
+    return 0;
+}
 
-    // Write updated inode
-    inode->direct_blocks[index] = 0;
-    return ext2_write_inode(ext2, inode, ino);
+// Free the blocks of a range of the file, holes are skipped. Indirect
+// blocks left empty go too. Every table is read and written once and
+// the bitmap of each group is updated once. The inode is not written
+int ext2_free_inode_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_free_batch batch = { 0 };
+    uint32_t *ptrs = ext2_inode_block_ptrs(inode);
+    uint64_t nptrs = sb->block_size / 4;
+    uint64_t end = (uint64_t) index + count;
+    uint64_t base = 12, span = 1;
+    int res = 0;
+
+    // Fast symlinks and inline data keep other things in the block map
+    if (!inode->disk_sector_count) {
+        return 0;
+    }
+
+    if (ext2_inode_extents(inode)) {
+        res = ext2_ext_free_blocks(ext2, inode, index, count, &batch);
+        goto out;
+    }
+
+    for (uint64_t i = index; i < 12 && i < end; ++i) {
+        if (ptrs[i]) {
+            if ((res = ext2_free_batch_add(ext2, &batch, ptrs[i], 1)) < 0) {
+                goto out;
+            }
+            inode->disk_sector_count -= sb->block_size / 512;
+            ptrs[i] = 0;
+        }
+    }
+
+    // Singly, doubly and triply indirect blocks
+    for (int level = 0; level < 3; ++level, base += span * nptrs) {
+        uint32_t *ptr = &ptrs[12 + level];
+        int empty;
+
+        span = level ? span * nptrs : 1;
+        if (!*ptr || end <= base || index >= base + span * nptrs) {
+            continue;
+        }
+        if ((res = ext2_free_table(ext2, inode, &batch, *ptr, span, base,
+                                   MAX(index, base), MIN(end, base + span * nptrs), &empty)) < 0) {
+            goto out;
+        }
+        if (empty) {
+            if ((res = ext2_free_batch_add(ext2, &batch, *ptr, 1)) < 0) {
+                goto out;
+            }
+            inode->disk_sector_count -= sb->block_size / 512;
+            *ptr = 0;
+        }
+    }
+
+out:
+    // Halfway through, some of the blocks may still be mapped on the
+    // disk: leak them rather than free them
+    if (res >= 0) {
+        res = ext2_free_batch_apply(ext2, &batch);
+    }
+    free(batch.runs);
+    return res;
+}
+
+// One past the last block mapped below the indirect block table_no,
+// whose entries map span blocks each from base. An indirect block with
+// nothing below counts as mapping its whole span
+static int ext2_table_end(fs_t *ext2, uint32_t table_no, uint64_t span, uint64_t base, uint64_t *end) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t nptrs = sb->block_size / 4;
+    uint32_t table[nptrs];
+    int res;
+
+    if ((res = ext2_read_block(ext2, table_no, table)) < 0) {
+        return res;
+    }
+
+    *end = 0;
+    for (size_t i = nptrs; i-- > 0;) {
+        if (!table[i]) {
+            continue;
+        }
+        if (span > 1 && (res = ext2_table_end(ext2, table[i], span / nptrs, base + i * span, end)) < 0) {
+            return res;
+        }
+        if (!*end) {
+            *end = base + (i + 1) * span;
+        }
+        break;
+    }
+    return 0;
+}
+
+// One past the last block of the file mapped, 0 if none is. Blocks
+// past the size, like the ones fallocate() keeps, count too
+int ext2_inode_map_end(fs_t *ext2, struct ext2_inode *inode, uint64_t *end) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t *ptrs = ext2_inode_block_ptrs(inode);
+    uint64_t nptrs = sb->block_size / 4;
+    uint64_t base[3] = { 12, 12 + nptrs, 12 + nptrs + nptrs * nptrs };
+    uint64_t span[3] = { 1, nptrs, nptrs * nptrs };
+
+    *end = 0;
+    if (!inode->disk_sector_count) {
+        return 0;
+    }
+    if (ext2_inode_extents(inode)) {
+        return ext2_ext_map_end(ext2, inode, end);
+    }
+
+    for (int level = 2; level >= 0; --level) {
+        int res;
+
+        if (!ptrs[12 + level]) {
+            continue;
+        }
+        if ((res = ext2_table_end(ext2, ptrs[12 + level], span[level], base[level], end)) < 0) {
+            return res;
+        }
+        if (!*end) {
+            *end = base[level] + span[level] * nptrs;
+        }
+        return 0;
+    }
+
+    for (int i = 11; i >= 0; --i) {
+        if (ptrs[i]) {
+            *end = i + 1;
+            break;
+        }
+    }
+    return 0;
 }
 
-int ext2_free_inode(fs_t *ext2, uint32_t ino) {
+// The caller holds the group lock
+static int ext2_free_inode_unlocked(fs_t *ext2, uint32_t ino, enum vnode_type type) {
     assert(ino);
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
     char block_buffer[sb->block_size];
     uint32_t ino_block_group_number = (ino - 1) / sb->sb.block_group_size_inodes;
     uint32_t ino_inode_index_in_group = (ino - 1) % sb->sb.block_group_size_inodes;
+    struct ext2_grp_desc *desc;
     int res;
 
+    if ((res = ext2_group_desc(ext2, ino_block_group_number, &desc)) < 0) {
+        return res;
+    }
+
     // Read inode usage block
-    if ((res = ext2_read_block(ext2,
-                               sb->block_group_descriptor_table[ino_block_group_number].inode_usage_bitmap_block,
-                               block_buffer)) < 0) {
+    ext2_group_readahead(ext2, ino_block_group_number, 1);
+    if ((res = ext2_read_block(ext2, desc->inode_usage_bitmap_block, block_buffer)) < 0) {
         return res;
     }
 
     // Remove usage bit
-    assert(((uint64_t *) block_buffer)[ino_inode_index_in_group / 64] & (1 << (ino_inode_index_in_group % 64)));
-    ((uint64_t *) block_buffer)[ino_inode_index_in_group / 64] &= ~(1 << (ino_inode_index_in_group % 64));
+    assert(((uint64_t *) block_buffer)[ino_inode_index_in_group / 64] & (1ULL << (ino_inode_index_in_group % 64)));
+    ((uint64_t *) block_buffer)[ino_inode_index_in_group / 64] &= ~(1ULL << (ino_inode_index_in_group % 64));
 
     // Write modified bitmap back
-    if ((res = ext2_write_block(ext2,
-                                sb->block_group_descriptor_table[ino_block_group_number].inode_usage_bitmap_block,
-                                block_buffer)) < 0) {
+    if ((res = ext2_write_block(ext2, desc->inode_usage_bitmap_block, block_buffer)) < 0) {
         return res;
     }
 
-    // Increment free inode count in BGDT entry and write it back
-    // TODO: this code is repetitive and maybe should be moved to
-    //       ext2_bgdt_inode_inc/_dec()
-    ++sb->block_group_descriptor_table[ino_block_group_number].free_inodes;
-    for (size_t i = 0; i < sb->block_group_descriptor_table_size_blocks; ++i) {
-        void *blk_ptr = (void *) (((uintptr_t) sb->block_group_descriptor_table) + i * sb->block_size);
+    // Increment free inode counts in BGDT entry and superblock
+    ++desc->free_inodes;
+    if (type == VN_DIR) {
+        --desc->dir_count;
+    }
+    ext2_counts_add(ext2, 0, 1, type == VN_DIR ? -1 : 0);
+    ext2_meta_dirty(ext2);
 
-        if ((res = ext2_write_block(ext2, sb->block_group_descriptor_table_block + i, blk_ptr)) < 0) {
-            return res;
-        }
+    printf("Freed inode #%u\n", ino);
+    return 0;
+}
+
+int ext2_free_inode(fs_t *ext2, uint32_t ino, enum vnode_type type) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t group_no = (ino - 1) / sb->sb.block_group_size_inodes;
+    int res;
+
+    ext2_group_lock(ext2, group_no);
+    res = ext2_free_inode_unlocked(ext2, ino, type);
+    ext2_group_unlock(ext2, group_no);
+
+    return res;
+}
+
+// Take the first free inode of the group. The caller holds the group
+// lock
+static int ext2_alloc_inode_in_group(fs_t *ext2, uint32_t group_no, int dir, uint32_t *ino) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    char block_buffer[sb->block_size];
+    uint32_t ipg = sb->sb.block_group_size_inodes;
+    struct ext2_grp_desc *desc;
+    int res;
+
+    if ((res = ext2_group_desc(ext2, group_no, &desc)) < 0) {
+        return res;
     }
 
-    // Update global inode count
-    ++sb->sb.free_inode_count;
-    if ((res = ext2_write_superblock(ext2)) < 0) {
+    printf("Allocating an inode inside block group #%u\n", group_no);
+
+    // Read inode usage bitmap
+    ext2_group_readahead(ext2, group_no, 1);
+    if ((res = ext2_read_block(ext2, desc->inode_usage_bitmap_block, block_buffer)) < 0) {
         return res;
     }
 
-    printf("Freed inode #%u\n", ino);
-    return 0;
+    for (uint32_t bit = 0; bit < ipg; ++bit) {
+        if (((uint64_t *) block_buffer)[bit / 64] == (uint64_t) -1) {
+            // Skip the rest of a full qword
+            bit |= 63;
+            continue;
+        }
+        if (ext2_bit_test(block_buffer, bit)) {
+            continue;
+        }
+
+        // Write updated bitmap
+        ((uint64_t *) block_buffer)[bit / 64] |= (1ULL << (bit % 64));
+        if ((res = ext2_write_block(ext2, desc->inode_usage_bitmap_block, block_buffer)) < 0) {
+            return res;
+        }
+
+        // Update BGDT and global inode count
+        --desc->free_inodes;
+        if (dir) {
+            ++desc->dir_count;
+        }
+        ext2_counts_add(ext2, 0, -1, dir ? 1 : 0);
+        ext2_meta_dirty(ext2);
+
+        *ino = bit + group_no * ipg + 1;
+        return 0;
+    }
+
+    return -ENOSPC;
 }
 
-int ext2_alloc_inode(fs_t *ext2, uint32_t *ino) {
+// Orlov allocator for directories. Top-level directories are spread
+// out: each goes to the group with the fewest directories among those
+// with more free inodes and blocks than average. Other directories
+// stay close to their parent unless its group is getting crowded
+static int ext2_find_group_dir(fs_t *ext2, uint32_t parent_group, int top, uint32_t *group_no) {
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
-    char block_buffer[sb->block_size];
-    uint32_t res_ino = 0;
-    uint32_t res_group_no = 0;
-    uint32_t res_ino_number_in_group = 0;
+    uint32_t ngroups = sb->block_group_count;
+    uint32_t avg_inodes = ext2_free_inodes_count(ext2) / ngroups;
+    uint32_t avg_blocks = ext2_free_blocks_count(ext2) / ngroups;
+    struct ext2_grp_desc *desc;
+    uint32_t ndirs;
     int res;
 
-    // Look through BGDT to find any block groups with free inodes
-    for (size_t i = 0; i < sb->block_group_count; ++i) {
-        if (sb->block_group_descriptor_table[i].free_inodes > 0) {
-            // Found a block group with free inodes
-            printf("Allocating an inode inside block group #%zu\n", i);
+    if (top) {
+        uint32_t best_dirs = UINT32_MAX;
+        int found = 0;
+
+        for (uint32_t n = 0; n < ngroups; ++n) {
+            uint32_t i = (parent_group + n) % ngroups;
 
-            // Read inode usage bitmap
-            if ((res = ext2_read_block(ext2,
-                                       sb->block_group_descriptor_table[i].inode_usage_bitmap_block,
-                                       block_buffer)) < 0) {
+            if ((res = ext2_group_desc(ext2, i, &desc)) < 0) {
                 return res;
             }
 
-            // Find a free bit
-            // Think this should be fine on amd64
-            for (size_t j = 0; j < sb->block_size / sizeof(uint64_t); ++j) {
-                // Get bitmap qword
-                uint64_t qw = ((uint64_t *) block_buffer)[j];
-                // If not all bits are set in this qword, find exactly which one
-                if (qw != ((uint64_t) -1)) {
-                    for (size_t k = 0; k < 64; ++k) {
-                        if (!(qw & (1 << k))) {
-                            res_ino_number_in_group = k + j * 64;
-                            res_group_no = i;
-                            res_ino = res_ino_number_in_group + i * sb->sb.block_group_size_inodes + 1;
-                            break;
-                        }
-                    }
-
-                    if (res_ino) {
-                        break;
-                    }
-                }
-
-                if (res_ino) {
-                    break;
-                }
+            if (desc->free_inodes && desc->free_inodes >= avg_inodes && desc->free_blocks >= avg_blocks &&
+                desc->dir_count < best_dirs) {
+                best_dirs = desc->dir_count;
+                *group_no = i;
+                found = 1;
             }
         }
+        if (found) {
+            return 0;
+        }
+    } else {
+        if ((res = ext2_dirs_count(ext2, &ndirs)) < 0) {
+            return res;
+        }
 
-        if (res_ino) {
-            break;
+        uint32_t max_dirs = ndirs / ngroups + sb->sb.block_group_size_inodes / 16;
+        uint32_t min_inodes = avg_inodes - avg_inodes / 4;
+        uint32_t min_blocks = avg_blocks - avg_blocks / 4;
+
+        for (uint32_t n = 0; n < ngroups; ++n) {
+            uint32_t i = (parent_group + n) % ngroups;
+
+            if ((res = ext2_group_desc(ext2, i, &desc)) < 0) {
+                return res;
+            }
+
+            if (desc->free_inodes && desc->dir_count < max_dirs && desc->free_inodes >= min_inodes &&
+                desc->free_blocks >= min_blocks) {
+                *group_no = i;
+                return 0;
+            }
         }
     }
-    if (res_ino == 0) {
-        return -ENOSPC;
+
+    // Everything is crowded, take any group with average free inodes,
+    // then any with some left
+    for (uint32_t n = 0; n < ngroups; ++n) {
+        uint32_t i = (parent_group + n) % ngroups;
+
+        if ((res = ext2_group_desc(ext2, i, &desc)) < 0) {
+            return res;
+        }
+        if (desc->free_inodes && desc->free_inodes >= avg_inodes) {
+            *group_no = i;
+            return 0;
+        }
     }
+    for (uint32_t n = 0; n < ngroups; ++n) {
+        uint32_t i = (parent_group + n) % ngroups;
 
-    // Write updated bitmap
-    ((uint64_t *) block_buffer)[res_ino_number_in_group / 64] |= (1 << (res_ino_number_in_group % 64));
-    if ((res = ext2_write_block(ext2,
-                                sb->block_group_descriptor_table[res_group_no].inode_usage_bitmap_block,
-                                block_buffer)) < 0) {
-        return res;
+        if ((res = ext2_group_desc(ext2, i, &desc)) < 0) {
+            return res;
+        }
+        if (desc->free_inodes) {
+            *group_no = i;
+            return 0;
+        }
     }
 
-    // Write updated BGDT
-    --sb->block_group_descriptor_table[res_group_no].free_inodes;
-    for (size_t i = 0; i < sb->block_group_descriptor_table_size_blocks; ++i) {
-        void *blk_ptr = (void *) (((uintptr_t) sb->block_group_descriptor_table) + i * sb->block_size);
+    return -ENOSPC;
+}
 
-        if ((res = ext2_write_block(ext2, sb->block_group_descriptor_table_block + i, blk_ptr)) < 0) {
+// Files go to their parent's group, or the next one with both free
+// inodes and blocks, so their inodes and data stay near the directory
+static int ext2_find_group_other(fs_t *ext2, uint32_t parent_group, uint32_t *group_no) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t ngroups = sb->block_group_count;
+    struct ext2_grp_desc *desc;
+    int res;
+
+    for (uint32_t n = 0; n < ngroups; ++n) {
+        uint32_t i = (parent_group + n) % ngroups;
+
+        if ((res = ext2_group_desc(ext2, i, &desc)) < 0) {
             return res;
         }
+        if (desc->free_inodes && desc->free_blocks) {
+            *group_no = i;
+            return 0;
+        }
     }
+    for (uint32_t n = 0; n < ngroups; ++n) {
+        uint32_t i = (parent_group + n) % ngroups;
 
-    // Update global inode count and flush superblock
-    --sb->sb.free_inode_count;
-    if ((res = ext2_write_superblock(ext2)) < 0) {
-        return res;
+        if ((res = ext2_group_desc(ext2, i, &desc)) < 0) {
+            return res;
+        }
+        if (desc->free_inodes) {
+            *group_no = i;
+            return 0;
+        }
     }
 
-    *ino = res_ino;
+    return -ENOSPC;
+}
 
-    return 0;
+// Allocate an inode for a new entry of type in the directory parent.
+// The group is picked without its lock: it may be used up by the time
+// it is locked, then another one is picked
+int ext2_alloc_inode(fs_t *ext2, uint32_t parent, enum vnode_type type, uint32_t *ino) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t parent_group = (parent - 1) / sb->sb.block_group_size_inodes;
+    uint32_t group_no;
+    int res;
+
+    for (uint32_t n = 0; n < sb->block_group_count; ++n) {
+        if (type == VN_DIR) {
+            res = ext2_find_group_dir(ext2, parent_group, parent == EXT2_ROOTINO, &group_no);
+        } else {
+            res = ext2_find_group_other(ext2, parent_group, &group_no);
+        }
+        if (res < 0) {
+            return res;
+        }
+
+        ext2_group_lock(ext2, group_no);
+        res = ext2_alloc_inode_in_group(ext2, group_no, type == VN_DIR, ino);
+        ext2_group_unlock(ext2, group_no);
+
+        if (res != -ENOSPC) {
+            return res;
+        }
+    }
+
+    return -ENOSPC;
 }
 
@@ -5,19 +5,243 @@
 #include <errno.h>
 #include <stdio.h>
 
+#define MIN(x, y) ((x) > (y) ? (y) : (x))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
 #define ext2_super(e)       ((struct ext2_extsb *) (e)->fs_private)
 
+// With a journal, the superblock goes into the running transaction as
+// part of the block holding it
 int ext2_write_superblock(fs_t *ext2) {
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
-    return blk_write(ext2->blk, sb, EXT2_SBOFF, EXT2_SBSIZ);
+    uint32_t block_no = EXT2_SBOFF / sb->block_size;
+    char block_buffer[sb->block_size];
+
+    if (!sb->journal) {
+        return blk_write(ext2->blk, sb, EXT2_SBOFF, EXT2_SBSIZ);
+    }
+
+    if (ext2_journal_read(ext2, block_no, block_buffer) != 0 &&
+        blk_read(ext2->blk, block_buffer, (uint64_t) block_no * sb->block_size, sb->block_size) < 0) {
+        return -EIO;
+    }
+    memcpy(block_buffer + EXT2_SBOFF % sb->block_size, sb, EXT2_SBSIZ);
+
+    return ext2_journal_write(ext2, block_no, block_buffer);
+}
+
+// BGDT or superblock counters were changed. The caller holds the lock
+// of the group
+void ext2_meta_dirty(fs_t *ext2) {
+    atomic_store_explicit(&ext2_super(ext2)->cache->meta_dirty, 1, memory_order_relaxed);
+}
+
+// Write back the BGDT and the superblock if they were changed. These
+// only hold free counts, so they may lag behind the bitmaps and inodes.
+// All the group locks are taken so that the counts agree with each other
+int ext2_write_meta(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int res = 0;
+
+    pthread_mutex_lock(&sb->cache->meta_lock);
+
+    if (!atomic_load_explicit(&sb->cache->meta_dirty, memory_order_relaxed)) {
+        pthread_mutex_unlock(&sb->cache->meta_lock);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < EXT2_GROUP_LOCKS; ++i) {
+        ext2_group_lock(ext2, i);
+    }
+    ext2_counts_fold(ext2);
+
+    // Blocks never loaded were not changed either
+    for (size_t i = 0; i < sb->block_group_descriptor_table_size_blocks; ++i) {
+        void *blk_ptr = (void *) (((uintptr_t) sb->block_group_descriptor_table) + i * sb->block_size);
+
+        if (!atomic_load_explicit(&sb->bgdt_loaded[i], memory_order_acquire)) {
+            continue;
+        }
+        if ((res = ext2_write_block(ext2, sb->block_group_descriptor_table_block + i, blk_ptr)) < 0) {
+            break;
+        }
+    }
+
+    if (res >= 0 && (res = ext2_write_superblock(ext2)) >= 0) {
+        atomic_store_explicit(&sb->cache->meta_dirty, 0, memory_order_relaxed);
+    }
+
+    for (uint32_t i = 0; i < EXT2_GROUP_LOCKS; ++i) {
+        ext2_group_unlock(ext2, i);
+    }
+    pthread_mutex_unlock(&sb->cache->meta_lock);
+    return res < 0 ? res : 0;
+}
+
+// Read the BGDT block at index if it was not read yet. Mount only reads
+// the superblock, so the descriptors are loaded on first use
+int ext2_bgdt_load(fs_t *ext2, uint32_t index) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int res = 0;
+
+    if (index >= sb->block_group_descriptor_table_size_blocks) {
+        return -EIO;
+    }
+    if (atomic_load_explicit(&sb->bgdt_loaded[index], memory_order_acquire)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&sb->cache->bgdt_lock);
+    if (!atomic_load_explicit(&sb->bgdt_loaded[index], memory_order_relaxed)) {
+        if ((res = ext2_read_block(ext2, sb->block_group_descriptor_table_block + index,
+                                   (char *) sb->block_group_descriptor_table + index * sb->block_size)) < 0) {
+            printf("ext2: failed to read BGDT block %u\n", index);
+        } else {
+            atomic_store_explicit(&sb->bgdt_loaded[index], 1, memory_order_release);
+            res = 0;
+        }
+    }
+    pthread_mutex_unlock(&sb->cache->bgdt_lock);
+
+    return res;
+}
+
+// The descriptor of the group. Its BGDT block is read on first use,
+// which may fail. Group numbers come from inode and block numbers on
+// disk, so they are checked
+int ext2_group_desc(fs_t *ext2, uint32_t group_no, struct ext2_grp_desc **desc) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int res;
+
+    if (group_no >= sb->block_group_count) {
+        fprintf(stderr, "ext2: group %u out of range\n", group_no);
+        return -EIO;
+    }
+    if ((res = ext2_bgdt_load(ext2, group_no * sizeof(struct ext2_grp_desc) / sb->block_size)) < 0) {
+        return res;
+    }
+    *desc = &sb->block_group_descriptor_table[group_no];
+    return 0;
+}
+
+// Load the rest of the BGDT ahead of its use, called by the flusher
+// when mounted with prefetch_bgdt
+void ext2_bgdt_prefetch(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    for (uint32_t i = 0; i < sb->block_group_descriptor_table_size_blocks; ++i) {
+        if (ext2_bgdt_load(ext2, i) < 0) {
+            break;
+        }
+    }
+}
+
+// The blocks on disk changed under the loaded copies, on journal
+// replay. Nothing may use the descriptors meanwhile
+void ext2_bgdt_invalidate(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    for (uint32_t i = 0; i < sb->block_group_descriptor_table_size_blocks; ++i) {
+        atomic_store_explicit(&sb->bgdt_loaded[i], 0, memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&sb->cache->ra_lock);
+    sb->cache->ra_count = 0;
+    pthread_mutex_unlock(&sb->cache->ra_lock);
+}
+
+// Read count adjacent metadata blocks from block_no with a single device
+// request, so that ext2_read_block() finds them in memory. Only the last
+// run read ahead is kept, with the blocks still in the journal laid over
+// it: they outlive their buffers there. The caller holds the lock of the
+// group the block it needs belongs to
+int ext2_meta_readahead(fs_t *ext2, uint32_t block_no, uint32_t count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_cache *cache = sb->cache;
+    int res = 0;
+
+    if (count > cache->ra_max) {
+        count = cache->ra_max;
+    }
+    if (!block_no || count < 2) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache->ra_lock);
+    if (block_no < cache->ra_start || block_no + count > cache->ra_start + cache->ra_count) {
+        cache->ra_count = 0;
+        if ((res = blk_read(ext2->blk, cache->ra_data, (uint64_t) block_no * sb->block_size,
+                            (size_t) count * sb->block_size)) < 0) {
+            fprintf(stderr, "ext2: Failed to read blocks %u-%u\n", block_no, block_no + count - 1);
+        } else {
+            if (sb->journal) {
+                ext2_journal_overlay(ext2, block_no, count, cache->ra_data);
+            }
+            cache->ra_start = block_no;
+            cache->ra_count = count;
+            res = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache->ra_lock);
+
+    return res;
 }
 
+static int ext2_ra_read(fs_t *ext2, uint32_t block_no, void *buf) {
+    struct ext2_cache *cache = ext2_super(ext2)->cache;
+    int res = -1;
+
+    if (!cache || !cache->ra_max) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->ra_lock);
+    if (block_no >= cache->ra_start && block_no < cache->ra_start + cache->ra_count) {
+        size_t block_size = ext2_super(ext2)->block_size;
+
+        memcpy(buf, cache->ra_data + (block_no - cache->ra_start) * block_size, block_size);
+        res = 0;
+    }
+    pthread_mutex_unlock(&cache->ra_lock);
+
+    return res;
+}
+
+// Keep the blocks read ahead up to date with the ones written
+void ext2_ra_update(fs_t *ext2, uint32_t block_no, uint32_t count, const void *buf) {
+    struct ext2_cache *cache = ext2_super(ext2)->cache;
+
+    if (!cache || !cache->ra_max) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->ra_lock);
+    uint32_t start = block_no > cache->ra_start ? block_no : cache->ra_start;
+    uint32_t end = block_no + count < cache->ra_start + cache->ra_count ?
+                   block_no + count : cache->ra_start + cache->ra_count;
+    if (start < end) {
+        size_t block_size = ext2_super(ext2)->block_size;
+
+        memcpy(cache->ra_data + (start - cache->ra_start) * block_size,
+               (const char *) buf + (start - block_no) * block_size, (end - start) * block_size);
+    }
+    pthread_mutex_unlock(&cache->ra_lock);
+}
+
+// Single blocks are metadata: with a journal, they may be newer in it
+// than on disk
 int ext2_read_block(fs_t *ext2, uint32_t block_no, void *buf) {
     if (!block_no) {
         return -1;
     }
+    if (ext2_super(ext2)->journal && ext2_journal_read(ext2, block_no, buf) == 0) {
+        return ext2_super(ext2)->block_size;
+    }
+    if (ext2_ra_read(ext2, block_no, buf) == 0) {
+        return ext2_super(ext2)->block_size;
+    }
     //printf("ext2_read_block %u\n", block_no);
-    int res = blk_read(ext2->blk, buf, block_no * ext2_super(ext2)->block_size, ext2_super(ext2)->block_size);
+    int res = blk_read(ext2->blk, buf, (uint64_t) block_no * ext2_super(ext2)->block_size, ext2_super(ext2)->block_size);
 
     if (res < 0) {
         fprintf(stderr, "ext2: Failed to read %uth block\n", block_no);
@@ -26,12 +250,45 @@ int ext2_read_block(fs_t *ext2, uint32_t block_no, void *buf) {
     return res;
 }
 
+// Read a run of adjacent blocks with a single device request
+int ext2_read_blocks(fs_t *ext2, uint32_t block_no, uint32_t count, void *buf) {
+    if (!block_no) {
+        return -1;
+    }
+
+    size_t block_size = ext2_super(ext2)->block_size;
+    int res = blk_read(ext2->blk, buf, (uint64_t) block_no * block_size, count * block_size);
+
+    if (res < 0) {
+        fprintf(stderr, "ext2: Failed to read blocks %u-%u\n", block_no, block_no + count - 1);
+    } else if (ext2_super(ext2)->journal) {
+        // Runs of inode table blocks are read this way too
+        ext2_journal_overlay(ext2, block_no, count, buf);
+    }
+
+    return res;
+}
+
+// With a journal, the block goes into the running transaction instead.
+// File data is written with ext2_write_blocks()
 int ext2_write_block(fs_t *ext2, uint32_t block_no, const void *buf) {
+    int res;
+
     if (!block_no) {
         return -1;
     }
+    if (ext2_super(ext2)->journal) {
+        ext2_ra_update(ext2, block_no, 1, buf);
+        if ((res = ext2_journal_write(ext2, block_no, buf)) < 0) {
+            return res;
+        }
+        return ext2_super(ext2)->block_size;
+    }
 
-    int res = blk_write(ext2->blk, buf, block_no * ext2_super(ext2)->block_size, ext2_super(ext2)->block_size);
+    // Updated once on disk: a read ahead of another group meanwhile
+    // could bring back the old contents otherwise
+    res = blk_write(ext2->blk, buf, (uint64_t) block_no * ext2_super(ext2)->block_size, ext2_super(ext2)->block_size);
+    ext2_ra_update(ext2, block_no, 1, buf);
 
     if (res < 0) {
         fprintf(stderr, "ext2: Failed to write %uth block\n", block_no);
@@ -40,63 +297,290 @@ int ext2_write_block(fs_t *ext2, uint32_t block_no, const void *buf) {
     return res;
 }
 
-int ext2_write_inode_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, const void *buf) {
-    if (index < 12) {
-        uint32_t block_number = inode->direct_blocks[index];
-        return ext2_write_block(ext2, block_number, buf);
-    } else {
-        // TODO
-        abort();
+// Write a run of adjacent blocks in place, never through the journal
+int ext2_write_blocks(fs_t *ext2, uint32_t block_no, uint32_t count, const void *buf) {
+    if (!block_no) {
+        return -1;
     }
+
+    size_t block_size = ext2_super(ext2)->block_size;
+    int res = blk_write(ext2->blk, buf, (uint64_t) block_no * block_size, count * block_size);
+
+    ext2_ra_update(ext2, block_no, count, buf);
+    if (res < 0) {
+        fprintf(stderr, "ext2: Failed to write blocks %u-%u\n", block_no, block_no + count - 1);
+    }
+
+    return res;
 }
 
-int ext2_read_inode_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, void *buf) {
-    if (index < 12) {
-        // Use direct ptrs
-        uint32_t block_number = inode->direct_blocks[index];
-        return ext2_read_block(ext2, block_number, buf);
-    } else {
-        struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
-        // Use buf as indirection block buffer (I think we're allowed to do so)
-
-        if (index < 12 + (sb->block_size / 4)) {
-            // Single indirection
-            if (ext2_read_block(ext2, inode->l1_indirect_block, buf) < 0) {
+// Get the path through the block map to the block index: offsets[0] is
+// the slot in inode's block pointers, the following ones are the slots
+// in indirect blocks. Returns the number of indirection levels
+int ext2_block_map_path(fs_t *ext2, uint32_t index, uint32_t *offsets) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint64_t ptrs = sb->block_size / 4;
+    uint64_t i = index;
+
+    if (i < 12) {
+        offsets[0] = i;
+        return 0;
+    }
+    i -= 12;
+
+    if (i < ptrs) {
+        offsets[0] = 12;
+        offsets[1] = i;
+        return 1;
+    }
+    i -= ptrs;
+
+    if (i < ptrs * ptrs) {
+        offsets[0] = 13;
+        offsets[1] = i / ptrs;
+        offsets[2] = i % ptrs;
+        return 2;
+    }
+    i -= ptrs * ptrs;
+
+    if (i < ptrs * ptrs * ptrs) {
+        offsets[0] = 14;
+        offsets[1] = i / (ptrs * ptrs);
+        offsets[2] = (i / ptrs) % ptrs;
+        offsets[3] = i % ptrs;
+        return 3;
+    }
+
+    return -EFBIG;
+}
+
+// Find the device block backing the block index of the inode,
+// *block_no is set to 0 if there's a hole
+int ext2_inode_get_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t *block_no) {
+    return ext2_inode_lookup_block(ext2, inode, index, block_no, NULL);
+}
+
+// Same as ext2_inode_get_block(). uninit, if given, tells if the block
+// was preallocated and never written: it reads back as zeroes
+int ext2_inode_lookup_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t *block_no, int *uninit) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t offsets[4];
+    int depth;
+
+    if (uninit) {
+        *uninit = 0;
+    }
+    if (ext2_inode_inline(inode)) {
+        // No blocks, the data is in the inode
+        *block_no = 0;
+        return 0;
+    }
+    if (ext2_inode_extents(inode)) {
+        return ext2_ext_get_block(ext2, inode, index, block_no, uninit);
+    }
+
+    if ((depth = ext2_block_map_path(ext2, index, offsets)) < 0) {
+        return depth;
+    }
+
+    uint32_t block = ext2_inode_block_ptrs(inode)[offsets[0]];
+
+    if (depth) {
+        uint32_t table[sb->block_size / 4];
+
+        for (int i = 1; i <= depth && block; ++i) {
+            if (ext2_read_block(ext2, block, table) < 0) {
                 return -EIO;
             }
+            block = table[offsets[i]];
+        }
+    }
 
-            uint32_t block_number = ((uint32_t *) buf)[index - 12];
-            return ext2_read_block(ext2, block_number, buf);
-        } else {
-            // Not implemented yet
-            return -EIO;
+    *block_no = block;
+    return 0;
+}
+
+// Fill blocks with the entries of [start, end) below the indirect block
+// table_no, whose entries map span blocks each from base. blocks[0] is
+// for start
+static int ext2_table_lookup(fs_t *ext2, uint32_t table_no, uint64_t span, uint64_t base,
+                             uint64_t start, uint64_t end, uint32_t *blocks) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t nptrs = sb->block_size / 4;
+    uint32_t table[nptrs];
+    int res;
+
+    if (ext2_read_block(ext2, table_no, table) < 0) {
+        return -EIO;
+    }
+
+    for (size_t i = (start - base) / span; i < nptrs && base + i * span < end; ++i) {
+        uint64_t from = MAX(start, base + i * span);
+        uint64_t to = MIN(end, base + (i + 1) * span);
+
+        if (!table[i]) {
+            memset(&blocks[from - start], 0, (to - from) * sizeof(uint32_t));
+        } else if (span == 1) {
+            blocks[from - start] = table[i];
+        } else if ((res = ext2_table_lookup(ext2, table[i], span / nptrs, base + i * span,
+                                            from, to, &blocks[from - start])) < 0) {
+            return res;
         }
     }
+
+    return 0;
 }
 
-int ext2_read_inode(fs_t *ext2, struct ext2_inode *inode, uint32_t ino) {
+// Same as ext2_inode_lookup_block() for count blocks from index, uninit
+// may be NULL. Every indirect block is read once
+int ext2_inode_lookup_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count,
+                             uint32_t *blocks, char *uninit) {
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
-    //printf("ext2_read_inode %d\n", ino);
-    char inode_block_buffer[sb->block_size];
+    uint32_t *ptrs = ext2_inode_block_ptrs(inode);
+    uint64_t nptrs = sb->block_size / 4;
+    uint64_t end = (uint64_t) index + count;
+    uint64_t base = 12, span = 1;
+    int res;
+
+    if (uninit) {
+        memset(uninit, 0, count);
+    }
+    if (ext2_inode_inline(inode)) {
+        memset(blocks, 0, count * sizeof(uint32_t));
+        return 0;
+    }
+    if (ext2_inode_extents(inode)) {
+        return ext2_ext_get_blocks(ext2, inode, index, count, blocks, uninit);
+    }
+
+    for (uint64_t i = index; i < 12 && i < end; ++i) {
+        blocks[i - index] = ptrs[i];
+    }
+
+    // Singly, doubly and triply indirect blocks
+    for (int level = 0; level < 3; ++level, base += span * nptrs) {
+        uint32_t table_no = ptrs[12 + level];
+        uint64_t from, to;
+
+        span = level ? span * nptrs : 1;
+        if (end <= base || index >= base + span * nptrs) {
+            continue;
+        }
+        from = MAX(index, base);
+        to = MIN(end, base + span * nptrs);
+        if (!table_no) {
+            memset(&blocks[from - index], 0, (to - from) * sizeof(uint32_t));
+        } else if ((res = ext2_table_lookup(ext2, table_no, span, base, from, to, &blocks[from - index])) < 0) {
+            return res;
+        }
+    }
+
+    return end > base ? -EFBIG : 0;
+}
+
+int ext2_write_inode_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, const void *buf) {
+    uint32_t block_number;
+    int res;
+
+    if ((res = ext2_inode_get_block(ext2, inode, index, &block_number)) < 0) {
+        return res;
+    }
+
+    // The block has to be allocated by the caller
+    if (!block_number) {
+        return -EIO;
+    }
+
+    return ext2_write_block(ext2, block_number, buf);
+}
+
+int ext2_read_inode_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t block_number;
+    int uninit;
+    int res;
+
+    // Inline directories are read through ext2_dir_read_block()
+    if (ext2_inode_inline(inode)) {
+        if (index) {
+            memset(buf, 0, sb->block_size);
+        } else if ((res = ext2_inline_read(ext2, inode, buf)) < 0) {
+            return res;
+        }
+        return sb->block_size;
+    }
+
+    if ((res = ext2_inode_lookup_block(ext2, inode, index, &block_number, &uninit)) < 0) {
+        return res;
+    }
+
+    if (!block_number || uninit) {
+        // Holes read back as zeros without touching the device
+        memset(buf, 0, sb->block_size);
+        return sb->block_size;
+    }
+
+    return ext2_read_block(ext2, block_number, buf);
+}
+
+// Write zeroes to count blocks from block_no, in place
+int ext2_zero_blocks(fs_t *ext2, uint32_t block_no, uint32_t count) {
+    size_t block_size = ext2_super(ext2)->block_size;
+    uint32_t run = count < EXT2_FLUSH_MAX_RUN ? count : EXT2_FLUSH_MAX_RUN;
+    char *zeroes = (char *) calloc(run, block_size);
+    int res = 0;
+
+    if (!zeroes) {
+        return -ENOMEM;
+    }
+
+    for (uint32_t i = 0; i < count; i += run) {
+        if ((res = ext2_write_blocks(ext2, block_no + i, count - i < run ? count - i : run, zeroes)) < 0) {
+            break;
+        }
+    }
+
+    free(zeroes);
+    return res < 0 ? res : 0;
+}
+
+// Get the inode table block the inode resides in and its offset inside the block
+int ext2_inode_location(fs_t *ext2, uint32_t ino, uint32_t *block_no, uint32_t *offset) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_grp_desc *desc;
+    int res;
 
     uint32_t ino_block_group_number = (ino - 1) / sb->sb.block_group_size_inodes;
-    //printf("inode block group number = %d\n", ino_block_group_number);
-    uint32_t ino_inode_table_block = sb->block_group_descriptor_table[ino_block_group_number].inode_table_block;
-    //printf("inode table is at block %d\n", ino_inode_table_block);
+    if ((res = ext2_group_desc(ext2, ino_block_group_number, &desc)) < 0) {
+        return res;
+    }
+    uint32_t ino_inode_table_block = desc->inode_table_block;
     uint32_t ino_inode_index_in_group = (ino - 1) % sb->sb.block_group_size_inodes;
-    //printf("inode entry index in the group = %d\n", ino_inode_index_in_group);
     uint32_t ino_inode_block_in_group = (ino_inode_index_in_group * sb->inode_struct_size) / sb->block_size;
-    //printf("inode entry offset is %d blocks\n", ino_inode_block_in_group);
-    uint32_t ino_inode_block_number = ino_inode_block_in_group + ino_inode_table_block;
-    //printf("inode block number is %uth block\n", ino_inode_block_number);
 
-    //struct ext2_inode *root_inode_block_inode_table = (struct ext2_inode *) root_inode_block_buf;
+    *block_no = ino_inode_block_in_group + ino_inode_table_block;
+    *offset = (ino_inode_index_in_group * sb->inode_struct_size) % sb->block_size;
+    return 0;
+}
+
+int ext2_read_inode(fs_t *ext2, struct ext2_inode *inode, uint32_t ino) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    char inode_block_buffer[sb->block_size];
+    uint32_t ino_inode_block_number, ino_entry_in_block;
+    int res;
+
+    if ((res = ext2_inode_location(ext2, ino, &ino_inode_block_number, &ino_entry_in_block)) < 0) {
+        return res;
+    }
+
+    ext2_group_lock(ext2, (ino - 1) / sb->sb.block_group_size_inodes);
     if (ext2_read_block(ext2, ino_inode_block_number, inode_block_buffer) < 0) {
+        ext2_group_unlock(ext2, (ino - 1) / sb->sb.block_group_size_inodes);
         printf("ext2: failed to load inode#%d block\n", ino);
         return -1;
     }
+    ext2_group_unlock(ext2, (ino - 1) / sb->sb.block_group_size_inodes);
 
-    uint32_t ino_entry_in_block = (ino_inode_index_in_group * sb->inode_struct_size) % sb->block_size;
     memcpy(inode, &inode_block_buffer[ino_entry_in_block], sb->inode_struct_size);
 
     return 0;
@@ -104,33 +588,26 @@ int ext2_read_inode(fs_t *ext2, struct ext2_inode *inode, uint32_t ino) {
 
 int ext2_write_inode(fs_t *ext2, const struct ext2_inode *inode, uint32_t ino) {
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
-    //printf("ext2_read_inode %d\n", ino);
     char inode_block_buffer[sb->block_size];
+    uint32_t ino_inode_block_number, ino_entry_in_block;
     int res;
 
-    uint32_t ino_block_group_number = (ino - 1) / sb->sb.block_group_size_inodes;
-    //printf("inode block group number = %d\n", ino_block_group_number);
-    uint32_t ino_inode_table_block = sb->block_group_descriptor_table[ino_block_group_number].inode_table_block;
-    //printf("inode table is at block %d\n", ino_inode_table_block);
-    uint32_t ino_inode_index_in_group = (ino - 1) % sb->sb.block_group_size_inodes;
-    //printf("inode entry index in the group = %d\n", ino_inode_index_in_group);
-    uint32_t ino_inode_block_in_group = (ino_inode_index_in_group * sb->inode_struct_size) / sb->block_size;
-    //printf("inode entry offset is %d blocks\n", ino_inode_block_in_group);
-    uint32_t ino_inode_block_number = ino_inode_block_in_group + ino_inode_table_block;
-    //printf("inode block number is %uth block\n", ino_inode_block_number);
-
-    // Need to read the block to modify it
-    if ((res = ext2_read_block(ext2, ino_inode_block_number, inode_block_buffer)) < 0) {
+    if ((res = ext2_inode_location(ext2, ino, &ino_inode_block_number, &ino_entry_in_block)) < 0) {
         return res;
     }
 
-    uint32_t ino_entry_in_block = (ino_inode_index_in_group * sb->inode_struct_size) % sb->block_size;
-    memcpy(&inode_block_buffer[ino_entry_in_block], inode, sb->inode_struct_size);
+    // Other inodes in the block may be written at the same time
+    ext2_group_lock(ext2, (ino - 1) / sb->sb.block_group_size_inodes);
 
-    // Write the block back
-    if ((res = ext2_write_block(ext2, ino_inode_block_number, inode_block_buffer)) < 0) {
-        return res;
+    // Need to read the block to modify it
+    if ((res = ext2_read_block(ext2, ino_inode_block_number, inode_block_buffer)) >= 0) {
+        memcpy(&inode_block_buffer[ino_entry_in_block], inode, sb->inode_struct_size);
+
+        // Write the block back
+        res = ext2_write_block(ext2, ino_inode_block_number, inode_block_buffer);
     }
 
-    return 0;
+    ext2_group_unlock(ext2, (ino - 1) / sb->sb.block_group_size_inodes);
+
+    return res < 0 ? res : 0;
 }
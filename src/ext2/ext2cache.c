@@ -0,0 +1,850 @@
+// ext2fs file data cache and write-back
+#include "ext2.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#define EXT2_PAGE_BUCKETS       32
+
+static void *ext2_flusher(void *arg);
+
+int ext2_cache_init(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_cache *cache = (struct ext2_cache *) malloc(sizeof(struct ext2_cache));
+
+    if (!cache) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->meta_lock, NULL);
+    for (size_t i = 0; i < EXT2_GROUP_LOCKS; ++i) {
+        pthread_mutex_init(&cache->group_locks[i], NULL);
+    }
+    pthread_mutex_init(&cache->rsv_lock, NULL);
+    pthread_mutex_init(&cache->bgdt_lock, NULL);
+    pthread_mutex_init(&cache->fext_lock, NULL);
+    pthread_mutex_init(&cache->orphan_lock, NULL);
+    pthread_mutex_init(&cache->reclaim_lock, NULL);
+    pthread_cond_init(&cache->reclaim_cond, NULL);
+    cache->reclaimer_stop = 0;
+    cache->reclaim = 0;
+    pthread_mutex_init(&cache->ra_lock, NULL);
+    pthread_cond_init(&cache->load_cond, NULL);
+    pthread_cond_init(&cache->flusher_cond, NULL);
+    cache->flusher_stop = 0;
+    cache->flush_all = 0;
+    cache->shrink = 0;
+    atomic_init(&cache->meta_dirty, 0);
+    cache->bgdt_prefetch = 0;
+    cache->fext_build = 0;
+    cache->ra_start = 0;
+    cache->ra_count = 0;
+    cache->ra_max = 0;
+    cache->ra_data = NULL;
+    // Bitmaps are only contiguous with flex_bg
+    if (sb->required_features & EXT2_REQ_FLEX_BG) {
+        cache->ra_max = EXT2_META_RA_MAX;
+        if (!(cache->ra_data = (char *) malloc(cache->ra_max * sb->block_size))) {
+            free(cache);
+            return -ENOMEM;
+        }
+    }
+    // The slots start spread over the groups
+    for (size_t i = 0; i < EXT2_ALLOC_SLOTS; ++i) {
+        atomic_init(&cache->slots[i].free_blocks, 0);
+        atomic_init(&cache->slots[i].free_inodes, 0);
+        atomic_init(&cache->slots[i].dirs, 0);
+        atomic_init(&cache->slots[i].group, (unsigned) (i * sb->block_group_count / EXT2_ALLOC_SLOTS));
+    }
+    cache->dirs_base = 0;
+    atomic_init(&cache->dirs_loaded, 0);
+    atomic_init(&cache->cached_pages, 0);
+    atomic_init(&cache->dirty_pages, 0);
+    atomic_init(&cache->delayed_pages, 0);
+    sb->cache = cache;
+
+    if (pthread_create(&cache->flusher, NULL, ext2_flusher, ext2) != 0) {
+        sb->cache = NULL;
+        free(cache->ra_data);
+        free(cache);
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+// Stop the flusher. It starts journal handles, so this goes before the
+// journal is released
+void ext2_cache_stop(fs_t *ext2) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->flusher_stop = 1;
+    pthread_cond_signal(&cache->flusher_cond);
+    pthread_mutex_unlock(&cache->lock);
+
+    pthread_join(cache->flusher, NULL);
+}
+
+// Drop the cached pages, the flusher is stopped. All the inodes are
+// written back by now, as the last reference to each of them flushes it,
+// unless the device failed even on the last try at umount
+void ext2_cache_release(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_cache *cache = sb->cache;
+
+    if (atomic_load(&cache->dirty_pages)) {
+        fprintf(stderr, "ext2: dropping %zu pages which failed to write back\n",
+                atomic_load(&cache->dirty_pages));
+    }
+    ext2_inode_info_prune(ext2);
+    assert(!atomic_load(&cache->cached_pages));
+    assert(!atomic_load(&cache->dirty_pages));
+
+    pthread_cond_destroy(&cache->load_cond);
+    pthread_cond_destroy(&cache->flusher_cond);
+    pthread_mutex_destroy(&cache->ra_lock);
+    pthread_cond_destroy(&cache->reclaim_cond);
+    pthread_mutex_destroy(&cache->reclaim_lock);
+    pthread_mutex_destroy(&cache->orphan_lock);
+    pthread_mutex_destroy(&cache->fext_lock);
+    pthread_mutex_destroy(&cache->bgdt_lock);
+    pthread_mutex_destroy(&cache->rsv_lock);
+    for (size_t i = 0; i < EXT2_GROUP_LOCKS; ++i) {
+        pthread_mutex_destroy(&cache->group_locks[i]);
+    }
+    pthread_mutex_destroy(&cache->meta_lock);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->ra_data);
+    free(cache);
+    sb->cache = NULL;
+}
+
+// Make the flusher write back everything right away, or evict clean
+// pages if shrink is set
+static void ext2_cache_kick(fs_t *ext2, int shrink) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    if (shrink) {
+        cache->shrink = 1;
+    } else {
+        cache->flush_all = 1;
+    }
+    pthread_cond_signal(&cache->flusher_cond);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Have the flusher load the rest of the BGDT in the background
+void ext2_cache_prefetch(fs_t *ext2) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->bgdt_prefetch = 1;
+    pthread_cond_signal(&cache->flusher_cond);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Have the flusher build the free extent index, it scans all the groups
+void ext2_cache_fext(fs_t *ext2) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->fext_build = 1;
+    pthread_cond_signal(&cache->flusher_cond);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void ext2_page_lru_del(struct ext2_inode_info *info, struct ext2_page *page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        info->lru_head = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    } else {
+        info->lru_tail = page->prev;
+    }
+}
+
+static void ext2_page_lru_add(struct ext2_inode_info *info, struct ext2_page *page) {
+    page->prev = NULL;
+    page->next = info->lru_head;
+    if (info->lru_head) {
+        info->lru_head->prev = page;
+    } else {
+        info->lru_tail = page;
+    }
+    info->lru_head = page;
+}
+
+struct ext2_page *ext2_page_find(struct ext2_inode_info *info, uint32_t index) {
+    struct ext2_page *page;
+
+    if (!info->pages || hash_get(info->pages, index, (void **) &page) != 0) {
+        return NULL;
+    }
+
+    return page;
+}
+
+// Get the page of the inode at index, creating it if needed. A new
+// page is filled with the current contents of the block if fill is set
+int ext2_page_get(fs_t *ext2, struct ext2_inode_info *info, uint32_t index, int fill, struct ext2_page **res_page) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_page *page;
+    int res;
+
+    if ((page = ext2_page_find(info, index))) {
+        if (page != info->lru_head) {
+            ext2_page_lru_del(info, page);
+            ext2_page_lru_add(info, page);
+        }
+        *res_page = page;
+        return 0;
+    }
+
+    // Make room, starting with the file's own pages
+    if (atomic_load(&sb->cache->cached_pages) >= EXT2_CACHE_MAX_PAGES &&
+        ext2_pages_shrink(ext2, info, EXT2_CACHE_SHRINK_BATCH) < EXT2_CACHE_SHRINK_BATCH) {
+        ext2_cache_kick(ext2, 1);
+    }
+
+    if (!info->pages) {
+        info->pages = (hash_t *) malloc(sizeof(hash_t));
+        memset(info->pages, 0, sizeof(hash_t));
+        info->pages->keycmp = hash_u64_keycmp;
+        info->pages->keyhsh = hash_u64_keyhsh;
+        hash_init(info->pages, EXT2_PAGE_BUCKETS);
+    }
+
+    if (!(page = (struct ext2_page *) malloc(sizeof(struct ext2_page) + sb->block_size))) {
+        return -ENOMEM;
+    }
+    page->index = index;
+    page->dirty = 0;
+    page->delayed = 0;
+    page->detached = 0;
+    page->pins = 0;
+
+    if (fill && (res = ext2_read_inode_block(ext2, info->inode, index, page->data)) < 0) {
+        free(page);
+        return res;
+    }
+
+    hash_put(info->pages, index, page);
+    ext2_page_lru_add(info, page);
+    atomic_fetch_add(&sb->cache->cached_pages, 1);
+
+    *res_page = page;
+    return 0;
+}
+
+// Mark the page dirty, mapped tells if it already has a block on disk
+void ext2_page_dirty(fs_t *ext2, struct ext2_inode_info *info, struct ext2_page *page, int mapped) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    if (page->dirty) {
+        return;
+    }
+
+    page->dirty = 1;
+    if (!info->ndirty++) {
+        info->dirty_since = time(NULL);
+    }
+    atomic_fetch_add(&cache->dirty_pages, 1);
+
+    if (!mapped) {
+        page->delayed = 1;
+        atomic_fetch_add(&cache->delayed_pages, 1);
+    }
+}
+
+// Make sure there's space for one more delayed page: its block and
+// the indirect blocks it may need get allocated at write-back, where
+// running out of space would lose the data
+int ext2_page_reserve(fs_t *ext2, struct ext2_inode_info *info) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t ptrs = sb->block_size / 4;
+
+    for (int i = 0; i < 2; ++i) {
+        size_t delayed = atomic_load(&sb->cache->delayed_pages) + 1;
+
+        if (ext2_free_blocks_count(ext2) >= delayed + delayed / ptrs + 3) {
+            return 0;
+        }
+
+        // Delayed pages of the inode itself may be what takes up the space,
+        // their worst case estimate is released once they are allocated
+        if (i == 0 && ext2_inode_flush(ext2, info) < 0) {
+            break;
+        }
+    }
+
+    return -ENOSPC;
+}
+
+// The page was written back
+static void ext2_page_clean(fs_t *ext2, struct ext2_inode_info *info, struct ext2_page *page) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    assert(page->dirty && !page->delayed);
+
+    page->dirty = 0;
+    if (!--info->ndirty) {
+        info->dirty_since = 0;
+    }
+    atomic_fetch_sub(&cache->dirty_pages, 1);
+}
+
+static void ext2_page_drop(fs_t *ext2, struct ext2_inode_info *info, struct ext2_page *page) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    if (page->dirty) {
+        if (!--info->ndirty) {
+            info->dirty_since = 0;
+        }
+        atomic_fetch_sub(&cache->dirty_pages, 1);
+    }
+    if (page->delayed) {
+        atomic_fetch_sub(&cache->delayed_pages, 1);
+    }
+
+    hash_del(info->pages, page->index);
+    ext2_page_lru_del(info, page);
+    atomic_fetch_sub(&cache->cached_pages, 1);
+
+    if (page->pins) {
+        // Still viewed, freed by the last ext2_page_unpin()
+        page->detached = 1;
+        return;
+    }
+    free(page);
+}
+
+// Release a view of the page. The caller holds info->lock
+void ext2_page_unpin(struct ext2_page *page) {
+    assert(page->pins);
+
+    if (!--page->pins && page->detached) {
+        free(page);
+    }
+}
+
+// Drop the pages starting from index, including the dirty ones
+void ext2_pages_truncate(fs_t *ext2, struct ext2_inode_info *info, uint32_t index) {
+    if (!info->pages) {
+        return;
+    }
+
+    for (size_t i = 0; i < info->pages->bucket_count; ++i) {
+        hash_entry_t *ent = info->pages->buckets[i];
+
+        while (ent) {
+            struct ext2_page *page = (struct ext2_page *) ent->value;
+            ent = ent->next;
+
+            if (page->index >= index) {
+                ext2_page_drop(ext2, info, page);
+            }
+        }
+    }
+
+    if (!index) {
+        free(info->pages->buckets);
+        free(info->pages);
+        info->pages = NULL;
+    }
+}
+
+// Evict up to count clean pages of the inode, least recently used
+// first. Returns the number of pages evicted
+size_t ext2_pages_shrink(fs_t *ext2, struct ext2_inode_info *info, size_t count) {
+    struct ext2_page *page = info->lru_tail;
+    size_t n = 0;
+
+    while (page && n < count) {
+        struct ext2_page *prev = page->prev;
+
+        if (!page->dirty && !page->pins) {
+            ext2_page_drop(ext2, info, page);
+            ++n;
+        }
+        page = prev;
+    }
+
+    return n;
+}
+
+static int ext2_page_cmp(const void *a, const void *b) {
+    const struct ext2_page *pa = *(const struct ext2_page **) a;
+    const struct ext2_page *pb = *(const struct ext2_page **) b;
+
+    return (pa->index > pb->index) - (pa->index < pb->index);
+}
+
+// Move the data of an inline file to a dirty page, which gets a block
+// at write-back like any other. The caller holds info->lock
+int ext2_inline_promote(fs_t *ext2, struct ext2_inode_info *info) {
+    struct ext2_page *page = NULL;
+    int res;
+
+    // Only the first block may have inline data
+    if (ext2_inode_size(info->inode) && (res = ext2_page_get(ext2, info, 0, 1, &page)) < 0) {
+        return res;
+    }
+
+    ext2_inline_drop(ext2, info->inode);
+    info->inode_dirty = 1;
+
+    if (page && !page->dirty) {
+        ext2_page_dirty(ext2, info, page, 0);
+    }
+
+    return 0;
+}
+
+// Put the data of an inline file back into the inode, which goes to
+// disk instead of the page
+static void ext2_inline_flush(fs_t *ext2, struct ext2_inode_info *info) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+    struct ext2_page *page = ext2_page_find(info, 0);
+
+    assert(info->ndirty == 1 && page && page->dirty);
+
+    ext2_inline_store(info->inode, page->data, ext2_inode_size(info->inode));
+    info->inode_dirty = 1;
+
+    if (page->delayed) {
+        page->delayed = 0;
+        atomic_fetch_sub(&cache->delayed_pages, 1);
+    }
+    ext2_page_clean(ext2, info, page);
+}
+
+// Give back blocks allocated for delayed pages but not mapped. What
+// can't be freed is leaked
+static void ext2_flush_unalloc(fs_t *ext2, uint32_t start, uint32_t count) {
+    struct ext2_free_batch batch = { 0 };
+
+    if (ext2_free_batch_add(ext2, &batch, start, count) >= 0) {
+        ext2_free_batch_apply(ext2, &batch);
+    }
+    free(batch.runs);
+}
+
+static void ext2_flush_mapped(fs_t *ext2, struct ext2_inode_info *info, struct ext2_page *page) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    info->inode->disk_sector_count += sb->block_size / 512;
+    info->inode_dirty = 1;
+    page->delayed = 0;
+    atomic_fetch_sub(&sb->cache->delayed_pages, 1);
+}
+
+// Map a run of delayed pages to the blocks allocated for them. If that
+// fails halfway, the pages which got mapped keep their blocks, the
+// blocks of the others are freed and they stay delayed
+static int ext2_flush_map_run(fs_t *ext2, struct ext2_inode_info *info, struct ext2_page **pages,
+                              const uint32_t *blocks, size_t count) {
+    uint32_t *mapped;
+    int res;
+
+    if ((res = ext2_inode_map_blocks(ext2, info->inode, pages[0]->index, blocks[0], count)) >= 0) {
+        for (size_t i = 0; i < count; ++i) {
+            ext2_flush_mapped(ext2, info, pages[i]);
+        }
+        return 0;
+    }
+
+    if (!(mapped = (uint32_t *) malloc(count * sizeof(uint32_t))) ||
+        ext2_inode_lookup_blocks(ext2, info->inode, pages[0]->index, count, mapped, NULL) < 0) {
+        free(mapped);
+        return res;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (mapped[i] == blocks[i]) {
+            ext2_flush_mapped(ext2, info, pages[i]);
+        } else {
+            ext2_flush_unalloc(ext2, blocks[i], 1);
+        }
+    }
+    free(mapped);
+
+    return res;
+}
+
+// The pages were written to blocks preallocated in uninitialized
+// extents: those read back what was written from now on
+static int ext2_flush_mark_init(fs_t *ext2, struct ext2_inode_info *info, struct ext2_page **pages,
+                                const char *uninit, size_t count) {
+    int res;
+
+    for (size_t i = 0; i < count;) {
+        size_t run = 1;
+
+        if (!uninit[i]) {
+            ++i;
+            continue;
+        }
+        while (i + run < count && uninit[i + run] && pages[i + run]->index == pages[i]->index + run) {
+            ++run;
+        }
+
+        if ((res = ext2_ext_mark_init(ext2, info->inode, pages[i]->index, run)) < 0) {
+            return res;
+        }
+        info->inode_dirty = 1;
+        i += run;
+    }
+
+    return 0;
+}
+
+// Write back all the dirty pages of the inode, but not the inode
+// itself. The pages without blocks get them here, all allocated as one
+// run. The caller holds info->lock
+int ext2_inode_flush_pages(fs_t *ext2, struct ext2_inode_info *info) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_cache *cache = sb->cache;
+    struct ext2_inode *inode = info->inode;
+    struct ext2_page **pages;
+    uint32_t *blocks;
+    char *uninit;
+    char *run_buffer = NULL;
+    size_t n = 0, ndelayed = 0;
+    size_t run_first = 0, run_len = 0;
+    uint32_t next = 0, avail = 0, goal = 0;
+    int res = 0;
+
+    if (!info->ndirty) {
+        return 0;
+    }
+
+    if (ext2_inode_inline(inode)) {
+        if (ext2_inline_fits(ext2, inode, ext2_inode_size(inode))) {
+            ext2_inline_flush(ext2, info);
+            return 0;
+        }
+        // Outgrew the inode
+        if ((res = ext2_inline_promote(ext2, info)) < 0) {
+            return res;
+        }
+    }
+
+    pages = (struct ext2_page **) malloc(info->ndirty * sizeof(struct ext2_page *));
+    blocks = (uint32_t *) malloc(info->ndirty * sizeof(uint32_t));
+    uninit = (char *) malloc(info->ndirty);
+    if (!pages || !blocks || !uninit) {
+        free(pages);
+        free(blocks);
+        free(uninit);
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < info->pages->bucket_count; ++i) {
+        for (hash_entry_t *ent = info->pages->buckets[i]; ent; ent = ent->next) {
+            struct ext2_page *page = (struct ext2_page *) ent->value;
+            if (page->dirty) {
+                pages[n++] = page;
+            }
+        }
+    }
+    assert(n == info->ndirty);
+    qsort(pages, n, sizeof(struct ext2_page *), ext2_page_cmp);
+
+    // The map is walked once per run of adjacent pages
+    for (size_t i = 0; i < n;) {
+        size_t run = 1;
+
+        while (i + run < n && pages[i + run]->index == pages[i]->index + run) {
+            ++run;
+        }
+        if ((res = ext2_inode_lookup_blocks(ext2, inode, pages[i]->index, run, &blocks[i], &uninit[i])) < 0) {
+            goto out;
+        }
+        i += run;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (!blocks[i]) {
+            ++ndelayed;
+        } else if (pages[i]->delayed) {
+            // Got a block by fallocate() meanwhile
+            pages[i]->delayed = 0;
+            atomic_fetch_sub(&cache->delayed_pages, 1);
+        }
+    }
+
+    // Allocate blocks for the delayed pages, asking for all of them at
+    // once so they end up contiguous unless the free space is fragmented.
+    // Pages adjacent both in the file and on disk are mapped as a run
+    for (size_t i = 0; i < n && ndelayed; ++i) {
+        if (blocks[i]) {
+            continue;
+        }
+
+        if (!avail) {
+            if (!goal) {
+                goal = ext2_inode_goal(ext2, inode, info->ino, pages[i]->index);
+            }
+            if ((res = ext2_rsv_alloc_blocks(ext2, &info->rsv, goal, ndelayed, &next, &avail)) < 0) {
+                if (run_len) {
+                    ext2_flush_unalloc(ext2, blocks[run_first], run_len);
+                }
+                goto out;
+            }
+        }
+
+        if (run_len && (pages[i]->index != pages[run_first]->index + run_len ||
+                        next != blocks[run_first] + run_len)) {
+            if ((res = ext2_flush_map_run(ext2, info, &pages[run_first], &blocks[run_first], run_len)) < 0) {
+                goto out;
+            }
+            run_len = 0;
+        }
+        if (!run_len) {
+            run_first = i;
+        }
+        ++run_len;
+
+        blocks[i] = next++;
+        goal = next;
+        --avail;
+        --ndelayed;
+    }
+    if (run_len && (res = ext2_flush_map_run(ext2, info, &pages[run_first], &blocks[run_first], run_len)) < 0) {
+        goto out;
+    }
+
+    // Write the pages, merging the ones which are contiguous on disk
+    for (size_t i = 0; i < n;) {
+        size_t run = 1;
+
+        while (i + run < n && run < EXT2_FLUSH_MAX_RUN && blocks[i + run] == blocks[i] + run) {
+            ++run;
+        }
+
+        if (run == 1) {
+            res = ext2_write_blocks(ext2, blocks[i], 1, pages[i]->data);
+        } else {
+            if (!run_buffer && !(run_buffer = malloc(EXT2_FLUSH_MAX_RUN * sb->block_size))) {
+                res = -ENOMEM;
+                goto out;
+            }
+            for (size_t j = 0; j < run; ++j) {
+                memcpy(run_buffer + j * sb->block_size, pages[i + j]->data, sb->block_size);
+            }
+            res = ext2_write_blocks(ext2, blocks[i], run, run_buffer);
+        }
+        if (res < 0 || (res = ext2_flush_mark_init(ext2, info, &pages[i], &uninit[i], run)) < 0) {
+            goto out;
+        }
+
+        // The data is on disk now, the pages stay cached for reading
+        for (size_t j = i; j < i + run; ++j) {
+            ext2_page_clean(ext2, info, pages[j]);
+        }
+
+        i += run;
+    }
+
+out:
+    // Left over from the last allocation when mapping failed
+    if (res < 0 && avail) {
+        ext2_flush_unalloc(ext2, next, avail);
+    }
+    free(run_buffer);
+    free(uninit);
+    free(blocks);
+    free(pages);
+    return res < 0 ? res : 0;
+}
+
+// Write back the dirty pages, then the inode: block map and size go to
+// disk after the data they refer to. The caller holds info->lock
+int ext2_inode_flush(fs_t *ext2, struct ext2_inode_info *info) {
+    int res;
+
+    if ((res = ext2_inode_flush_pages(ext2, info)) < 0) {
+        return res;
+    }
+    if (!info->inode_dirty) {
+        return 0;
+    }
+
+    if ((res = ext2_write_inode(ext2, info->inode, info->ino)) < 0) {
+        return res;
+    }
+    info->inode_dirty = 0;
+
+    return 0;
+}
+
+// Take references to the inodes to write back or shrink so that they
+// don't go away once cache->lock is released. The caller holds the lock
+static struct ext2_inode_info **ext2_cache_grab(fs_t *ext2, int flush_all, int shrink, time_t now, size_t *count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode_info **infos;
+
+    *count = 0;
+    if (!sb->inode_info->item_count ||
+        !(infos = malloc(sb->inode_info->item_count * sizeof(struct ext2_inode_info *)))) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sb->inode_info->bucket_count; ++i) {
+        for (hash_entry_t *ent = sb->inode_info->buckets[i]; ent; ent = ent->next) {
+            struct ext2_inode_info *info = (struct ext2_inode_info *) ent->value;
+
+            // Only a hint, checked again under the inode's lock
+            if (((info->ndirty || info->inode_dirty) &&
+                 (flush_all || now - info->dirty_since >= EXT2_DIRTY_EXPIRE)) ||
+                (shrink && info->pages)) {
+                ++info->refcount;
+                infos[(*count)++] = info;
+            }
+        }
+    }
+
+    return infos;
+}
+
+// Write back everything: file data, inodes and then the allocation
+// metadata
+int ext2_cache_sync(fs_t *ext2) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+    struct ext2_inode_info **infos;
+    size_t count;
+    int res = 0, err;
+
+    ext2_journal_start(ext2);
+
+    pthread_mutex_lock(&cache->lock);
+    infos = ext2_cache_grab(ext2, 1, 0, 0, &count);
+    pthread_mutex_unlock(&cache->lock);
+
+    for (size_t i = 0; i < count; ++i) {
+        pthread_mutex_lock(&infos[i]->lock);
+        if ((err = ext2_inode_flush(ext2, infos[i])) < 0 && !res) {
+            res = err;
+        }
+        pthread_mutex_unlock(&infos[i]->lock);
+
+        ext2_inode_info_put(ext2, infos[i]);
+    }
+    free(infos);
+
+    if ((err = ext2_write_meta(ext2)) < 0 && !res) {
+        res = err;
+    }
+
+    ext2_journal_stop(ext2);
+    return res;
+}
+
+// Write back the dirty inodes, either the ones dirty for long enough
+// or all of them when kicked. Evicts clean pages of all the inodes when
+// the cache is over its limit
+static void *ext2_flusher(void *arg) {
+    fs_t *ext2 = (fs_t *) arg;
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_cache *cache = sb->cache;
+
+    pthread_mutex_lock(&cache->lock);
+
+    while (!cache->flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += EXT2_FLUSH_INTERVAL;
+
+        if (!cache->flush_all && !cache->shrink && !cache->bgdt_prefetch && !cache->fext_build) {
+            pthread_cond_timedwait(&cache->flusher_cond, &cache->lock, &deadline);
+        }
+        if (cache->flusher_stop) {
+            break;
+        }
+
+        if (cache->bgdt_prefetch) {
+            cache->bgdt_prefetch = 0;
+            pthread_mutex_unlock(&cache->lock);
+            ext2_bgdt_prefetch(ext2);
+            pthread_mutex_lock(&cache->lock);
+        }
+        if (cache->fext_build) {
+            cache->fext_build = 0;
+            pthread_mutex_unlock(&cache->lock);
+            if (ext2_fext_build(ext2) < 0) {
+                fprintf(stderr, "ext2: failed to build the free extent index\n");
+            }
+            pthread_mutex_lock(&cache->lock);
+        }
+
+        int flush_all = cache->flush_all;
+        int shrink = atomic_load(&cache->cached_pages) > EXT2_CACHE_MAX_PAGES;
+        cache->flush_all = 0;
+        cache->shrink = 0;
+
+        time_t now = time(NULL);
+        size_t count = 0;
+        struct ext2_inode_info **infos = NULL;
+
+        if (atomic_load(&cache->dirty_pages) || shrink) {
+            infos = ext2_cache_grab(ext2, flush_all, shrink, now, &count);
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+
+        ext2_journal_start(ext2);
+        for (size_t i = 0; i < count; ++i) {
+            struct ext2_inode_info *info = infos[i];
+
+            pthread_mutex_lock(&info->lock);
+            if ((info->ndirty || info->inode_dirty) &&
+                (flush_all || now - info->dirty_since >= EXT2_DIRTY_EXPIRE) &&
+                ext2_inode_flush(ext2, info) < 0) {
+                fprintf(stderr, "ext2: write-back of inode %u failed\n", info->ino);
+            }
+
+            // Evict down to 3/4 of the limit so that readers don't hit it
+            // again right away
+            size_t cached = atomic_load(&cache->cached_pages);
+            if (shrink && info->pages && cached > EXT2_CACHE_MAX_PAGES * 3 / 4) {
+                ext2_pages_shrink(ext2, info, cached - EXT2_CACHE_MAX_PAGES * 3 / 4);
+            }
+            pthread_mutex_unlock(&info->lock);
+
+            // Unused inodes without pages left go away here
+            ext2_inode_info_put(ext2, info);
+        }
+        free(infos);
+
+        // Free counts follow the inodes written above
+        if (ext2_write_meta(ext2) < 0) {
+            fprintf(stderr, "ext2: failed to write back BGDT and superblock\n");
+        }
+        ext2_journal_stop(ext2);
+
+        pthread_mutex_lock(&cache->lock);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+// Called by writers after dirtying pages, holding info->lock: past the
+// dirty limit they write back their own pages and kick the flusher
+int ext2_cache_throttle(fs_t *ext2, struct ext2_inode_info *info) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    if (atomic_load(&cache->dirty_pages) <= EXT2_DIRTY_MAX_PAGES) {
+        return 0;
+    }
+
+    ext2_cache_kick(ext2, 0);
+    return ext2_inode_flush(ext2, info);
+}
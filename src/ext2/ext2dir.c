@@ -7,11 +7,97 @@
 #include <errno.h>
 #include <stdio.h>
 
+// Inline directories look like a single block to the directory code
+uint64_t ext2_dir_size(fs_t *ext2, const struct ext2_inode *inode) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    if (ext2_inode_inline(inode)) {
+        return sb->block_size;
+    }
+    return inode->size_lower;
+}
+
+// The entry at off lies within the block and holds its name
+int ext2_dirent_valid(fs_t *ext2, const void *block, size_t off) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    const struct ext2_dirent *dirent = (const struct ext2_dirent *) ((const char *) block + off);
+
+    if ((off & 3) || off + sizeof(struct ext2_dirent) > sb->block_size) {
+        return 0;
+    }
+    return dirent->len >= sizeof(struct ext2_dirent) && !(dirent->len & 3) &&
+           off + dirent->len <= sb->block_size &&
+           sizeof(struct ext2_dirent) + dirent->name_len <= dirent->len;
+}
+
+// The entries must chain up to the end of the block, the directory code
+// walks them without checking
+int ext2_dir_read_block(fs_t *ext2, vnode_t *dir, uint32_t index, void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode *inode = ext2_vnode_inode(dir);
+    size_t off;
+    int res;
+
+    if (ext2_inode_inline(inode)) {
+        if ((res = ext2_inline_dir_read(ext2, inode, dir->fs_number, buf)) < 0) {
+            return res;
+        }
+        res = sb->block_size;
+    } else if ((res = ext2_read_inode_block(ext2, inode, index, buf)) < 0) {
+        return res;
+    }
+
+    for (off = 0; off < sb->block_size; off += ((struct ext2_dirent *) ((char *) buf + off))->len) {
+        if (!ext2_dirent_valid(ext2, buf, off)) {
+            fprintf(stderr, "ext2: bad directory entry in inode %u, block %u offset %zu\n",
+                    dir->fs_number, index, off);
+            return -EIO;
+        }
+    }
+
+    return res;
+}
+
+// The entries of an inline directory outgrew the inode: give it the
+// block made up by ext2_dir_read_block()
+static int ext2_dir_promote(fs_t *ext2, vnode_t *dir, const void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode *inode = ext2_vnode_inode(dir);
+    char saved[sb->inode_struct_size];
+    uint32_t block_no;
+    int res;
+
+    memcpy(saved, inode, sb->inode_struct_size);
+    ext2_inline_drop(ext2, inode);
+    inode->size_lower = sb->block_size;
+
+    if ((res = ext2_inode_alloc_block(ext2, inode, dir->fs_number, 0, &block_no)) < 0) {
+        memcpy(inode, saved, sb->inode_struct_size);
+        return res;
+    }
+
+    return ext2_write_block(ext2, block_no, buf);
+}
+
+static int ext2_dir_write_block(fs_t *ext2, vnode_t *dir, uint32_t index, const void *buf) {
+    struct ext2_inode *inode = ext2_vnode_inode(dir);
+    int res;
+
+    if (ext2_inode_inline(inode)) {
+        if ((res = ext2_inline_dir_store(ext2, inode, buf)) == -ENOSPC) {
+            return ext2_dir_promote(ext2, dir, buf);
+        }
+        return ext2_write_inode(ext2, inode, dir->fs_number);
+    }
+
+    return ext2_write_inode_block(ext2, inode, index, buf);
+}
+
 // Add an inode to directory
-int ext2_dir_add_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino) {
+int ext2_dir_add_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino, enum vnode_type type) {
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
     char block_buffer[sb->block_size];
-    struct ext2_inode *dir_inode = dir->fs_data;
+    struct ext2_inode *dir_inode = ext2_vnode_inode(dir);
     struct ext2_dirent *current_dirent, *result_dirent;
     int res;
     int found = 0;
@@ -22,7 +108,7 @@ int ext2_dir_add_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino)
 
     // Try reading parent dirent blocks to see if any has
     // some space to fit our file
-    size_t dir_size_blocks = (dir_inode->size_lower + sb->block_size - 1) / sb->block_size;
+    size_t dir_size_blocks = (ext2_dir_size(ext2, dir_inode) + sb->block_size - 1) / sb->block_size;
     for (size_t i = 0; i < dir_size_blocks; ++i) {
         current_dirent = NULL;
         result_dirent = NULL;
@@ -30,7 +116,7 @@ int ext2_dir_add_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino)
         size_t off = 0;
 
         // Read directory content block
-        if ((res = ext2_read_inode_block(ext2, dir_inode, i, block_buffer)) < 0) {
+        if ((res = ext2_dir_read_block(ext2, dir, i, block_buffer)) < 0) {
             return res;
         }
 
@@ -55,12 +141,12 @@ int ext2_dir_add_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino)
                 result_dirent = (struct ext2_dirent *) &block_buffer[off + real_len];
                 result_dirent->len = current_dirent->len - real_len;
                 result_dirent->name_len = strlen(name);
-                result_dirent->type_ind = 0;
+                result_dirent->type_ind = ext2_dirent_type(ext2, type);
                 result_dirent->ino = ino;
                 strncpy(result_dirent->name, name, result_dirent->name_len);
                 current_dirent->len = real_len;
 
-                if ((res = ext2_write_inode_block(ext2, dir_inode, i, block_buffer)) < 0) {
+                if ((res = ext2_dir_write_block(ext2, dir, i, block_buffer)) < 0) {
                     return res;
                 }
 
@@ -71,8 +157,9 @@ int ext2_dir_add_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino)
         }
     }
 
+    uint32_t block_no;
     dir_inode->size_lower += sb->block_size;
-    if ((res = ext2_inode_alloc_block(ext2, dir_inode, dir->fs_number, dir_size_blocks)) < 0) {
+    if ((res = ext2_inode_alloc_block(ext2, dir_inode, dir->fs_number, dir_size_blocks, &block_no)) < 0) {
         dir_inode->size_lower -= sb->block_size;
         return res;
     }
@@ -82,14 +169,40 @@ int ext2_dir_add_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino)
     current_dirent->ino = ino;
     current_dirent->len = sb->block_size;
     current_dirent->name_len = strlen(name);
-    current_dirent->type_ind = 0;
+    current_dirent->type_ind = ext2_dirent_type(ext2, type);
     strncpy(current_dirent->name, name, current_dirent->name_len);
 
     return ext2_write_inode_block(ext2, dir_inode, dir_size_blocks, block_buffer);
 }
 
+// Extents can't shift the blocks past index down: unless it's the last
+// block, it stays as a block with no entries
+static int ext2_free_extent_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t ino, size_t sz) {
+    char block_buffer[sz];
+    struct ext2_dirent *dirent = (struct ext2_dirent *) block_buffer;
+    int res;
+
+    if ((index + 1) * sz < inode->size_lower) {
+        memset(block_buffer, 0, sz);
+        dirent->len = sz;
+        return ext2_write_inode_block(ext2, inode, index, block_buffer);
+    }
+
+    inode->size_lower -= sz;
+    if ((res = ext2_free_inode_blocks(ext2, inode, index, 1)) < 0) {
+        inode->size_lower += sz;
+        return res;
+    }
+
+    return ext2_write_inode(ext2, inode, ino);
+}
+
 // Not only free the block itself, but also remove it from index list
 static int ext2_free_block_index(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t ino, size_t sz) {
+    if (ext2_inode_extents(inode)) {
+        return ext2_free_extent_block(ext2, inode, index, ino, sz);
+    }
+
     if (index >= 12) {
         // TODO: Implement this
         abort();
@@ -101,6 +214,7 @@ static int ext2_free_block_index(fs_t *ext2, struct ext2_inode *inode, uint32_t
     if ((res = ext2_free_block(ext2, block_no)) < 0) {
         return res;
     }
+    inode->disk_sector_count -= sz / 512;
 
     // Shift direct indexed blocks
     for (uint32_t i = index; i < 11; ++i) {
@@ -117,14 +231,14 @@ static int ext2_free_block_index(fs_t *ext2, struct ext2_inode *inode, uint32_t
 int ext2_dir_remove_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t ino) {
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
     char block_buffer[sb->block_size];
-    struct ext2_inode *dir_inode = dir->fs_data;
+    struct ext2_inode *dir_inode = ext2_vnode_inode(dir);
     struct ext2_dirent *current_dirent, *prev_dirent;
     int res;
 
-    size_t dir_size_blocks = (dir_inode->size_lower + sb->block_size - 1) / sb->block_size;
+    size_t dir_size_blocks = (ext2_dir_size(ext2, dir_inode) + sb->block_size - 1) / sb->block_size;
 
     for (size_t i = 0; i < dir_size_blocks; ++i) {
-        if ((res = ext2_read_inode_block(ext2, dir_inode, i, block_buffer)) < 0) {
+        if ((res = ext2_dir_read_block(ext2, dir, i, block_buffer)) < 0) {
             return res;
         }
 
@@ -154,7 +268,7 @@ int ext2_dir_remove_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t i
 
                     // Resize the previous node
                     prev_dirent->len += current_dirent->len;
-                    return ext2_write_inode_block(ext2, dir_inode, i, block_buffer);
+                    return ext2_dir_write_block(ext2, dir, i, block_buffer);
                 } else {
                     // It's not the last one - relocate the next entry
                     uint32_t len = current_dirent->len;
@@ -163,7 +277,7 @@ int ext2_dir_remove_inode(fs_t *ext2, vnode_t *dir, const char *name, uint32_t i
                     next_dirent = current_dirent;
                     next_dirent->len += len;
                     assert(((off + len) & 3) == 0);
-                    return ext2_write_inode_block(ext2, dir_inode, i, block_buffer);
+                    return ext2_dir_write_block(ext2, dir, i, block_buffer);
                 }
             }
 
@@ -0,0 +1,739 @@
+// ext2fs extent trees: ext4-style block mapping of the inodes with
+// EXT2_INODE_EXTENTS, a run of contiguous blocks per leaf entry
+#include "ext2.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+
+#define MIN(x, y) ((x) > (y) ? (y) : (x))
+
+// Longest extent. Longer len values mark the extent uninitialized:
+// its blocks are allocated but read back as zeroes
+#define EXT2_EXT_INIT_MAX_LEN       32768
+// Deepest tree ext4 makes
+#define EXT2_EXT_MAX_DEPTH          5
+// The root in i_block[] has room for 4 entries
+#define EXT2_EXT_ROOT_MAX           4
+
+#define ext2_ext_root(i)            ((struct ext2_ext_header *) ext2_inode_block_ptrs(i))
+#define ext2_ext_extents(h)         ((struct ext2_extent *) ((h) + 1))
+#define ext2_ext_index(h)           ((struct ext2_ext_idx *) ((h) + 1))
+// Both kinds of entries are 12 bytes and start with the first block
+// of the file they map
+#define ext2_ext_key(h, i)          (*(uint32_t *) ((char *) ((h) + 1) + (i) * 12))
+#define ext2_ext_node_max(sb)       (((sb)->block_size - sizeof(struct ext2_ext_header)) / 12)
+
+// A node on the way from the root to a leaf
+struct ext2_ext_path {
+    // Where the node is stored, 0 for the root in the inode
+    uint32_t block_no;
+    struct ext2_ext_header *hdr;
+    // Entry followed down or, in the leaf, the last extent starting
+    // at or before the block looked up: -1 if there's none
+    int pos;
+};
+
+static uint32_t ext2_ext_len(const struct ext2_extent *ext) {
+    return ext->len > EXT2_EXT_INIT_MAX_LEN ? ext->len - EXT2_EXT_INIT_MAX_LEN : ext->len;
+}
+
+static int ext2_ext_uninit(const struct ext2_extent *ext) {
+    return ext->len > EXT2_EXT_INIT_MAX_LEN;
+}
+
+static void ext2_ext_set_len(struct ext2_extent *ext, uint32_t len, int uninit) {
+    ext->len = len + (uninit ? EXT2_EXT_INIT_MAX_LEN : 0);
+}
+
+// Does the run of count blocks from start lie in the data blocks of
+// the filesystem
+static int ext2_ext_range_valid(struct ext2_extsb *sb, uint32_t start, uint32_t count) {
+    return start > sb->sb.sb_block_number && (uint64_t) start + count <= sb->sb.block_count;
+}
+
+// Same checks ext4 does on the entries of a node: the blocks pointed
+// to are on the device and the keys are in order without overlaps
+static int ext2_ext_entries_valid(struct ext2_extsb *sb, struct ext2_ext_header *hdr) {
+    uint64_t next = 0;
+
+    for (int i = 0; i < hdr->entries; ++i) {
+        if (hdr->depth) {
+            struct ext2_ext_idx *idx = &ext2_ext_index(hdr)[i];
+
+            if (idx->leaf_hi || !ext2_ext_range_valid(sb, idx->leaf, 1) || (i && idx->block < next)) {
+                return 0;
+            }
+            next = (uint64_t) idx->block + 1;
+        } else {
+            struct ext2_extent *ext = &ext2_ext_extents(hdr)[i];
+            uint32_t len = ext2_ext_len(ext);
+
+            if (ext->start_hi || !len || !ext2_ext_range_valid(sb, ext->start, len) || ext->block < next ||
+                (uint64_t) ext->block + len > UINT32_MAX + (uint64_t) 1) {
+                return 0;
+            }
+            next = (uint64_t) ext->block + len;
+        }
+    }
+    return 1;
+}
+
+static int ext2_ext_check(fs_t *ext2, struct ext2_ext_header *hdr, uint16_t max, int depth) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    if (hdr->magic != EXT2_EXT_MAGIC || hdr->entries > hdr->max || hdr->max > max ||
+        (depth >= 0 && hdr->depth != depth) || hdr->depth > EXT2_EXT_MAX_DEPTH ||
+        !ext2_ext_entries_valid(sb, hdr)) {
+        printf("ext2: bad extent tree node\n");
+        return -EIO;
+    }
+    return 0;
+}
+
+// Read a tree node other than the root into buf
+static int ext2_ext_read_node(fs_t *ext2, uint32_t block_no, uint16_t leaf_hi, int depth, void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int res;
+
+    // Block numbers are 32-bit here
+    if (leaf_hi || !ext2_ext_range_valid(sb, block_no, 1)) {
+        return -EIO;
+    }
+    if ((res = ext2_read_block(ext2, block_no, buf)) < 0) {
+        return res;
+    }
+
+    return ext2_ext_check(ext2, (struct ext2_ext_header *) buf, ext2_ext_node_max(sb), depth);
+}
+
+static int ext2_ext_write_node(fs_t *ext2, struct ext2_ext_path *node) {
+    int res;
+
+    // The root is written along with the inode
+    if (!node->block_no) {
+        return 0;
+    }
+    if ((res = ext2_write_block(ext2, node->block_no, node->hdr)) < 0) {
+        return res;
+    }
+    return 0;
+}
+
+// Last entry of the node starting at or before index, -1 if none
+static int ext2_ext_search(struct ext2_ext_header *hdr, uint32_t index) {
+    int lo = 0, hi = (int) hdr->entries - 1, pos = -1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+
+        if (ext2_ext_key(hdr, mid) <= index) {
+            pos = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return pos;
+}
+
+int ext2_ext_enabled(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    return !!(sb->required_features & EXT2_REQ_EXTENTS);
+}
+
+// Make i_block[] of a new inode an empty extent tree
+void ext2_ext_init(struct ext2_inode *inode) {
+    struct ext2_ext_header *hdr = ext2_ext_root(inode);
+
+    memset(hdr, 0, EXT2_INLINE_SIZE);
+    hdr->magic = EXT2_EXT_MAGIC;
+    hdr->max = EXT2_EXT_ROOT_MAX;
+    inode->flags |= EXT2_INODE_EXTENTS;
+}
+
+// Find the device block backing the block index, 0 if there's a hole.
+// uninit, if given, tells if the block is in an uninitialized extent
+int ext2_ext_get_block(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t *block_no, int *uninit) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_ext_header *hdr = ext2_ext_root(inode);
+    char buf[sb->block_size];
+    int pos, res;
+
+    if ((res = ext2_ext_check(ext2, hdr, EXT2_EXT_ROOT_MAX, -1)) < 0) {
+        return res;
+    }
+
+    *block_no = 0;
+    if (uninit) {
+        *uninit = 0;
+    }
+
+    while (hdr->depth) {
+        struct ext2_ext_idx *idx;
+
+        if ((pos = ext2_ext_search(hdr, index)) < 0) {
+            return 0;
+        }
+        idx = &ext2_ext_index(hdr)[pos];
+        if ((res = ext2_ext_read_node(ext2, idx->leaf, idx->leaf_hi, hdr->depth - 1, buf)) < 0) {
+            return res;
+        }
+        hdr = (struct ext2_ext_header *) buf;
+    }
+
+    if ((pos = ext2_ext_search(hdr, index)) >= 0) {
+        struct ext2_extent *ext = &ext2_ext_extents(hdr)[pos];
+
+        if (ext->start_hi) {
+            return -EIO;
+        }
+        if (index - ext->block < ext2_ext_len(ext)) {
+            *block_no = ext->start + (index - ext->block);
+            if (uninit) {
+                *uninit = ext2_ext_uninit(ext);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Same as ext2_ext_get_block() for count blocks from index, 0 for the
+// holes. Each leaf is searched once, not each block
+int ext2_ext_get_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count,
+                        uint32_t *blocks, char *uninit) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    char buf[sb->block_size];
+    uint64_t end = (uint64_t) index + count;
+    uint64_t at = index;
+    int pos, res;
+
+    if ((res = ext2_ext_check(ext2, ext2_ext_root(inode), EXT2_EXT_ROOT_MAX, -1)) < 0) {
+        return res;
+    }
+
+    while (at < end) {
+        struct ext2_ext_header *hdr = ext2_ext_root(inode);
+        // First block past the part of the tree the leaf covers
+        uint64_t limit = end;
+
+        pos = ext2_ext_search(hdr, at);
+        while (hdr->depth && pos >= 0) {
+            struct ext2_ext_idx *idx = &ext2_ext_index(hdr)[pos];
+
+            if (pos + 1 < hdr->entries) {
+                limit = MIN(limit, ext2_ext_key(hdr, pos + 1));
+            }
+            if ((res = ext2_ext_read_node(ext2, idx->leaf, idx->leaf_hi, hdr->depth - 1, buf)) < 0) {
+                return res;
+            }
+            hdr = (struct ext2_ext_header *) buf;
+            pos = ext2_ext_search(hdr, at);
+        }
+        if (pos < 0 && hdr->entries) {
+            limit = MIN(limit, ext2_ext_key(hdr, 0));
+        }
+
+        for (pos = pos < 0 ? 0 : pos; !hdr->depth && pos < hdr->entries && at < limit; ++pos) {
+            struct ext2_extent *ext = &ext2_ext_extents(hdr)[pos];
+            uint64_t ext_end = (uint64_t) ext->block + ext2_ext_len(ext);
+
+            if (ext->start_hi) {
+                return -EIO;
+            }
+            for (; at < limit && at < ext->block; ++at) {
+                blocks[at - index] = 0;
+                if (uninit) {
+                    uninit[at - index] = 0;
+                }
+            }
+            for (; at < limit && at < ext_end; ++at) {
+                blocks[at - index] = ext->start + (uint32_t) (at - ext->block);
+                if (uninit) {
+                    uninit[at - index] = (char) ext2_ext_uninit(ext);
+                }
+            }
+        }
+
+        // Nothing mapped up to the next leaf
+        for (; at < limit; ++at) {
+            blocks[at - index] = 0;
+            if (uninit) {
+                uninit[at - index] = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Fill path with the nodes leading to the leaf for index. Index nodes
+// are followed even before their first entry: new extents go there.
+// buffers has room for the blocks of EXT2_EXT_MAX_DEPTH nodes
+static int ext2_ext_find(fs_t *ext2, struct ext2_inode *inode, uint32_t index, struct ext2_ext_path *path, char *buffers) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_ext_header *hdr = ext2_ext_root(inode);
+    int depth, res;
+
+    if ((res = ext2_ext_check(ext2, hdr, EXT2_EXT_ROOT_MAX, -1)) < 0) {
+        return res;
+    }
+    depth = hdr->depth;
+
+    path[0].block_no = 0;
+    for (int level = 0;; ++level) {
+        path[level].hdr = hdr;
+        path[level].pos = ext2_ext_search(hdr, index);
+
+        if (level == depth) {
+            return depth;
+        }
+        if (!hdr->entries) {
+            return -EIO;
+        }
+        if (path[level].pos < 0) {
+            path[level].pos = 0;
+        }
+
+        struct ext2_ext_idx *idx = &ext2_ext_index(hdr)[path[level].pos];
+        char *buf = buffers + level * sb->block_size;
+
+        if ((res = ext2_ext_read_node(ext2, idx->leaf, idx->leaf_hi, depth - level - 1, buf)) < 0) {
+            return res;
+        }
+        path[level + 1].block_no = idx->leaf;
+        hdr = (struct ext2_ext_header *) buf;
+    }
+}
+
+// The first entry of the node at level changed, so do the index
+// entries pointing to it
+static int ext2_ext_fix_keys(fs_t *ext2, struct ext2_ext_path *path, int level) {
+    uint32_t key = ext2_ext_key(path[level].hdr, 0);
+    int res;
+
+    for (int i = level - 1; i >= 0; --i) {
+        ext2_ext_index(path[i].hdr)[path[i].pos].block = key;
+        if ((res = ext2_ext_write_node(ext2, &path[i])) < 0) {
+            return res;
+        }
+        if (path[i].pos) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// The node at level is full: split it, or move the root down a level
+// if it's the root. Only makes room in the parent if that is full too,
+// the caller looks the path up again and retries
+static int ext2_ext_make_room(fs_t *ext2, struct ext2_inode *inode, struct ext2_ext_path *path, int level) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_ext_header *hdr = path[level].hdr;
+    char buf[sb->block_size];
+    struct ext2_ext_header *node = (struct ext2_ext_header *) buf;
+    uint32_t block_no;
+    int res;
+
+    if (level && path[level - 1].hdr->entries == path[level - 1].hdr->max) {
+        return ext2_ext_make_room(ext2, inode, path, level - 1);
+    }
+    if (!level && hdr->depth == EXT2_EXT_MAX_DEPTH) {
+        return -EFBIG;
+    }
+
+    if ((res = ext2_alloc_block(ext2, &block_no)) < 0) {
+        return res;
+    }
+    inode->disk_sector_count += sb->block_size / 512;
+
+    memset(buf, 0, sb->block_size);
+    node->magic = EXT2_EXT_MAGIC;
+    node->max = ext2_ext_node_max(sb);
+    node->depth = hdr->depth;
+
+    if (!level) {
+        // All of the root goes into the new node, which becomes the
+        // only child of the root
+        node->entries = hdr->entries;
+        memcpy(node + 1, hdr + 1, hdr->entries * 12);
+        if ((res = ext2_write_block(ext2, block_no, buf)) < 0) {
+            goto fail;
+        }
+
+        memset(hdr + 1, 0, EXT2_INLINE_SIZE - sizeof(struct ext2_ext_header));
+        ++hdr->depth;
+        hdr->entries = 1;
+        ext2_ext_index(hdr)[0].block = ext2_ext_key(node, 0);
+        ext2_ext_index(hdr)[0].leaf = block_no;
+        return 0;
+    }
+
+    // Entries past the one followed move to the new node. Appending
+    // moves just the last one, which leaves the old node full
+    int count = hdr->entries;
+    int split = path[level].pos + 1;
+
+    if (split > count - 1) {
+        split = count - 1;
+    }
+    if (split < 1) {
+        split = 1;
+    }
+
+    node->entries = count - split;
+    memcpy(node + 1, (char *) (hdr + 1) + split * 12, (count - split) * 12);
+    if ((res = ext2_write_block(ext2, block_no, buf)) < 0) {
+        goto fail;
+    }
+
+    hdr->entries = split;
+    memset((char *) (hdr + 1) + split * 12, 0, (count - split) * 12);
+    if ((res = ext2_ext_write_node(ext2, &path[level])) < 0) {
+        return res;
+    }
+
+    // Index the new node right after the old one
+    struct ext2_ext_header *parent = path[level - 1].hdr;
+    struct ext2_ext_idx *idx = ext2_ext_index(parent);
+    int pos = path[level - 1].pos + 1;
+
+    memmove(&idx[pos + 1], &idx[pos], (parent->entries - pos) * sizeof(struct ext2_ext_idx));
+    memset(&idx[pos], 0, sizeof(struct ext2_ext_idx));
+    idx[pos].block = ext2_ext_key(node, 0);
+    idx[pos].leaf = block_no;
+    ++parent->entries;
+
+    return ext2_ext_write_node(ext2, &path[level - 1]);
+
+fail:
+    // Nothing points to the new node yet
+    ext2_free_block(ext2, block_no);
+    inode->disk_sector_count -= sb->block_size / 512;
+    return res;
+}
+
+// Map len blocks from start on to the file from index on, which must
+// be a hole. Continues a neighbouring extent when possible
+static int ext2_ext_insert(fs_t *ext2, struct ext2_inode *inode, char *buffers,
+                           uint32_t index, uint32_t start, uint32_t len, int uninit) {
+    struct ext2_ext_path path[EXT2_EXT_MAX_DEPTH + 1];
+    uint32_t max_len = uninit ? EXT2_EXT_INIT_MAX_LEN - 1 : EXT2_EXT_INIT_MAX_LEN;
+    int depth, res;
+
+    while (1) {
+        if ((depth = ext2_ext_find(ext2, inode, index, path, buffers)) < 0) {
+            return depth;
+        }
+
+        struct ext2_ext_path *leaf = &path[depth];
+        struct ext2_extent *ext = ext2_ext_extents(leaf->hdr);
+        int pos = leaf->pos;
+
+        if (pos >= 0 && ext2_ext_uninit(&ext[pos]) == uninit &&
+            ext[pos].block + ext2_ext_len(&ext[pos]) == index &&
+            ext[pos].start + ext2_ext_len(&ext[pos]) == start &&
+            ext2_ext_len(&ext[pos]) + len <= max_len) {
+            ext2_ext_set_len(&ext[pos], ext2_ext_len(&ext[pos]) + len, uninit);
+            return ext2_ext_write_node(ext2, leaf);
+        }
+
+        if (pos + 1 < leaf->hdr->entries && ext2_ext_uninit(&ext[pos + 1]) == uninit &&
+            index + len == ext[pos + 1].block && start + len == ext[pos + 1].start &&
+            ext2_ext_len(&ext[pos + 1]) + len <= max_len) {
+            ext[pos + 1].block = index;
+            ext[pos + 1].start = start;
+            ext2_ext_set_len(&ext[pos + 1], ext2_ext_len(&ext[pos + 1]) + len, uninit);
+            if ((res = ext2_ext_write_node(ext2, leaf)) < 0) {
+                return res;
+            }
+            return pos + 1 ? 0 : ext2_ext_fix_keys(ext2, path, depth);
+        }
+
+        if (leaf->hdr->entries < leaf->hdr->max) {
+            ++pos;
+            memmove(&ext[pos + 1], &ext[pos], (leaf->hdr->entries - pos) * sizeof(struct ext2_extent));
+            memset(&ext[pos], 0, sizeof(struct ext2_extent));
+            ext[pos].block = index;
+            ext[pos].start = start;
+            ext2_ext_set_len(&ext[pos], len, uninit);
+            ++leaf->hdr->entries;
+
+            if ((res = ext2_ext_write_node(ext2, leaf)) < 0) {
+                return res;
+            }
+            return pos ? 0 : ext2_ext_fix_keys(ext2, path, depth);
+        }
+
+        if ((res = ext2_ext_make_room(ext2, inode, path, depth)) < 0) {
+            return res;
+        }
+    }
+}
+
+// Map count blocks from block_no on to the file from index on, which
+// must be a hole. With uninit, they read back as zeroes until written.
+// The tree blocks are written, the inode is not
+int ext2_ext_map_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t block_no, uint32_t count,
+                        int uninit) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    char *buffers = (char *) malloc(EXT2_EXT_MAX_DEPTH * sb->block_size);
+    int res = 0;
+
+    if (!buffers) {
+        return -ENOMEM;
+    }
+
+    while (count) {
+        uint32_t len = MIN(count, uninit ? EXT2_EXT_INIT_MAX_LEN - 1 : EXT2_EXT_INIT_MAX_LEN);
+
+        if ((res = ext2_ext_insert(ext2, inode, buffers, index, block_no, len, uninit)) < 0) {
+            break;
+        }
+        index += len;
+        block_no += len;
+        count -= len;
+    }
+
+    free(buffers);
+    return res;
+}
+
+// The node at level lost its last entry: free it and drop its index
+// entry, up to the first node which still has entries. An empty tree
+// is a single leaf again
+static int ext2_ext_drop_node(fs_t *ext2, struct ext2_inode *inode, struct ext2_ext_path *path, int level,
+                              struct ext2_free_batch *batch) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int res;
+
+    while (level && !path[level].hdr->entries) {
+        if ((res = ext2_free_batch_add(ext2, batch, path[level].block_no, 1)) < 0) {
+            return res;
+        }
+        inode->disk_sector_count -= sb->block_size / 512;
+
+        --level;
+        struct ext2_ext_header *hdr = path[level].hdr;
+        struct ext2_ext_idx *idx = ext2_ext_index(hdr);
+        int pos = path[level].pos;
+
+        memmove(&idx[pos], &idx[pos + 1], (hdr->entries - pos - 1) * sizeof(struct ext2_ext_idx));
+        --hdr->entries;
+        memset(&idx[hdr->entries], 0, sizeof(struct ext2_ext_idx));
+    }
+
+    if (!level && !path[0].hdr->entries) {
+        path[0].hdr->depth = 0;
+    }
+    if ((res = ext2_ext_write_node(ext2, &path[level])) < 0) {
+        return res;
+    }
+
+    if (path[level].hdr->entries && !path[level].pos) {
+        return ext2_ext_fix_keys(ext2, path, level);
+    }
+    return 0;
+}
+
+// Unmap count blocks of the file from index on and add them to the
+// batch, holes are skipped. The tree blocks are written, the inode is not
+int ext2_ext_free_blocks(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count,
+                         struct ext2_free_batch *batch) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_ext_path path[EXT2_EXT_MAX_DEPTH + 1];
+    char *buffers = (char *) malloc(EXT2_EXT_MAX_DEPTH * sb->block_size);
+    uint64_t end = (uint64_t) index + count;
+    uint64_t pos_index = index;
+    int depth, res = 0;
+
+    if (!buffers) {
+        return -ENOMEM;
+    }
+
+    while (pos_index < end) {
+        if ((depth = ext2_ext_find(ext2, inode, pos_index, path, buffers)) < 0) {
+            res = depth;
+            break;
+        }
+
+        struct ext2_ext_path *leaf = &path[depth];
+        struct ext2_extent *ext = ext2_ext_extents(leaf->hdr);
+        int pos = leaf->pos;
+
+        if (pos < 0 || ext[pos].block + (uint64_t) ext2_ext_len(&ext[pos]) <= pos_index) {
+            // In a hole: go on with the next extent, which may be in
+            // the next leaf
+            uint64_t next = UINT64_MAX;
+
+            if (pos + 1 < leaf->hdr->entries) {
+                next = ext[pos + 1].block;
+            } else {
+                for (int level = depth - 1; level >= 0; --level) {
+                    if (path[level].pos + 1 < path[level].hdr->entries) {
+                        next = ext2_ext_index(path[level].hdr)[path[level].pos + 1].block;
+                        break;
+                    }
+                }
+            }
+            pos_index = next;
+            continue;
+        }
+
+        struct ext2_extent *cur = &ext[pos];
+        uint32_t len = ext2_ext_len(cur);
+        int uninit = ext2_ext_uninit(cur);
+        uint64_t from = pos_index;
+        uint64_t cur_end = cur->block + (uint64_t) len;
+        uint64_t to = MIN(end, cur_end);
+
+        if ((res = ext2_free_batch_add(ext2, batch, cur->start + (from - cur->block), to - from)) < 0) {
+            goto out;
+        }
+        inode->disk_sector_count -= (to - from) * (sb->block_size / 512);
+
+        if (from == cur->block && to == cur_end) {
+            memmove(cur, cur + 1, (leaf->hdr->entries - pos - 1) * sizeof(struct ext2_extent));
+            --leaf->hdr->entries;
+            memset(&ext[leaf->hdr->entries], 0, sizeof(struct ext2_extent));
+
+            if (!leaf->hdr->entries && depth) {
+                res = ext2_ext_drop_node(ext2, inode, path, depth, batch);
+            } else if ((res = ext2_ext_write_node(ext2, leaf)) == 0 && !pos && leaf->hdr->entries) {
+                res = ext2_ext_fix_keys(ext2, path, depth);
+            }
+        } else if (from == cur->block) {
+            cur->start += to - from;
+            cur->block = to;
+            ext2_ext_set_len(cur, cur_end - to, uninit);
+            if ((res = ext2_ext_write_node(ext2, leaf)) == 0 && !pos) {
+                res = ext2_ext_fix_keys(ext2, path, depth);
+            }
+        } else if (to == cur_end) {
+            ext2_ext_set_len(cur, from - cur->block, uninit);
+            res = ext2_ext_write_node(ext2, leaf);
+        } else {
+            // Punched out of the middle: the tail becomes an extent of
+            // its own
+            uint32_t tail_start = cur->start + (to - cur->block);
+
+            ext2_ext_set_len(cur, from - cur->block, uninit);
+            if ((res = ext2_ext_write_node(ext2, leaf)) == 0) {
+                res = ext2_ext_insert(ext2, inode, buffers, to, tail_start, cur_end - to, uninit);
+            }
+        }
+        if (res < 0) {
+            break;
+        }
+
+        pos_index = to;
+    }
+
+out:
+    free(buffers);
+    return res;
+}
+
+// Blocks from index on were written: make the uninitialized extents
+// among count of them plain ones, splitting them where the range ends.
+// The tree blocks are written, the inode is not
+int ext2_ext_mark_init(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_ext_path path[EXT2_EXT_MAX_DEPTH + 1];
+    char *buffers = (char *) malloc(EXT2_EXT_MAX_DEPTH * sb->block_size);
+    uint64_t end = (uint64_t) index + count;
+    uint64_t pos_index = index;
+    int depth, res = 0;
+
+    if (!buffers) {
+        return -ENOMEM;
+    }
+
+    while (pos_index < end) {
+        if ((depth = ext2_ext_find(ext2, inode, pos_index, path, buffers)) < 0) {
+            res = depth;
+            break;
+        }
+
+        struct ext2_ext_path *leaf = &path[depth];
+        struct ext2_extent *cur = leaf->pos >= 0 ? &ext2_ext_extents(leaf->hdr)[leaf->pos] : NULL;
+
+        // Holes and plain extents are left alone
+        if (!cur || cur->block + (uint64_t) ext2_ext_len(cur) <= pos_index) {
+            ++pos_index;
+            continue;
+        }
+        uint64_t cur_end = cur->block + (uint64_t) ext2_ext_len(cur);
+        if (!ext2_ext_uninit(cur)) {
+            pos_index = cur_end;
+            continue;
+        }
+
+        uint64_t from = pos_index;
+        uint64_t to = MIN(end, cur_end);
+        uint32_t start = cur->start;
+        uint32_t block = cur->block;
+
+        // What stays uninitialized before the range keeps the entry, the
+        // rest is mapped again after it
+        if (from == block) {
+            ext2_ext_set_len(cur, to - from, 0);
+        } else {
+            ext2_ext_set_len(cur, from - block, 1);
+        }
+        if ((res = ext2_ext_write_node(ext2, leaf)) < 0) {
+            break;
+        }
+        if (from != block &&
+            (res = ext2_ext_insert(ext2, inode, buffers, from, start + (from - block), to - from, 0)) < 0) {
+            break;
+        }
+        if (to != cur_end &&
+            (res = ext2_ext_insert(ext2, inode, buffers, to, start + (to - block), cur_end - to, 1)) < 0) {
+            break;
+        }
+
+        pos_index = to;
+    }
+
+    free(buffers);
+    return res;
+}
+
+// One past the last block of the file mapped, 0 if none is. The
+// rightmost path of the tree leads there
+int ext2_ext_map_end(fs_t *ext2, struct ext2_inode *inode, uint64_t *end) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_ext_header *hdr = ext2_ext_root(inode);
+    char buf[sb->block_size];
+    int res;
+
+    if ((res = ext2_ext_check(ext2, hdr, EXT2_EXT_ROOT_MAX, -1)) < 0) {
+        return res;
+    }
+
+    *end = 0;
+    while (hdr->depth) {
+        struct ext2_ext_idx *idx;
+
+        if (!hdr->entries) {
+            return 0;
+        }
+        idx = &ext2_ext_index(hdr)[hdr->entries - 1];
+        if ((res = ext2_ext_read_node(ext2, idx->leaf, idx->leaf_hi, hdr->depth - 1, buf)) < 0) {
+            return res;
+        }
+        hdr = (struct ext2_ext_header *) buf;
+    }
+
+    if (hdr->entries) {
+        struct ext2_extent *ext = &ext2_ext_extents(hdr)[hdr->entries - 1];
+        *end = ext->block + (uint64_t) ext2_ext_len(ext);
+    }
+    return 0;
+}
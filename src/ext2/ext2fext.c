@@ -0,0 +1,307 @@
+// ext2fs free extent index: the free space as runs of blocks, so that
+// large allocations are placed without scanning the bitmaps
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#define ext2_fext_of(n, member)     rb_entry(n, struct ext2_fext, member)
+#define ext2_bit_test(bitmap, bit)  (((uint64_t *) (bitmap))[(bit) / 64] & (1ULL << ((bit) % 64)))
+
+static int ext2_fext_start_cmp(const struct rb_node *a, const struct rb_node *b) {
+    uint32_t x = ext2_fext_of(a, by_start)->start;
+    uint32_t y = ext2_fext_of(b, by_start)->start;
+
+    return x < y ? -1 : x > y;
+}
+
+static int ext2_fext_count_cmp(const struct rb_node *a, const struct rb_node *b) {
+    const struct ext2_fext *x = ext2_fext_of(a, by_count);
+    const struct ext2_fext *y = ext2_fext_of(b, by_count);
+
+    if (x->count != y->count) {
+        return x->count < y->count ? -1 : 1;
+    }
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static uint32_t ext2_fext_group(struct ext2_extsb *sb, uint32_t block_no) {
+    return (block_no - sb->sb.sb_block_number) / sb->sb.block_group_size_blocks;
+}
+
+static int ext2_fext_new(struct ext2_fext_index *idx, uint32_t start, uint32_t count) {
+    struct ext2_fext *ext = (struct ext2_fext *) malloc(sizeof(struct ext2_fext));
+
+    if (!ext) {
+        return -ENOMEM;
+    }
+
+    ext->start = start;
+    ext->count = count;
+    rb_insert(&idx->by_start, &ext->by_start, ext2_fext_start_cmp);
+    rb_insert(&idx->by_count, &ext->by_count, ext2_fext_count_cmp);
+    ++idx->nexts;
+
+    return 0;
+}
+
+static void ext2_fext_free(struct ext2_fext_index *idx, struct ext2_fext *ext) {
+    rb_erase(&idx->by_start, &ext->by_start);
+    rb_erase(&idx->by_count, &ext->by_count);
+    --idx->nexts;
+    free(ext);
+}
+
+// Move or resize the extent. It stays between its neighbours, so only
+// its place by length changes
+static void ext2_fext_set(struct ext2_fext_index *idx, struct ext2_fext *ext, uint32_t start, uint32_t count) {
+    rb_erase(&idx->by_count, &ext->by_count);
+    ext->start = start;
+    ext->count = count;
+    rb_insert(&idx->by_count, &ext->by_count, ext2_fext_count_cmp);
+}
+
+// The last extent starting at or before block_no
+static struct ext2_fext *ext2_fext_lookup(struct ext2_fext_index *idx, uint32_t block_no) {
+    struct rb_node *node = idx->by_start.root;
+    struct ext2_fext *res = NULL;
+
+    while (node) {
+        struct ext2_fext *ext = ext2_fext_of(node, by_start);
+
+        if (ext->start <= block_no) {
+            res = ext;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    return res;
+}
+
+static void ext2_fext_destroy(struct ext2_fext_index *idx) {
+    struct rb_node *node;
+
+    while ((node = rb_first(&idx->by_start))) {
+        ext2_fext_free(idx, ext2_fext_of(node, by_start));
+    }
+    free(idx);
+}
+
+// Collect the free runs of all the groups. Blocks freed by the running
+// journal transaction are left out, ext2_read_block_bitmap() shows them
+// as used. The bitmaps are read without any lock: blocks allocated or
+// freed meanwhile may be wrong in the index, which only makes the hint
+// worse. Called by the flusher, so allocations never wait for the scan
+int ext2_fext_build(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    char bitmap_block[sb->block_size];
+    struct ext2_fext_index *idx;
+    int res;
+
+    if (sb->fext) {
+        return 0;
+    }
+    if (!(idx = (struct ext2_fext_index *) calloc(1, sizeof(struct ext2_fext_index)))) {
+        return -ENOMEM;
+    }
+
+    for (uint32_t i = 0; i < sb->block_group_count; ++i) {
+        uint32_t base = i * sb->sb.block_group_size_blocks + sb->sb.sb_block_number;
+        uint32_t limit = ext2_group_blocks(sb, i);
+        struct ext2_grp_desc *desc;
+
+        if ((res = ext2_group_desc(ext2, i, &desc)) < 0) {
+            ext2_fext_destroy(idx);
+            return res;
+        }
+        if (!desc->free_blocks) {
+            continue;
+        }
+        if ((res = ext2_read_block_bitmap(ext2, i, bitmap_block)) < 0) {
+            ext2_fext_destroy(idx);
+            return res;
+        }
+
+        for (uint32_t bit = 0; bit < limit;) {
+            if (!(bit % 64) && ((uint64_t *) bitmap_block)[bit / 64] == (uint64_t) -1) {
+                bit += 64;
+                continue;
+            }
+            if (ext2_bit_test(bitmap_block, bit)) {
+                ++bit;
+                continue;
+            }
+
+            uint32_t start = bit;
+            while (bit < limit && !ext2_bit_test(bitmap_block, bit)) {
+                ++bit;
+            }
+            if ((res = ext2_fext_new(idx, base + start, bit - start)) < 0) {
+                ext2_fext_destroy(idx);
+                return res;
+            }
+        }
+    }
+
+    printf("ext2: free extent index of %zu extents\n", idx->nexts);
+    pthread_mutex_lock(&sb->cache->fext_lock);
+    sb->fext = idx;
+    pthread_mutex_unlock(&sb->cache->fext_lock);
+    return 0;
+}
+
+// Where to allocate count contiguous blocks: at goal if there are
+// enough free blocks from there, or at the next free extent of goal's
+// group if it is long enough. Otherwise at the shortest extent which
+// is long enough, or the longest one if none is. Only a hint, the
+// caller allocates from the bitmap. Until the flusher has built the
+// index, -EAGAIN. The caller holds no group lock
+int ext2_fext_goal(fs_t *ext2, uint32_t goal, uint32_t count, uint32_t *best) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_fext_index *idx;
+    struct ext2_fext *ext;
+    struct rb_node *node, *fit = NULL;
+    int res = 0;
+
+    pthread_mutex_lock(&sb->cache->fext_lock);
+    if (!(idx = sb->fext)) {
+        pthread_mutex_unlock(&sb->cache->fext_lock);
+        ext2_cache_fext(ext2);
+        return -EAGAIN;
+    }
+    if (!idx->nexts) {
+        pthread_mutex_unlock(&sb->cache->fext_lock);
+        return -ENOSPC;
+    }
+
+    if ((ext = ext2_fext_lookup(idx, goal)) && goal < ext->start + ext->count &&
+        ext->start + ext->count - goal >= count) {
+        *best = goal;
+        goto out;
+    }
+    node = ext ? rb_next(&ext->by_start) : rb_first(&idx->by_start);
+    if (node && goal >= sb->sb.sb_block_number && (ext = ext2_fext_of(node, by_start))->count >= count &&
+        ext2_fext_group(sb, ext->start) == ext2_fext_group(sb, goal)) {
+        *best = ext->start;
+        goto out;
+    }
+
+    for (node = idx->by_count.root; node;) {
+        if (ext2_fext_of(node, by_count)->count >= count) {
+            fit = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    if (!fit) {
+        fit = rb_last(&idx->by_count);
+    }
+
+    *best = ext2_fext_of(fit, by_count)->start;
+
+out:
+    pthread_mutex_unlock(&sb->cache->fext_lock);
+    return res;
+}
+
+// The blocks became free, merge them with the adjacent extents of the
+// same group. Out of memory, the index just misses them
+void ext2_fext_insert(fs_t *ext2, uint32_t start, uint32_t count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_fext_index *idx;
+
+    pthread_mutex_lock(&sb->cache->fext_lock);
+    idx = sb->fext;
+    while (idx && count) {
+        // Extents never cross groups
+        uint32_t group = ext2_fext_group(sb, start);
+        uint32_t group_end = group * sb->sb.block_group_size_blocks + sb->sb.sb_block_number +
+                             ext2_group_blocks(sb, group);
+        uint32_t n = start + count > group_end ? group_end - start : count;
+        struct ext2_fext *prev = ext2_fext_lookup(idx, start);
+        struct rb_node *node = prev ? rb_next(&prev->by_start) : rb_first(&idx->by_start);
+        struct ext2_fext *next = node ? ext2_fext_of(node, by_start) : NULL;
+
+        if (prev && (prev->start + prev->count != start || ext2_fext_group(sb, prev->start) != group)) {
+            prev = NULL;
+        }
+        if (next && (start + n != next->start || ext2_fext_group(sb, next->start) != group)) {
+            next = NULL;
+        }
+
+        if (prev && next) {
+            uint32_t total = prev->count + n + next->count;
+
+            ext2_fext_free(idx, next);
+            ext2_fext_set(idx, prev, prev->start, total);
+        } else if (prev) {
+            ext2_fext_set(idx, prev, prev->start, prev->count + n);
+        } else if (next) {
+            ext2_fext_set(idx, next, start, next->count + n);
+        } else {
+            ext2_fext_new(idx, start, n);
+        }
+
+        start += n;
+        count -= n;
+    }
+
+    pthread_mutex_unlock(&sb->cache->fext_lock);
+}
+
+// The blocks were allocated. Parts of the range which are not in the
+// index are skipped
+void ext2_fext_remove(fs_t *ext2, uint32_t start, uint32_t count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_fext_index *idx;
+    uint32_t end = start + count;
+
+    pthread_mutex_lock(&sb->cache->fext_lock);
+    idx = sb->fext;
+    while (idx && start < end) {
+        struct ext2_fext *ext = ext2_fext_lookup(idx, start);
+
+        if (!ext || start >= ext->start + ext->count) {
+            struct rb_node *node = ext ? rb_next(&ext->by_start) : rb_first(&idx->by_start);
+
+            if (!node || ext2_fext_of(node, by_start)->start >= end) {
+                break;
+            }
+            start = ext2_fext_of(node, by_start)->start;
+            continue;
+        }
+
+        uint32_t ext_end = ext->start + ext->count;
+        uint32_t cut_end = ext_end < end ? ext_end : end;
+
+        if (start == ext->start && cut_end == ext_end) {
+            ext2_fext_free(idx, ext);
+        } else if (start == ext->start) {
+            ext2_fext_set(idx, ext, cut_end, ext_end - cut_end);
+        } else {
+            ext2_fext_set(idx, ext, ext->start, start - ext->start);
+            // Split, the index only loses the tail if that fails
+            if (cut_end < ext_end) {
+                ext2_fext_new(idx, cut_end, ext_end - cut_end);
+            }
+        }
+
+        start = cut_end;
+    }
+    pthread_mutex_unlock(&sb->cache->fext_lock);
+}
+
+// Called at umount, once nobody allocates or frees anymore
+void ext2_fext_release(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    if (sb->fext) {
+        ext2_fext_destroy(sb->fext);
+        sb->fext = NULL;
+    }
+}
@@ -0,0 +1,244 @@
+// ext2fs in-memory per-inode state
+#include "ext2.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#define EXT2_INODE_INFO_BUCKETS     64
+
+void ext2_inode_info_init(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    sb->inode_info = (hash_t *) malloc(sizeof(hash_t));
+    memset(sb->inode_info, 0, sizeof(hash_t));
+    sb->inode_info->keycmp = hash_u64_keycmp;
+    sb->inode_info->keyhsh = hash_u64_keyhsh;
+    hash_init(sb->inode_info, EXT2_INODE_INFO_BUCKETS);
+}
+
+void ext2_inode_info_release(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    // All the vnodes are released by now
+    assert(!sb->inode_info->item_count);
+    free(sb->inode_info->buckets);
+    free(sb->inode_info);
+}
+
+// The info of an inode in use, NULL otherwise. An info being loaded is
+// waited for. The caller holds cache->lock
+static struct ext2_inode_info *ext2_inode_info_find(fs_t *ext2, uint32_t ino) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode_info *info;
+
+    while (hash_get(sb->inode_info, ino, (void **) &info) == 0) {
+        if (!info->loading) {
+            return info;
+        }
+        pthread_cond_wait(&sb->cache->load_cond, &sb->cache->lock);
+    }
+
+    return NULL;
+}
+
+// Get the info of an inode, loading the inode if it is not in use yet.
+// The info goes into the hash before the inode is read, so that the
+// read runs without cache->lock and nobody else reads it meanwhile
+struct ext2_inode_info *ext2_inode_info_get(fs_t *ext2, uint32_t ino) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode_info *info;
+    int res;
+
+    pthread_mutex_lock(&sb->cache->lock);
+
+    if ((info = ext2_inode_info_find(ext2, ino))) {
+        ++info->refcount;
+        pthread_mutex_unlock(&sb->cache->lock);
+        return info;
+    }
+
+    if (!(info = (struct ext2_inode_info *) malloc(sizeof(struct ext2_inode_info)))) {
+        pthread_mutex_unlock(&sb->cache->lock);
+        return NULL;
+    }
+    if (!(info->inode = (struct ext2_inode *) malloc(sb->inode_struct_size))) {
+        pthread_mutex_unlock(&sb->cache->lock);
+        free(info);
+        return NULL;
+    }
+
+    info->ino = ino;
+    info->refcount = 1;
+    info->loading = 1;
+    pthread_mutex_init(&info->lock, NULL);
+    memset(&info->rsv, 0, sizeof(struct ext2_rsv_window));
+    info->pages = NULL;
+    info->lru_head = NULL;
+    info->lru_tail = NULL;
+    info->ndirty = 0;
+    info->inode_dirty = 0;
+    info->dirty_since = 0;
+
+    hash_put(sb->inode_info, ino, info);
+    pthread_mutex_unlock(&sb->cache->lock);
+
+    res = ext2_read_inode(ext2, info->inode, ino);
+    if (res == 0) {
+        atomic_init(&info->append_end, ext2_inode_size(info->inode));
+    }
+
+    pthread_mutex_lock(&sb->cache->lock);
+    if (res != 0) {
+        hash_del(sb->inode_info, ino);
+    } else {
+        info->loading = 0;
+    }
+    pthread_cond_broadcast(&sb->cache->load_cond);
+    pthread_mutex_unlock(&sb->cache->lock);
+
+    if (res != 0) {
+        pthread_mutex_destroy(&info->lock);
+        free(info->inode);
+        free(info);
+        return NULL;
+    }
+
+    return info;
+}
+
+// Copy the in-memory inode if it is in use: it may be newer than the
+// one on disk. Returns -1 otherwise. The copy is made under the inode's
+// lock so that it is not torn by a writer. The caller holds no lock
+int ext2_inode_info_copy(fs_t *ext2, uint32_t ino, struct ext2_inode *inode) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode_info *info;
+
+    pthread_mutex_lock(&sb->cache->lock);
+    if ((info = ext2_inode_info_find(ext2, ino))) {
+        ++info->refcount;
+    }
+    pthread_mutex_unlock(&sb->cache->lock);
+
+    if (!info) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&info->lock);
+    memcpy(inode, info->inode, sb->inode_struct_size);
+    pthread_mutex_unlock(&info->lock);
+
+    // The last reference may write the inode back
+    ext2_journal_start(ext2);
+    ext2_inode_info_put(ext2, info);
+    ext2_journal_stop(ext2);
+
+    return 0;
+}
+
+// The orphan list link of the inode if it is in use, -1 otherwise. The
+// caller holds orphan_lock, which protects the link
+int ext2_inode_info_dtime(fs_t *ext2, uint32_t ino, uint32_t *dtime) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode_info *info;
+    int res = -1;
+
+    pthread_mutex_lock(&sb->cache->lock);
+    if ((info = ext2_inode_info_find(ext2, ino))) {
+        *dtime = info->inode->dtime;
+        res = 0;
+    }
+    pthread_mutex_unlock(&sb->cache->lock);
+
+    return res;
+}
+
+static void ext2_inode_info_free(fs_t *ext2, struct ext2_inode_info *info) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    ext2_pages_truncate(ext2, info, 0);
+    hash_del(sb->inode_info, info->ino);
+
+    pthread_mutex_destroy(&info->lock);
+    free(info->inode);
+    free(info);
+}
+
+// Free the infos only kept for their cached pages
+void ext2_inode_info_prune(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    pthread_mutex_lock(&sb->cache->lock);
+    for (size_t i = 0; i < sb->inode_info->bucket_count; ++i) {
+        hash_entry_t *ent = sb->inode_info->buckets[i];
+
+        while (ent) {
+            struct ext2_inode_info *info = (struct ext2_inode_info *) ent->value;
+            ent = ent->next;
+
+            if (!info->refcount) {
+                ext2_inode_info_free(ext2, info);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sb->cache->lock);
+}
+
+// Drop a reference. Once the inode is not used anymore, its dirty pages
+// are written back. The data of an unlinked inode is dropped instead.
+// The info stays around while it has pages cached: clean ones until they
+// get evicted, dirty ones or the inode itself when the write-back failed,
+// for the flusher to retry
+int ext2_inode_info_put(fs_t *ext2, struct ext2_inode_info *info) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int res;
+
+    pthread_mutex_lock(&sb->cache->lock);
+    assert(info->refcount);
+    if (info->refcount > 1) {
+        --info->refcount;
+        pthread_mutex_unlock(&sb->cache->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&sb->cache->lock);
+
+    // The write-back runs without cache->lock, the reference kept until
+    // then stops others from freeing the info meanwhile
+    pthread_mutex_lock(&info->lock);
+    if (!info->inode->hard_link_count) {
+        ext2_pages_truncate(ext2, info, 0);
+    }
+    res = ext2_inode_flush(ext2, info);
+    pthread_mutex_unlock(&info->lock);
+
+    pthread_mutex_lock(&sb->cache->lock);
+
+    // Taken again while being written back
+    if (--info->refcount) {
+        pthread_mutex_unlock(&sb->cache->lock);
+        return res;
+    }
+
+    // The blocks nobody writes to anymore are free for others
+    ext2_rsv_discard(ext2, &info->rsv);
+
+    // A deleted inode number may be reused with different contents
+    if (info->inode->hard_link_count && ((info->pages && info->pages->item_count) || info->inode_dirty)) {
+        pthread_mutex_unlock(&sb->cache->lock);
+        return res;
+    }
+
+    int orphan = !info->inode->hard_link_count;
+
+    ext2_inode_info_free(ext2, info);
+    pthread_mutex_unlock(&sb->cache->lock);
+
+    // An unlinked inode can be freed now
+    if (orphan) {
+        ext2_orphan_kick(ext2);
+    }
+
+    return res;
+}
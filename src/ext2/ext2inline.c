@@ -0,0 +1,263 @@
+// ext2fs inline data: tiny files and directories kept in the inode
+#include "ext2.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define MIN(x, y) ((x) > (y) ? (y) : (x))
+
+// First bytes past the 128-byte inode, in the larger inodes
+#define ext2_inode_extra_isize(i)   (*(uint16_t *) ((char *) (i) + 128))
+
+// Size of "." and ".." entries made up for inline directories
+#define EXT2_INLINE_DOT_LEN         12
+// Inline directories start with the parent inode number
+#define EXT2_INLINE_PARENT_LEN      4
+
+// Find the "system.data" attribute in the inode. values is set to the
+// base its value_offs is relative to. Returns -ENOENT if there is none,
+// -EIO if the entry or its value does not fit in the inode
+static int ext2_inline_xattr(fs_t *ext2, struct ext2_inode *inode, struct ext2_xattr_entry **entp, char **values) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    char *end = (char *) inode + sb->inode_struct_size;
+
+    if (sb->inode_struct_size <= 128) {
+        return -ENOENT;
+    }
+
+    char *base = (char *) inode + 128 + ext2_inode_extra_isize(inode);
+    if (base + 4 > end || *(uint32_t *) base != EXT2_XATTR_MAGIC) {
+        return -ENOENT;
+    }
+
+    char *first = base + 4;
+    for (char *p = first; p + sizeof(struct ext2_xattr_entry) <= end && *(uint32_t *) p;) {
+        struct ext2_xattr_entry *ent = (struct ext2_xattr_entry *) p;
+
+        if (p + EXT2_XATTR_LEN(ent->name_len) > end) {
+            return -EIO;
+        }
+        if (ent->name_index == EXT2_XATTR_SYSTEM && ent->name_len == 4 && !memcmp(ent->name, "data", 4)) {
+            if ((size_t) ent->value_offs + ent->value_size > (size_t) (end - first)) {
+                return -EIO;
+            }
+            *entp = ent;
+            *values = first;
+            return 0;
+        }
+        p += EXT2_XATTR_LEN(ent->name_len);
+    }
+
+    return -ENOENT;
+}
+
+// Empty the attribute value, the data is elsewhere now
+static void ext2_inline_xattr_clear(fs_t *ext2, struct ext2_inode *inode) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_xattr_entry *ent;
+    char *values;
+
+    if (ext2_inline_xattr(ext2, inode, &ent, &values) < 0 || !ent->value_size) {
+        return;
+    }
+
+    memset(values + ent->value_offs, 0,
+           MIN((ent->value_size + 3) & ~3, (size_t) ((char *) inode + sb->inode_struct_size - (values + ent->value_offs))));
+    ent->value_size = 0;
+    ent->value_offs = (char *) inode + sb->inode_struct_size - values;
+    ent->hash = 0;
+}
+
+// New files only get inline data if the inode has room for the attribute
+int ext2_inline_enabled(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    return (sb->required_features & EXT2_REQ_INLINE_DATA) &&
+           sb->inode_struct_size >= 128 + EXT2_INODE_EXTRA_ISIZE + 8 + EXT2_XATTR_LEN(4);
+}
+
+// Make a new, zeroed inode inline with an empty "system.data"
+int ext2_inline_init(fs_t *ext2, struct ext2_inode *inode) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+
+    if (!ext2_inline_enabled(ext2)) {
+        return -EOPNOTSUPP;
+    }
+
+    ext2_inode_extra_isize(inode) = EXT2_INODE_EXTRA_ISIZE;
+
+    char *base = (char *) inode + 128 + EXT2_INODE_EXTRA_ISIZE;
+    struct ext2_xattr_entry *ent = (struct ext2_xattr_entry *) (base + 4);
+
+    *(uint32_t *) base = EXT2_XATTR_MAGIC;
+    ent->name_len = 4;
+    ent->name_index = EXT2_XATTR_SYSTEM;
+    // Empty values point to the end of the inode
+    ent->value_offs = (char *) inode + sb->inode_struct_size - (base + 4);
+    ent->value_inum = 0;
+    ent->value_size = 0;
+    ent->hash = 0;
+    memcpy(ent->name, "data", 4);
+
+    inode->flags |= EXT2_INODE_INLINE;
+    return 0;
+}
+
+// Whether size bytes can be written back inline. Only the block
+// pointers are written, files using the attribute move to blocks
+int ext2_inline_fits(fs_t *ext2, struct ext2_inode *inode, uint64_t size) {
+    struct ext2_xattr_entry *ent;
+    char *values;
+
+    return size <= EXT2_INLINE_SIZE && ext2_inline_xattr(ext2, inode, &ent, &values) == 0 && !ent->value_size;
+}
+
+// Fill a block buffer with the data of an inline file
+int ext2_inline_read(fs_t *ext2, struct ext2_inode *inode, void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint64_t size = ext2_inode_size(inode);
+    struct ext2_xattr_entry *ent;
+    char *values;
+    int res;
+
+    memset(buf, 0, sb->block_size);
+    memcpy(buf, ext2_inode_block_ptrs(inode), MIN(size, EXT2_INLINE_SIZE));
+
+    if (size > EXT2_INLINE_SIZE) {
+        if ((res = ext2_inline_xattr(ext2, inode, &ent, &values)) == -EIO) {
+            return res;
+        }
+        if (res == 0) {
+            size_t n = MIN(MIN(size - EXT2_INLINE_SIZE, ent->value_size), sb->block_size - EXT2_INLINE_SIZE);
+            memcpy((char *) buf + EXT2_INLINE_SIZE, values + ent->value_offs, n);
+        }
+    }
+
+    return 0;
+}
+
+// Put the data of a file back into the inode, see ext2_inline_fits()
+void ext2_inline_store(struct ext2_inode *inode, const void *data, size_t size) {
+    memset(ext2_inode_block_ptrs(inode), 0, EXT2_INLINE_SIZE);
+    memcpy(ext2_inode_block_ptrs(inode), data, size);
+}
+
+// Stop keeping the data inline, i_block[] is zeroed to become the
+// block map or extent tree. The caller has a copy of the data
+void ext2_inline_drop(fs_t *ext2, struct ext2_inode *inode) {
+    ext2_inline_xattr_clear(ext2, inode);
+    memset(ext2_inode_block_ptrs(inode), 0, EXT2_INLINE_SIZE);
+    inode->flags &= ~EXT2_INODE_INLINE;
+
+    if (ext2_ext_enabled(ext2)) {
+        ext2_ext_init(inode);
+    }
+}
+
+// Make up a directory block from the inline entries, "." and ".."
+// included, so the directory code needs no special cases for reading
+int ext2_inline_dir_read(fs_t *ext2, struct ext2_inode *inode, uint32_t ino, void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    const char *i_block = (const char *) ext2_inode_block_ptrs(inode);
+    char *block = (char *) buf;
+    struct ext2_xattr_entry *ent;
+    struct ext2_dirent *dirent;
+    char *values;
+    size_t off, end;
+    int res;
+
+    memset(block, 0, sb->block_size);
+
+    dirent = (struct ext2_dirent *) block;
+    dirent->ino = ino;
+    dirent->len = EXT2_INLINE_DOT_LEN;
+    dirent->name_len = 1;
+    dirent->type_ind = ext2_dirent_type(ext2, VN_DIR);
+    dirent->name[0] = '.';
+
+    dirent = (struct ext2_dirent *) &block[EXT2_INLINE_DOT_LEN];
+    dirent->ino = *(const uint32_t *) i_block;
+    dirent->len = EXT2_INLINE_DOT_LEN;
+    dirent->name_len = 2;
+    dirent->type_ind = ext2_dirent_type(ext2, VN_DIR);
+    dirent->name[0] = '.';
+    dirent->name[1] = '.';
+
+    // The entries in i_block[] and in the attribute both fill their
+    // space up, so they chain as they are
+    off = 2 * EXT2_INLINE_DOT_LEN;
+    end = off + EXT2_INLINE_SIZE - EXT2_INLINE_PARENT_LEN;
+    memcpy(&block[off], i_block + EXT2_INLINE_PARENT_LEN, EXT2_INLINE_SIZE - EXT2_INLINE_PARENT_LEN);
+
+    if ((res = ext2_inline_xattr(ext2, inode, &ent, &values)) == -EIO) {
+        return res;
+    }
+    if (res == 0 && ent->value_size && end + ent->value_size <= sb->block_size) {
+        memcpy(&block[end], values + ent->value_offs, ent->value_size);
+        end += ent->value_size;
+    }
+
+    // The last entry takes up the rest of the block
+    while (off < end) {
+        dirent = (struct ext2_dirent *) &block[off];
+        if (!dirent->len || off + dirent->len >= end) {
+            dirent->len = sb->block_size - off;
+            break;
+        }
+        off += dirent->len;
+    }
+
+    return 0;
+}
+
+// Pack the entries of a block made by ext2_inline_dir_read() back into
+// the inode. Returns -ENOSPC if they don't fit there
+int ext2_inline_dir_store(fs_t *ext2, struct ext2_inode *inode, const void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    const char *block = (const char *) buf;
+    char packed[EXT2_INLINE_SIZE];
+    struct ext2_dirent *dirent, *last = NULL;
+    size_t out = EXT2_INLINE_PARENT_LEN;
+    size_t off = 0;
+    int nent = 0;
+
+    memset(packed, 0, sizeof(packed));
+    // Parent of ".."
+    memcpy(packed, &((const struct ext2_dirent *) &block[EXT2_INLINE_DOT_LEN])->ino, EXT2_INLINE_PARENT_LEN);
+
+    // Follow the chain: removed entries may have been merged into ".."
+    while (off < sb->block_size) {
+        const struct ext2_dirent *src = (const struct ext2_dirent *) &block[off];
+
+        if (!src->len) {
+            break;
+        }
+        // "." and ".." are not stored
+        if (src->ino && nent++ >= 2) {
+            size_t len = (sizeof(struct ext2_dirent) + src->name_len + 3) & ~3;
+
+            if (out + len > EXT2_INLINE_SIZE) {
+                return -ENOSPC;
+            }
+
+            last = (struct ext2_dirent *) &packed[out];
+            memcpy(last, src, sizeof(struct ext2_dirent) + src->name_len);
+            last->len = len;
+            out += len;
+        }
+        off += src->len;
+    }
+
+    if (last) {
+        last->len += EXT2_INLINE_SIZE - out;
+    } else {
+        // An empty directory still has one unused entry
+        dirent = (struct ext2_dirent *) &packed[EXT2_INLINE_PARENT_LEN];
+        dirent->len = EXT2_INLINE_SIZE - EXT2_INLINE_PARENT_LEN;
+    }
+
+    memcpy(ext2_inode_block_ptrs(inode), packed, EXT2_INLINE_SIZE);
+    ext2_inline_xattr_clear(ext2, inode);
+    return 0;
+}
@@ -0,0 +1,1142 @@
+// ext2fs JBD2 metadata journal: metadata blocks written by the running
+// transaction are kept in memory, committed to the log with a single
+// sequential write and written in place at checkpoints. File data is
+// written in place before the commit which refers to it
+#include "ext2.h"
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#define EXT2_JOURNAL_BUCKETS    1024
+
+#define EXT2_JPASS_SCAN         0
+#define EXT2_JPASS_REVOKE       1
+#define EXT2_JPASS_REPLAY       2
+
+// Handles are nested: an operation may end up in another one
+static __thread int ext2_journal_depth;
+
+static void *ext2_journal_thread(void *arg);
+
+// Read or write count blocks of the log starting at jblock, merging the
+// ones which are contiguous on disk
+static int ext2_journal_io(fs_t *ext2, struct ext2_journal *j, uint32_t jblock, uint32_t count, void *buf, int write) {
+    size_t block_size = ((struct ext2_extsb *) ext2->fs_private)->block_size;
+    char *p = (char *) buf;
+    ssize_t res;
+
+    for (uint32_t i = 0; i < count;) {
+        uint32_t run = 1;
+
+        while (i + run < count && j->map[jblock + i + run] == j->map[jblock + i] + run) {
+            ++run;
+        }
+
+        uint64_t off = (uint64_t) j->map[jblock + i] * block_size;
+        if (write) {
+            res = blk_write(ext2->blk, p, off, run * block_size);
+        } else {
+            res = blk_read(ext2->blk, p, off, run * block_size);
+        }
+        if (res < 0) {
+            fprintf(stderr, "ext2: journal %s failed at block %u\n", write ? "write" : "read", jblock + i);
+            return (int) res;
+        }
+
+        p += run * block_size;
+        i += run;
+    }
+
+    return 0;
+}
+
+static int ext2_journal_write_jsb(fs_t *ext2, struct ext2_journal *j, uint32_t start, uint32_t sequence) {
+    struct ext2_jsb *jsb = (struct ext2_jsb *) j->jsb;
+
+    jsb->start = htobe32(start);
+    jsb->sequence = htobe32(sequence);
+
+    return ext2_journal_io(ext2, j, 0, 1, j->jsb, 1);
+}
+
+static uint32_t ext2_journal_next(struct ext2_journal *j, uint32_t jblock) {
+    return jblock + 1 < j->maxlen ? jblock + 1 : j->first;
+}
+
+// Free the entries and the buckets of the hash, values included if
+// free_values is set
+static void ext2_journal_hash_free(hash_t *h, int free_values) {
+    for (size_t i = 0; i < h->bucket_count; ++i) {
+        hash_entry_t *ent = h->buckets[i];
+
+        while (ent) {
+            hash_entry_t *next = ent->next;
+
+            if (free_values) {
+                free(ent->value);
+            }
+            free(ent);
+            ent = next;
+        }
+    }
+    free(h->buckets);
+}
+
+// Walk the committed transactions of the log the way JBD2 recovery
+// does: the scan pass finds the end of the log, the revoke pass collects
+// the revoked blocks and the replay pass writes the logged blocks in
+// place unless they were revoked later
+static int ext2_journal_pass(fs_t *ext2, struct ext2_journal *j, int pass, uint32_t *end, hash_t *revoked) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_jsb *jsb = (struct ext2_jsb *) j->jsb;
+    uint32_t sequence = be32toh(jsb->sequence);
+    uint32_t jblock = be32toh(jsb->start);
+    char block[sb->block_size];
+    char data[sb->block_size];
+    int res;
+
+    while (pass == EXT2_JPASS_SCAN || sequence != *end) {
+        struct ext2_jheader *hdr = (struct ext2_jheader *) block;
+
+        if ((res = ext2_journal_io(ext2, j, jblock, 1, block, 0)) < 0) {
+            return res;
+        }
+        if (be32toh(hdr->magic) != EXT2_JMAGIC || be32toh(hdr->sequence) != sequence) {
+            break;
+        }
+        jblock = ext2_journal_next(j, jblock);
+
+        uint32_t type = be32toh(hdr->blocktype);
+        if (type == EXT2_JCOMMIT) {
+            ++sequence;
+            continue;
+        }
+
+        if (type == EXT2_JREVOKE) {
+            struct ext2_jrevoke *r = (struct ext2_jrevoke *) block;
+            size_t rec = j->tag_size == sizeof(struct ext2_jtag) ? 8 : 4;
+            size_t count = be32toh(r->count);
+
+            if (pass != EXT2_JPASS_REVOKE) {
+                continue;
+            }
+            for (size_t off = sizeof(struct ext2_jrevoke); off + rec <= count && off + rec <= sb->block_size;
+                 off += rec) {
+                // 64-bit records: only the low half can be non-zero here
+                uint32_t block_no = be32toh(*(uint32_t *) &block[off + rec - 4]);
+                void *prev;
+
+                if (hash_get(revoked, block_no, &prev) != 0 || (int32_t) (sequence - (uint32_t) (uintptr_t) prev) > 0) {
+                    hash_put(revoked, block_no, (void *) (uintptr_t) sequence);
+                }
+            }
+            continue;
+        }
+
+        if (type != EXT2_JDESCRIPTOR) {
+            break;
+        }
+
+        for (size_t off = sizeof(struct ext2_jheader); off + j->tag_size <= sb->block_size;) {
+            struct ext2_jtag *tag = (struct ext2_jtag *) &block[off];
+            uint16_t flags = be16toh(tag->flags);
+            uint32_t block_no = be32toh(tag->block_no);
+            void *rev;
+
+            if (pass == EXT2_JPASS_REPLAY &&
+                (hash_get(revoked, block_no, &rev) != 0 || (int32_t) ((uint32_t) (uintptr_t) rev - sequence) < 0)) {
+                if ((res = ext2_journal_io(ext2, j, jblock, 1, data, 0)) < 0) {
+                    return res;
+                }
+                if (flags & EXT2_JTAG_ESCAPE) {
+                    *(uint32_t *) data = htobe32(EXT2_JMAGIC);
+                }
+                if (blk_write(ext2->blk, data, (uint64_t) block_no * sb->block_size, sb->block_size) < 0) {
+                    fprintf(stderr, "ext2: journal replay of block %u failed\n", block_no);
+                    return -EIO;
+                }
+            }
+            jblock = ext2_journal_next(j, jblock);
+
+            off += j->tag_size;
+            if (!(flags & EXT2_JTAG_SAME_UUID)) {
+                off += 16;
+            }
+            if (flags & EXT2_JTAG_LAST) {
+                break;
+            }
+        }
+    }
+
+    if (pass == EXT2_JPASS_SCAN) {
+        *end = sequence;
+    }
+    return 0;
+}
+
+// Write the committed transactions of the log in place. end is set to
+// the sequence following the last one
+static int ext2_journal_replay(fs_t *ext2, struct ext2_journal *j, uint32_t *end) {
+    hash_t revoked;
+    int res;
+
+    memset(&revoked, 0, sizeof(hash_t));
+    revoked.keycmp = hash_u64_keycmp;
+    revoked.keyhsh = hash_u64_keyhsh;
+    hash_init(&revoked, EXT2_JOURNAL_BUCKETS);
+
+    *end = 0;
+    if ((res = ext2_journal_pass(ext2, j, EXT2_JPASS_SCAN, end, &revoked)) == 0 &&
+        (res = ext2_journal_pass(ext2, j, EXT2_JPASS_REVOKE, end, &revoked)) == 0) {
+        res = ext2_journal_pass(ext2, j, EXT2_JPASS_REPLAY, end, &revoked);
+    }
+    ext2_journal_hash_free(&revoked, 0);
+
+    return res;
+}
+
+// Replay the log, the journal is empty afterwards. The superblock and
+// the BGDT are read again as they may have been replayed
+static int ext2_journal_recover(fs_t *ext2, struct ext2_journal *j) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t end;
+    int res;
+
+    if ((res = ext2_journal_replay(ext2, j, &end)) < 0) {
+        return res;
+    }
+
+    printf("ext2: replayed transactions %u-%u\n", be32toh(((struct ext2_jsb *) j->jsb)->sequence), end - 1);
+    j->sequence = end + 1;
+
+    if ((res = blk_flush(ext2->blk)) < 0) {
+        return res;
+    }
+    if (blk_read(ext2->blk, sb, EXT2_SBOFF, EXT2_SBSIZ) != EXT2_SBSIZ) {
+        return -EIO;
+    }
+    ext2_bgdt_invalidate(ext2);
+
+    return 0;
+}
+
+static void ext2_journal_free(struct ext2_journal *j) {
+    if (j->bufs) {
+        ext2_journal_hash_free(j->bufs, 1);
+        free(j->bufs);
+    }
+
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    free(j->revoked);
+    free(j->freed);
+    free(j->map);
+    free(j->jsb);
+    free(j);
+}
+
+// Parse the commit=, max_batch_time= and max_batch= options out of the
+// comma-separated mount options, others are left alone
+static int ext2_journal_options(struct ext2_journal *j, const char *opt) {
+    j->commit_interval = EXT2_JOURNAL_COMMIT_INTERVAL;
+    j->max_batch_time = EXT2_JOURNAL_MAX_BATCH_TIME;
+    j->max_batch = EXT2_JOURNAL_MAX_BATCH;
+
+    while (opt && *opt) {
+        size_t len = strcspn(opt, ",");
+        unsigned int *value = NULL;
+        const char *arg = NULL;
+
+        if (len > 7 && !strncmp(opt, "commit=", 7)) {
+            value = &j->commit_interval;
+            arg = opt + 7;
+        } else if (len > 15 && !strncmp(opt, "max_batch_time=", 15)) {
+            value = &j->max_batch_time;
+            arg = opt + 15;
+        } else if (len > 10 && !strncmp(opt, "max_batch=", 10)) {
+            value = &j->max_batch;
+            arg = opt + 10;
+        }
+
+        if (value) {
+            char *end;
+            unsigned long v = strtoul(arg, &end, 10);
+
+            if (end != opt + len || v > UINT32_MAX) {
+                printf("ext2: bad mount option: %.*s\n", (int) len, opt);
+                return -EINVAL;
+            }
+            *value = v;
+        }
+
+        opt += len;
+        if (*opt == ',') {
+            ++opt;
+        }
+    }
+
+    if (!j->commit_interval) {
+        j->commit_interval = EXT2_JOURNAL_COMMIT_INTERVAL;
+    }
+    return 0;
+}
+
+// Find the journal, replay it if the fs was not unmounted cleanly and
+// mark the fs as in use until ext2_journal_release()
+int ext2_journal_load(fs_t *ext2, const char *opt) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_journal *j;
+    struct ext2_jsb *jsb;
+    int res;
+
+    sb->journal = NULL;
+
+    if (!(sb->optional_features & EXT2_OPT_HAS_JOURNAL)) {
+        if (sb->required_features & EXT2_REQ_RECOVER) {
+            printf("ext2: needs recovery but has no journal\n");
+            return -EINVAL;
+        }
+        return 0;
+    }
+    if (sb->journal_dev || !sb->journal_inode) {
+        printf("ext2: external journals are not supported\n");
+        return -EINVAL;
+    }
+
+    if (!(j = (struct ext2_journal *) calloc(1, sizeof(struct ext2_journal)))) {
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+
+    if ((res = ext2_journal_options(j, opt)) < 0) {
+        ext2_journal_free(j);
+        return res;
+    }
+
+    struct ext2_inode *inode = (struct ext2_inode *) malloc(sb->inode_struct_size);
+    j->jsb = (char *) malloc(sb->block_size);
+    if (!inode || !j->jsb) {
+        free(inode);
+        ext2_journal_free(j);
+        return -ENOMEM;
+    }
+
+    uint32_t block_no = 0;
+    if ((res = ext2_read_inode(ext2, inode, sb->journal_inode)) < 0 ||
+        (res = ext2_inode_get_block(ext2, inode, 0, &block_no)) < 0 ||
+        !block_no || ext2_read_block(ext2, block_no, j->jsb) < 0) {
+        printf("ext2: failed to read the journal superblock\n");
+        free(inode);
+        ext2_journal_free(j);
+        return res < 0 ? res : -EIO;
+    }
+
+    jsb = (struct ext2_jsb *) j->jsb;
+    j->maxlen = be32toh(jsb->maxlen);
+    j->first = be32toh(jsb->first);
+
+    if (be32toh(jsb->header.magic) != EXT2_JMAGIC || be32toh(jsb->header.blocktype) != EXT2_JSB_V2 ||
+        be32toh(jsb->blocksize) != sb->block_size || j->first < 1 || j->first >= j->maxlen ||
+        (uint64_t) j->maxlen * sb->block_size > ext2_inode_size(inode)) {
+        printf("ext2: bad or unsupported journal superblock\n");
+        free(inode);
+        ext2_journal_free(j);
+        return -EINVAL;
+    }
+    if (be32toh(jsb->feature_incompat) & ~EXT2_JFEATURE_INCOMPAT_SUPPORTED) {
+        printf("ext2: unsupported journal features: %08x\n",
+               be32toh(jsb->feature_incompat) & ~EXT2_JFEATURE_INCOMPAT_SUPPORTED);
+        free(inode);
+        ext2_journal_free(j);
+        return -EINVAL;
+    }
+    j->tag_size = (be32toh(jsb->feature_incompat) & EXT2_JFEATURE_INCOMPAT_64BIT) ?
+                  sizeof(struct ext2_jtag) : sizeof(struct ext2_jtag) - 4;
+
+    // The journal is mostly contiguous, but follow the inode's map
+    if (!(j->map = (uint32_t *) malloc(j->maxlen * sizeof(uint32_t)))) {
+        free(inode);
+        ext2_journal_free(j);
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < j->maxlen; ++i) {
+        if ((res = ext2_inode_get_block(ext2, inode, i, &j->map[i])) < 0 || !j->map[i]) {
+            printf("ext2: journal block %u is not mapped\n", i);
+            free(inode);
+            ext2_journal_free(j);
+            return res < 0 ? res : -EINVAL;
+        }
+    }
+    free(inode);
+
+    j->sequence = be32toh(jsb->sequence);
+    if (jsb->start && (res = ext2_journal_recover(ext2, j)) < 0) {
+        printf("ext2: journal recovery failed\n");
+        ext2_journal_free(j);
+        return res;
+    }
+
+    // Revoke blocks may be written from now on
+    jsb->feature_incompat |= htobe32(EXT2_JFEATURE_INCOMPAT_REVOKE);
+    if ((res = ext2_journal_write_jsb(ext2, j, 0, j->sequence)) < 0) {
+        ext2_journal_free(j);
+        return res;
+    }
+
+    sb->required_features |= EXT2_REQ_RECOVER;
+    if ((res = ext2_write_superblock(ext2)) < 0 || (res = blk_flush(ext2->blk)) < 0) {
+        ext2_journal_free(j);
+        return res;
+    }
+
+    j->bufs = (hash_t *) calloc(1, sizeof(hash_t));
+    if (!j->bufs) {
+        ext2_journal_free(j);
+        return -ENOMEM;
+    }
+    j->bufs->keycmp = hash_u64_keycmp;
+    j->bufs->keyhsh = hash_u64_keyhsh;
+    hash_init(j->bufs, EXT2_JOURNAL_BUCKETS);
+
+    j->head = j->first;
+    j->state = EXT2_JOURNAL_IDLE;
+    sb->journal = j;
+
+    if (pthread_create(&j->thread, NULL, ext2_journal_thread, ext2) != 0) {
+        sb->journal = NULL;
+        ext2_journal_free(j);
+        return -EAGAIN;
+    }
+
+    printf("ext2: journal of %u blocks, next transaction %u\n", j->maxlen, j->sequence);
+    return 0;
+}
+
+static int ext2_jbuf_cmp(const void *a, const void *b) {
+    uint32_t x = (*(struct ext2_jbuf * const *) a)->block_no;
+    uint32_t y = (*(struct ext2_jbuf * const *) b)->block_no;
+
+    return x < y ? -1 : x > y;
+}
+
+// Write all the buffered blocks in place and empty the log. The caller
+// has set the state to EXT2_JOURNAL_WRITE so the buffers don't change,
+// and doesn't hold the lock
+static int ext2_journal_checkpoint(fs_t *ext2, struct ext2_journal *j) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_jbuf **bufs;
+    size_t count = 0;
+    int res = 0;
+
+    if (!j->bufs->item_count) {
+        return 0;
+    }
+    if (!(bufs = (struct ext2_jbuf **) malloc(j->bufs->item_count * sizeof(struct ext2_jbuf *)))) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < j->bufs->bucket_count; ++i) {
+        for (hash_entry_t *ent = j->bufs->buckets[i]; ent; ent = ent->next) {
+            bufs[count++] = (struct ext2_jbuf *) ent->value;
+        }
+    }
+
+    // In block order, the device sees a sweep instead of random writes.
+    // The blocks read ahead are kept up to date, as the buffers go away
+    qsort(bufs, count, sizeof(struct ext2_jbuf *), ext2_jbuf_cmp);
+    for (size_t i = 0; i < count; ++i) {
+        ext2_ra_update(ext2, bufs[i]->block_no, 1, bufs[i]->data);
+        if (blk_write(ext2->blk, bufs[i]->data, (uint64_t) bufs[i]->block_no * sb->block_size, sb->block_size) < 0) {
+            fprintf(stderr, "ext2: checkpoint of block %u failed\n", bufs[i]->block_no);
+            free(bufs);
+            return -EIO;
+        }
+    }
+
+    // Only drop the log once the blocks are in place
+    if ((res = blk_flush(ext2->blk)) < 0 ||
+        (res = ext2_journal_write_jsb(ext2, j, 0, j->sequence)) < 0 ||
+        (res = blk_flush(ext2->blk)) < 0) {
+        free(bufs);
+        return res;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    for (size_t i = 0; i < count; ++i) {
+        hash_del(j->bufs, bufs[i]->block_no);
+        free(bufs[i]);
+    }
+    j->running = NULL;
+    j->nrunning = 0;
+    j->start = 0;
+    j->head = j->first;
+    pthread_mutex_unlock(&j->lock);
+
+    free(bufs);
+    return 0;
+}
+
+// Make room for the running transaction by emptying the log while it
+// keeps its buffers. Those of the blocks it changed again no longer hold
+// what was committed, so the committed transactions are replayed from
+// the log instead of written from memory. The caller has set the state
+// to EXT2_JOURNAL_WRITE and doesn't hold the lock
+static int ext2_journal_restart(fs_t *ext2, struct ext2_journal *j) {
+    struct ext2_jbuf **bufs;
+    size_t count = 0;
+    uint32_t end;
+    int res;
+
+    if (!(bufs = (struct ext2_jbuf **) malloc((j->bufs->item_count + 1) * sizeof(struct ext2_jbuf *)))) {
+        return -ENOMEM;
+    }
+    if ((res = ext2_journal_replay(ext2, j, &end)) < 0 ||
+        (res = blk_flush(ext2->blk)) < 0 ||
+        (res = ext2_journal_write_jsb(ext2, j, 0, j->sequence)) < 0 ||
+        (res = blk_flush(ext2->blk)) < 0) {
+        free(bufs);
+        return res;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    for (size_t i = 0; i < j->bufs->bucket_count; ++i) {
+        for (hash_entry_t *ent = j->bufs->buckets[i]; ent; ent = ent->next) {
+            struct ext2_jbuf *jbuf = (struct ext2_jbuf *) ent->value;
+
+            jbuf->logged = 0;
+            if (!jbuf->running) {
+                bufs[count++] = jbuf;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        hash_del(j->bufs, bufs[i]->block_no);
+        free(bufs[i]);
+    }
+    j->start = 0;
+    j->head = j->first;
+    pthread_mutex_unlock(&j->lock);
+
+    free(bufs);
+    return 0;
+}
+
+// Blocks the log needs to commit the running transaction, the caller
+// holds the lock
+static uint32_t ext2_journal_tx_blocks(fs_t *ext2, struct ext2_journal *j) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t per_revoke = (sb->block_size - sizeof(struct ext2_jrevoke)) / (j->tag_size == sizeof(struct ext2_jtag) ? 8 : 4);
+    // Every tag may be followed by a UUID at worst
+    size_t per_desc = (sb->block_size - sizeof(struct ext2_jheader)) / (j->tag_size + 16);
+
+    return (j->nrevoked + per_revoke - 1) / per_revoke + (j->nrunning + per_desc - 1) / per_desc + j->nrunning + 1;
+}
+
+// Lay out the running transaction in buf: revoke blocks, descriptors
+// each followed by the blocks it lists, then the commit block. The
+// caller holds the lock. Returns the number of blocks used
+static uint32_t ext2_journal_build(fs_t *ext2, struct ext2_journal *j, char *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_jsb *jsb = (struct ext2_jsb *) j->jsb;
+    size_t rec = j->tag_size == sizeof(struct ext2_jtag) ? 8 : 4;
+    uint32_t n = 0;
+    struct ext2_jheader *hdr;
+
+    memset(buf, 0, ext2_journal_tx_blocks(ext2, j) * sb->block_size);
+
+    for (size_t i = 0; i < j->nrevoked;) {
+        struct ext2_jrevoke *r = (struct ext2_jrevoke *) (buf + n++ * sb->block_size);
+        size_t off = sizeof(struct ext2_jrevoke);
+
+        r->header.magic = htobe32(EXT2_JMAGIC);
+        r->header.blocktype = htobe32(EXT2_JREVOKE);
+        r->header.sequence = htobe32(j->sequence);
+
+        for (; i < j->nrevoked && off + rec <= sb->block_size; ++i, off += rec) {
+            *(uint32_t *) ((char *) r + off + rec - 4) = htobe32(j->revoked[i]);
+        }
+        r->count = htobe32(off);
+    }
+
+    struct ext2_jbuf *jbuf = j->running;
+    while (jbuf) {
+        char *desc = buf + n++ * sb->block_size;
+        size_t off = sizeof(struct ext2_jheader);
+        struct ext2_jtag *tag = NULL;
+
+        hdr = (struct ext2_jheader *) desc;
+        hdr->magic = htobe32(EXT2_JMAGIC);
+        hdr->blocktype = htobe32(EXT2_JDESCRIPTOR);
+        hdr->sequence = htobe32(j->sequence);
+
+        for (; jbuf && off + j->tag_size + (tag ? 0 : 16) <= sb->block_size; jbuf = jbuf->next) {
+            char *copy = buf + n++ * sb->block_size;
+
+            tag = (struct ext2_jtag *) (desc + off);
+            tag->block_no = htobe32(jbuf->block_no);
+            memcpy(copy, jbuf->data, sb->block_size);
+            if (be32toh(*(uint32_t *) copy) == EXT2_JMAGIC) {
+                *(uint32_t *) copy = 0;
+                tag->flags |= htobe16(EXT2_JTAG_ESCAPE);
+            }
+
+            if (off == sizeof(struct ext2_jheader)) {
+                memcpy(desc + off + j->tag_size, jsb->uuid, 16);
+                off += 16;
+            } else {
+                tag->flags |= htobe16(EXT2_JTAG_SAME_UUID);
+            }
+            off += j->tag_size;
+
+            jbuf->running = 0;
+            jbuf->logged = 1;
+        }
+        tag->flags |= htobe16(EXT2_JTAG_LAST);
+    }
+
+    struct ext2_jcommit *commit = (struct ext2_jcommit *) (buf + n++ * sb->block_size);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    commit->header.magic = htobe32(EXT2_JMAGIC);
+    commit->header.blocktype = htobe32(EXT2_JCOMMIT);
+    commit->header.sequence = htobe32(j->sequence);
+    commit->sec = htobe64(now.tv_sec);
+    commit->nsec = htobe32(now.tv_nsec);
+
+    return n;
+}
+
+// Microseconds from a to b
+static int64_t ext2_journal_usec(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000ll + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+// The blocks freed by the running transaction become reusable: hand
+// them to the free extent index. Called with j->lock held
+static void ext2_journal_drop_freed(fs_t *ext2, struct ext2_journal *j) {
+    for (size_t i = 0; i < j->nfreed; ++i) {
+        ext2_fext_insert(ext2, j->freed[i].start, j->freed[i].count);
+    }
+    j->nfreed = 0;
+}
+
+// Commit the running transaction: wait for its operations to end, then
+// write it to the log and make it durable. File data written so far is
+// made durable by the same device flush, which is done even if there is
+// nothing to commit. Only called by the commit thread, see
+// ext2_journal_commit()
+static int ext2_journal_do_commit(fs_t *ext2, struct ext2_journal *j) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t start, count, sequence;
+    struct timespec begin, end;
+    size_t nops = 0;
+    char *buf = NULL;
+    int was_empty, res;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    pthread_mutex_lock(&j->lock);
+    while (j->state != EXT2_JOURNAL_IDLE) {
+        pthread_cond_wait(&j->cond, &j->lock);
+    }
+    j->state = EXT2_JOURNAL_DRAIN;
+    while (j->handles) {
+        pthread_cond_wait(&j->cond, &j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    // The free counts belong to the same transaction as the bitmaps
+    res = ext2_write_meta(ext2);
+
+    pthread_mutex_lock(&j->lock);
+    j->state = EXT2_JOURNAL_WRITE;
+
+    // Operations starting from now belong to the next transaction
+    nops = j->nops;
+    j->nops = 0;
+
+    if (res < 0 || (!j->nrunning && !j->nrevoked)) {
+        ext2_journal_drop_freed(ext2, j);
+        if (res == 0) {
+            pthread_mutex_unlock(&j->lock);
+            res = blk_flush(ext2->blk);
+            pthread_mutex_lock(&j->lock);
+        }
+        nops = 0;
+        goto out;
+    }
+
+    count = ext2_journal_tx_blocks(ext2, j);
+    if (j->head + count > j->maxlen && j->start) {
+        pthread_mutex_unlock(&j->lock);
+        res = ext2_journal_restart(ext2, j);
+        pthread_mutex_lock(&j->lock);
+
+        if (res < 0) {
+            goto out;
+        }
+    }
+    if (j->head + count > j->maxlen) {
+        // Too large to fit the log even when empty: write it in place,
+        // without the guarantees of the journal. Nothing older is left
+        // in the log to be replayed over it
+        fprintf(stderr, "ext2: transaction %u of %u blocks written in place\n", j->sequence, count);
+        j->nrevoked = 0;
+        ext2_journal_drop_freed(ext2, j);
+        ++j->sequence;
+        pthread_mutex_unlock(&j->lock);
+
+        res = ext2_journal_checkpoint(ext2, j);
+
+        pthread_mutex_lock(&j->lock);
+        goto out;
+    }
+
+    if (!(buf = (char *) malloc(count * sb->block_size))) {
+        res = -ENOMEM;
+        goto out;
+    }
+    count = ext2_journal_build(ext2, j, buf);
+
+    j->running = NULL;
+    j->nrunning = 0;
+    j->nrevoked = 0;
+    ext2_journal_drop_freed(ext2, j);
+    sequence = j->sequence++;
+    start = j->head;
+    if ((was_empty = !j->start)) {
+        j->start = start;
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    // Point the journal superblock at the log if it was empty. The commit
+    // block goes last: the transaction only counts once all of it is on
+    // disk
+    if ((!was_empty || (res = ext2_journal_write_jsb(ext2, j, start, sequence)) == 0) &&
+        (res = ext2_journal_io(ext2, j, start, count - 1, buf, 1)) == 0 &&
+        (res = blk_flush(ext2->blk)) == 0 &&
+        (res = ext2_journal_io(ext2, j, start + count - 1, 1, buf + (count - 1) * sb->block_size, 1)) == 0) {
+        res = blk_flush(ext2->blk);
+    }
+    free(buf);
+
+    pthread_mutex_lock(&j->lock);
+    if (res < 0) {
+        goto out;
+    }
+    j->head = start + count;
+    j->stats.blocks += count;
+
+    if (j->maxlen - j->head < (j->maxlen - j->first) / EXT2_JOURNAL_RESERVE_PART) {
+        pthread_mutex_unlock(&j->lock);
+        int err = ext2_journal_checkpoint(ext2, j);
+        pthread_mutex_lock(&j->lock);
+
+        if (err < 0) {
+            res = err;
+        }
+    }
+
+out:
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (res == 0 && nops) {
+        uint64_t latency = (uint64_t) ext2_journal_usec(&begin, &end);
+
+        ++j->stats.commits;
+        j->stats.ops += nops;
+        j->stats.latency += latency;
+        if (nops > j->stats.max_ops) {
+            j->stats.max_ops = nops;
+        }
+        if (latency > j->stats.max_latency) {
+            j->stats.max_latency = latency;
+        }
+    }
+
+    ++j->commit_gen;
+    j->commit_res = res;
+    j->state = EXT2_JOURNAL_IDLE;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+
+    return res;
+}
+
+// Whether the running transaction should be committed without waiting
+// for anything else
+static int ext2_journal_full(struct ext2_journal *j) {
+    return j->nrunning + j->nrevoked >= (j->maxlen - j->first) / EXT2_JOURNAL_TRANSACTION_PART;
+}
+
+// Commits the running transaction every commit_interval seconds, once
+// it is full, or when asked by ext2_journal_commit(). Callers asking
+// for a commit while other operations are still running wait up to
+// max_batch_time for them to join, so that one commit record and one
+// device flush are shared by all of them
+static void *ext2_journal_thread(void *arg) {
+    fs_t *ext2 = (fs_t *) arg;
+    struct ext2_journal *j = ((struct ext2_extsb *) ext2->fs_private)->journal;
+
+    pthread_mutex_lock(&j->lock);
+
+    while (1) {
+        int wanted = j->commit_wanted > j->commit_gen;
+        struct timespec now, deadline;
+
+        if (j->thread_stop && !wanted) {
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        if (!wanted && !ext2_journal_full(j)) {
+            if (!j->nrunning && !j->nrevoked) {
+                pthread_cond_wait(&j->cond, &j->lock);
+                continue;
+            }
+            if (now.tv_sec < j->running_since + (time_t) j->commit_interval) {
+                deadline.tv_sec = j->running_since + j->commit_interval;
+                deadline.tv_nsec = 0;
+                pthread_cond_timedwait(&j->cond, &j->lock, &deadline);
+                continue;
+            }
+        } else if (wanted && !ext2_journal_full(j) && !j->thread_stop &&
+                   j->handles && j->nops < j->max_batch) {
+            deadline = j->wanted_since;
+            deadline.tv_nsec += (long) j->max_batch_time * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+
+            if (ext2_journal_usec(&now, &deadline) > 0) {
+                pthread_cond_timedwait(&j->cond, &j->lock, &deadline);
+                continue;
+            }
+        }
+
+        pthread_mutex_unlock(&j->lock);
+        if (ext2_journal_do_commit(ext2, j) < 0) {
+            fprintf(stderr, "ext2: journal commit failed\n");
+        }
+        pthread_mutex_lock(&j->lock);
+    }
+
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+// Commit the operations which ended so far and make them durable,
+// along with the file data written before. Returns 1 once done, 0
+// without a journal
+int ext2_journal_commit(fs_t *ext2) {
+    struct ext2_journal *j = ((struct ext2_extsb *) ext2->fs_private)->journal;
+    uint64_t gen;
+    int res;
+
+    if (!j) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    // A commit in progress already drained the operations which ended
+    gen = j->commit_gen + 1;
+    if (j->commit_wanted < gen) {
+        if (j->commit_wanted <= j->commit_gen) {
+            clock_gettime(CLOCK_REALTIME, &j->wanted_since);
+        }
+        j->commit_wanted = gen;
+        pthread_cond_broadcast(&j->cond);
+    }
+    while (j->commit_gen < gen) {
+        pthread_cond_wait(&j->cond, &j->lock);
+    }
+    res = j->commit_res;
+    pthread_mutex_unlock(&j->lock);
+
+    return res < 0 ? res : 1;
+}
+
+int ext2_journal_stats(fs_t *ext2, struct ext2_journal_stats *st) {
+    struct ext2_journal *j = ((struct ext2_extsb *) ext2->fs_private)->journal;
+
+    if (!j) {
+        return -ENOENT;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    *st = j->stats;
+    pthread_mutex_unlock(&j->lock);
+
+    return 0;
+}
+
+// Commit and checkpoint everything, then mark the fs as clean
+int ext2_journal_release(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_journal *j = sb->journal;
+    int res, err;
+
+    if (!j) {
+        return 0;
+    }
+
+    res = ext2_journal_commit(ext2);
+
+    pthread_mutex_lock(&j->lock);
+    j->thread_stop = 1;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+
+    pthread_join(j->thread, NULL);
+
+    j->state = EXT2_JOURNAL_WRITE;
+    if (j->stats.commits) {
+        printf("ext2: %llu commits, %.1f operations and %llu us each on average, at most %llu and %llu us\n",
+               (unsigned long long) j->stats.commits, (double) j->stats.ops / j->stats.commits,
+               (unsigned long long) (j->stats.latency / j->stats.commits),
+               (unsigned long long) j->stats.max_ops, (unsigned long long) j->stats.max_latency);
+    }
+
+    if ((err = ext2_journal_checkpoint(ext2, j)) < 0 && res >= 0) {
+        res = err;
+    }
+
+    // Only clean if everything made it to its place
+    sb->journal = NULL;
+    if (res >= 0) {
+        sb->required_features &= ~EXT2_REQ_RECOVER;
+        res = ext2_write_superblock(ext2);
+    }
+
+    ext2_journal_free(j);
+    return res < 0 ? res : 0;
+}
+
+// Operations changing metadata run between these so that a commit
+// never sees half of one. Must be called before taking any fs lock
+void ext2_journal_start(fs_t *ext2) {
+    struct ext2_journal *j = ((struct ext2_extsb *) ext2->fs_private)->journal;
+
+    if (!j || ext2_journal_depth++) {
+        return;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    while (j->state != EXT2_JOURNAL_IDLE) {
+        pthread_cond_wait(&j->cond, &j->lock);
+    }
+    ++j->handles;
+    ++j->nops;
+    pthread_mutex_unlock(&j->lock);
+}
+
+void ext2_journal_stop(fs_t *ext2) {
+    struct ext2_journal *j = ((struct ext2_extsb *) ext2->fs_private)->journal;
+
+    if (!j || --ext2_journal_depth) {
+        return;
+    }
+
+    // Wakes up commits waiting for the operation, and the commit
+    // thread if the transaction is full now
+    pthread_mutex_lock(&j->lock);
+    if (!--j->handles || ext2_journal_full(j)) {
+        pthread_cond_broadcast(&j->cond);
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+// Copy the buffered block if there is one. Returns -1 otherwise
+int ext2_journal_read(fs_t *ext2, uint32_t block_no, void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_journal *j = sb->journal;
+    struct ext2_jbuf *jbuf;
+    int res = -1;
+
+    pthread_mutex_lock(&j->lock);
+    if (hash_get(j->bufs, block_no, (void **) &jbuf) == 0) {
+        memcpy(buf, jbuf->data, sb->block_size);
+        res = 0;
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    return res;
+}
+
+// Replace the blocks read from the device with the buffered ones
+void ext2_journal_overlay(fs_t *ext2, uint32_t block_no, uint32_t count, void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_journal *j = sb->journal;
+    struct ext2_jbuf *jbuf;
+
+    pthread_mutex_lock(&j->lock);
+    for (uint32_t i = 0; j->bufs->item_count && i < count; ++i) {
+        if (hash_get(j->bufs, block_no + i, (void **) &jbuf) == 0) {
+            memcpy((char *) buf + i * sb->block_size, jbuf->data, sb->block_size);
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+static void ext2_journal_unlink(struct ext2_journal *j, struct ext2_jbuf *jbuf) {
+    if (jbuf->prev) {
+        jbuf->prev->next = jbuf->next;
+    } else {
+        j->running = jbuf->next;
+    }
+    if (jbuf->next) {
+        jbuf->next->prev = jbuf->prev;
+    }
+    jbuf->running = 0;
+    --j->nrunning;
+}
+
+// Put a metadata block into the running transaction
+int ext2_journal_write(fs_t *ext2, uint32_t block_no, const void *buf) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_journal *j = sb->journal;
+    struct ext2_jbuf *jbuf;
+
+    pthread_mutex_lock(&j->lock);
+    while (j->state == EXT2_JOURNAL_WRITE) {
+        pthread_cond_wait(&j->cond, &j->lock);
+    }
+
+    if (hash_get(j->bufs, block_no, (void **) &jbuf) != 0) {
+        if (!(jbuf = (struct ext2_jbuf *) malloc(sizeof(struct ext2_jbuf) + sb->block_size))) {
+            pthread_mutex_unlock(&j->lock);
+            return -ENOMEM;
+        }
+        jbuf->block_no = block_no;
+        jbuf->running = 0;
+        jbuf->logged = 0;
+        hash_put(j->bufs, block_no, jbuf);
+    }
+
+    memcpy(jbuf->data, buf, sb->block_size);
+    if (!jbuf->running) {
+        jbuf->running = 1;
+        jbuf->prev = NULL;
+        jbuf->next = j->running;
+        if (j->running) {
+            j->running->prev = jbuf;
+        }
+        j->running = jbuf;
+        // The commit thread starts counting the interval
+        if (!j->nrunning++ && !j->nrevoked) {
+            j->running_since = time(NULL);
+            pthread_cond_broadcast(&j->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&j->lock);
+    return 0;
+}
+
+// The count blocks from block_no were freed by the running transaction.
+// Their logged copies must not be replayed anymore once the transaction
+// commits, and they can't be reused before that
+int ext2_journal_forget(fs_t *ext2, uint32_t block_no, uint32_t count) {
+    struct ext2_journal *j = ((struct ext2_extsb *) ext2->fs_private)->journal;
+    struct ext2_jbuf *jbuf;
+
+    if (!j) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    while (j->state == EXT2_JOURNAL_WRITE) {
+        pthread_cond_wait(&j->cond, &j->lock);
+    }
+
+    // Files are freed from either end, extend the last run both ways
+    struct ext2_freed_run *last = j->nfreed ? &j->freed[j->nfreed - 1] : NULL;
+    if (last && block_no == last->start + last->count) {
+        last->count += count;
+    } else if (last && block_no + count == last->start) {
+        last->start = block_no;
+        last->count += count;
+    } else {
+        if (j->nfreed == j->freed_cap) {
+            size_t cap = j->freed_cap ? j->freed_cap * 2 : 64;
+            struct ext2_freed_run *freed = realloc(j->freed, cap * sizeof(struct ext2_freed_run));
+
+            if (!freed) {
+                pthread_mutex_unlock(&j->lock);
+                return -ENOMEM;
+            }
+            j->freed = freed;
+            j->freed_cap = cap;
+        }
+        j->freed[j->nfreed].start = block_no;
+        j->freed[j->nfreed].count = count;
+        ++j->nfreed;
+    }
+
+    for (uint32_t end = block_no + count; block_no < end; ++block_no) {
+        if (hash_get(j->bufs, block_no, (void **) &jbuf) != 0) {
+            continue;
+        }
+        if (jbuf->logged) {
+            if (j->nrevoked == j->revoked_cap) {
+                size_t cap = j->revoked_cap ? j->revoked_cap * 2 : 64;
+                uint32_t *revoked = realloc(j->revoked, cap * sizeof(uint32_t));
+
+                if (!revoked) {
+                    pthread_mutex_unlock(&j->lock);
+                    return -ENOMEM;
+                }
+                j->revoked = revoked;
+                j->revoked_cap = cap;
+            }
+            if (!j->nrunning && !j->nrevoked) {
+                j->running_since = time(NULL);
+                pthread_cond_broadcast(&j->cond);
+            }
+            j->revoked[j->nrevoked++] = block_no;
+        }
+        if (jbuf->running) {
+            ext2_journal_unlink(j, jbuf);
+        }
+        hash_del(j->bufs, block_no);
+        free(jbuf);
+    }
+
+    pthread_mutex_unlock(&j->lock);
+    return 0;
+}
+
+// Mark the blocks freed by the running transaction as used in the
+// bitmap of the count blocks from base, so the allocator skips them.
+// With set == 0, unmark them again before the bitmap is written
+void ext2_journal_mask_freed(fs_t *ext2, uint32_t base, uint32_t count, char *bitmap, int set) {
+    struct ext2_journal *j = ((struct ext2_extsb *) ext2->fs_private)->journal;
+
+    if (!j) {
+        return;
+    }
+
+    pthread_mutex_lock(&j->lock);
+    for (size_t i = 0; i < j->nfreed; ++i) {
+        uint32_t start = j->freed[i].start;
+        uint32_t end = start + j->freed[i].count;
+
+        if (start < base) {
+            start = base;
+        }
+        if (end > base + count) {
+            end = base + count;
+        }
+        for (uint32_t b = start; b < end; ++b) {
+            if (set) {
+                ((uint64_t *) bitmap)[(b - base) / 64] |= 1ULL << ((b - base) % 64);
+            } else {
+                ((uint64_t *) bitmap)[(b - base) / 64] &= ~(1ULL << ((b - base) % 64));
+            }
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+}
@@ -0,0 +1,248 @@
+// ext2fs orphan list: unlinked inodes stay chained from the superblock
+// through their dtime until the reclaimer has freed their blocks and
+// them, so that a crash meanwhile leaks nothing
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+static void *ext2_reclaimer(void *arg);
+
+// Start the reclaimer. The orphans left by a crash are freed right away
+int ext2_orphan_init(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_cache *cache = sb->cache;
+
+    if (sb->orphan_inode_head) {
+        printf("ext2: orphan list starts at inode #%u\n", sb->orphan_inode_head);
+    }
+
+    cache->reclaim = 1;
+    if (pthread_create(&cache->reclaimer, NULL, ext2_reclaimer, ext2) != 0) {
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+// Free the orphans left and stop the reclaimer. Nobody uses the inodes
+// anymore by now
+void ext2_orphan_release(fs_t *ext2) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    pthread_mutex_lock(&cache->reclaim_lock);
+    cache->reclaimer_stop = 1;
+    pthread_cond_signal(&cache->reclaim_cond);
+    pthread_mutex_unlock(&cache->reclaim_lock);
+
+    pthread_join(cache->reclaimer, NULL);
+}
+
+// An orphan may not be used anymore. Takes no lock other than the
+// reclaimer's own
+void ext2_orphan_kick(fs_t *ext2) {
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    pthread_mutex_lock(&cache->reclaim_lock);
+    cache->reclaim = 1;
+    pthread_cond_signal(&cache->reclaim_cond);
+    pthread_mutex_unlock(&cache->reclaim_lock);
+}
+
+// The inode lost its last link: put it at the head of the list. Its
+// blocks are freed once nobody uses it anymore. The superblock goes
+// into the same transaction as the inode
+int ext2_orphan_add(fs_t *ext2, struct ext2_inode_info *info) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int res;
+
+    pthread_mutex_lock(&sb->cache->orphan_lock);
+    pthread_mutex_lock(&info->lock);
+
+    info->inode->hard_link_count = 0;
+    info->inode->dtime = sb->orphan_inode_head;
+    if ((res = ext2_write_inode(ext2, info->inode, info->ino)) >= 0) {
+        pthread_mutex_lock(&sb->cache->meta_lock);
+        sb->orphan_inode_head = info->ino;
+        pthread_mutex_unlock(&sb->cache->meta_lock);
+        ext2_meta_dirty(ext2);
+    }
+
+    pthread_mutex_unlock(&info->lock);
+    pthread_mutex_unlock(&sb->cache->orphan_lock);
+    return res < 0 ? res : 0;
+}
+
+// The first orphan nobody uses, 0 if there is none. The ones still in
+// use kick the reclaimer when they are released
+static uint32_t ext2_orphan_next(fs_t *ext2) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    uint32_t ino, next, n = 0;
+
+    pthread_mutex_lock(&sb->cache->orphan_lock);
+    for (ino = sb->orphan_inode_head; ino; ino = next) {
+        // A broken list is left alone, fsck deals with it
+        if (ino > sb->sb.inode_count || ++n > sb->sb.inode_count) {
+            fprintf(stderr, "ext2: broken orphan list at inode %u\n", ino);
+            ino = 0;
+            break;
+        }
+        if (ext2_inode_info_dtime(ext2, ino, &next) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sb->cache->orphan_lock);
+
+    return ino;
+}
+
+// Take the orphan off the list. The caller holds orphan_lock and a
+// reference to the info
+static int ext2_orphan_unchain(fs_t *ext2, struct ext2_inode_info *info) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode *inode = info->inode;
+    uint32_t next;
+    int res;
+
+    pthread_mutex_lock(&info->lock);
+    next = inode->dtime;
+    if (!inode->hard_link_count) {
+        inode->size_lower = 0;
+        inode->size_upper = 0;
+        inode->dtime = time(NULL);
+    } else {
+        inode->dtime = 0;
+    }
+    res = ext2_write_inode(ext2, inode, info->ino);
+    pthread_mutex_unlock(&info->lock);
+    if (res < 0) {
+        return res;
+    }
+
+    if (sb->orphan_inode_head == info->ino) {
+        pthread_mutex_lock(&sb->cache->meta_lock);
+        sb->orphan_inode_head = next;
+        pthread_mutex_unlock(&sb->cache->meta_lock);
+        ext2_meta_dirty(ext2);
+        return 0;
+    }
+
+    // The inodes unlinked since are in front of it
+    for (uint32_t ino = sb->orphan_inode_head; ino;) {
+        struct ext2_inode_info *prev = ext2_inode_info_get(ext2, ino);
+
+        if (!prev) {
+            return -EIO;
+        }
+
+        pthread_mutex_lock(&prev->lock);
+        if (prev->inode->dtime == info->ino) {
+            prev->inode->dtime = next;
+            res = ext2_write_inode(ext2, prev->inode, ino);
+            ino = 0;
+        } else {
+            ino = prev->inode->dtime;
+        }
+        pthread_mutex_unlock(&prev->lock);
+        ext2_inode_info_put(ext2, prev);
+    }
+
+    return res < 0 ? res : 0;
+}
+
+// Free the blocks of the orphan from the end, a batch per journal
+// handle, then the inode itself. After a crash halfway, the blocks freed
+// so far are unmapped and the inode is still on the list
+static int ext2_orphan_reclaim(fs_t *ext2, uint32_t ino) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode_info *info = ext2_inode_info_get(ext2, ino);
+    struct ext2_inode *inode;
+    enum vnode_type type;
+    int deleted;
+    int res = 0;
+
+    if (!info) {
+        return -EIO;
+    }
+    inode = info->inode;
+
+    // Only inodes which lost their last link are freed, others are just
+    // taken off the list
+    deleted = !inode->hard_link_count;
+    type = (inode->type_perm & 0xF000) == EXT2_TYPE_DIR ? VN_DIR : VN_REG;
+
+    // The whole mapping goes, blocks kept past the size included
+    while (deleted && inode->disk_sector_count && res >= 0) {
+        uint64_t end = 0;
+
+        ext2_journal_start(ext2);
+        pthread_mutex_lock(&info->lock);
+        if ((res = ext2_inode_map_end(ext2, inode, &end)) >= 0 && end) {
+            uint64_t start = end > EXT2_RECLAIM_BATCH ? end - EXT2_RECLAIM_BATCH : 0;
+
+            if ((res = ext2_free_inode_blocks(ext2, inode, start, end - start)) >= 0) {
+                res = ext2_write_inode(ext2, inode, ino);
+            }
+        }
+        pthread_mutex_unlock(&info->lock);
+        ext2_journal_stop(ext2);
+
+        if (!end) {
+            break;
+        }
+    }
+
+    ext2_journal_start(ext2);
+    if (res >= 0) {
+        pthread_mutex_lock(&sb->cache->orphan_lock);
+        res = ext2_orphan_unchain(ext2, info);
+        pthread_mutex_unlock(&sb->cache->orphan_lock);
+    }
+
+    // The info goes first, the number may be reused right after
+    ext2_inode_info_put(ext2, info);
+    if (res >= 0 && deleted) {
+        res = ext2_free_inode(ext2, ino, type);
+    }
+    ext2_journal_stop(ext2);
+
+    return res;
+}
+
+// Free the orphans nobody uses, whenever kicked
+static void *ext2_reclaimer(void *arg) {
+    fs_t *ext2 = (fs_t *) arg;
+    struct ext2_cache *cache = ((struct ext2_extsb *) ext2->fs_private)->cache;
+
+    pthread_mutex_lock(&cache->reclaim_lock);
+
+    while (1) {
+        while (!cache->reclaim && !cache->reclaimer_stop) {
+            pthread_cond_wait(&cache->reclaim_cond, &cache->reclaim_lock);
+        }
+
+        // Stopping, the list is emptied first
+        int stop = cache->reclaimer_stop;
+        cache->reclaim = 0;
+        pthread_mutex_unlock(&cache->reclaim_lock);
+
+        uint32_t ino;
+        while ((ino = ext2_orphan_next(ext2))) {
+            if (ext2_orphan_reclaim(ext2, ino) < 0) {
+                fprintf(stderr, "ext2: failed to free orphan inode %u\n", ino);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&cache->reclaim_lock);
+        if (stop) {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->reclaim_lock);
+    return NULL;
+}
@@ -5,11 +5,13 @@
 #include "vfs.h"
 
 #include <string.h>
+#include <time.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 
 // Forward declaration of ext2 vnode functions
 static int ext2_vnode_find(vnode_t *vn, const char *name, vnode_t **resvn);
@@ -18,9 +20,20 @@ static int ext2_vnode_mkdir(vnode_t *at, const char *name, mode_t mode);
 static int ext2_vnode_open(vnode_t *vn, int opt);
 static int ext2_vnode_opendir(vnode_t *vn, int opt);
 static ssize_t ext2_vnode_read(struct ofile *fd, void *buf, size_t count);
+static ssize_t ext2_vnode_view(struct ofile *fd, size_t count, struct vfs_view *view);
+static void ext2_vnode_view_put(struct ofile *fd, struct vfs_view *view);
 static ssize_t ext2_vnode_write(struct ofile *fd, const void *buf, size_t count);
-static int ext2_vnode_truncate(struct ofile *fd, size_t length);
+static ssize_t ext2_vnode_writev(struct ofile *fd, const struct iovec *iov, int iovcnt);
+static ssize_t ext2_vnode_preadv(struct ofile *fd, const struct iovec *iov, int iovcnt, uint64_t offset);
+static ssize_t ext2_vnode_pwritev(struct ofile *fd, const struct iovec *iov, int iovcnt, uint64_t offset);
+static int ext2_vnode_truncate(struct ofile *fd, uint64_t length);
+static int ext2_vnode_fallocate(struct ofile *fd, int mode, uint64_t offset, uint64_t length);
+static ssize_t ext2_vnode_copy_range(struct ofile *src, uint64_t src_off, struct ofile *dst, uint64_t dst_off, size_t count);
+static void ext2_vnode_close(struct ofile *fd);
+static int ext2_vnode_fsync(struct ofile *fd, int datasync);
 static int ext2_vnode_readdir(struct ofile *fd);
+static ssize_t ext2_vnode_getdents(struct ofile *fd, void *buf, size_t count);
+static ssize_t ext2_vnode_readdirplus(struct ofile *fd, void *buf, size_t count);
 static void ext2_vnode_destroy(vnode_t *vn);
 static int ext2_vnode_stat(vnode_t *vn, struct stat *st);
 static int ext2_vnode_chmod(vnode_t *vn, mode_t mode);
@@ -47,11 +60,22 @@ struct vnode_operations ext2_vnode_ops = {
 
     .opendir = ext2_vnode_opendir,
     .readdir = ext2_vnode_readdir,
+    .getdents = ext2_vnode_getdents,
+    .readdirplus = ext2_vnode_readdirplus,
 
     .open = ext2_vnode_open,
     .read = ext2_vnode_read,
+    .view = ext2_vnode_view,
+    .view_put = ext2_vnode_view_put,
     .write = ext2_vnode_write,
+    .writev = ext2_vnode_writev,
+    .preadv = ext2_vnode_preadv,
+    .pwritev = ext2_vnode_pwritev,
     .truncate = ext2_vnode_truncate,
+    .fallocate = ext2_vnode_fallocate,
+    .copy_range = ext2_vnode_copy_range,
+    .close = ext2_vnode_close,
+    .fsync = ext2_vnode_fsync,
 };
 
 //// vnode function implementation
@@ -59,18 +83,18 @@ struct vnode_operations ext2_vnode_ops = {
 static int ext2_vnode_find(vnode_t *vn, const char *name, vnode_t **res) {
     fs_t *ext2 = vn->fs;
     struct ext2_extsb *sb = vn->fs->fs_private;
-    struct ext2_inode *inode = vn->fs_data;
+    struct ext2_inode *inode = ext2_vnode_inode(vn);
 
     char buffer[sb->block_size];
     struct ext2_dirent *dirent = NULL;
 
-    size_t block_count = (inode->size_lower + (sb->block_size - 1)) / sb->block_size;
+    size_t block_count = (ext2_dir_size(ext2, inode) + (sb->block_size - 1)) / sb->block_size;
     char ent_name[256];
     size_t index = 0;
 
     while (index < block_count) {
         // Read directory contents block
-        if (ext2_read_inode_block(ext2, inode, index, buffer) < 0) {
+        if (ext2_dir_read_block(ext2, vn, index, buffer) < 0) {
             return -EIO;
         }
 
@@ -83,18 +107,17 @@ static int ext2_vnode_find(vnode_t *vn, const char *name, vnode_t **res) {
             if (dirent->ino) {
                 if (strlen(name) == dirent->name_len && !strncmp(dirent->name, name, dirent->name_len)) {
                     // Found the entry
-                    vnode_t *out = (vnode_t *) malloc(sizeof(vnode_t));
-                    out->op = &ext2_vnode_ops;
-                    out->fs = ext2;
-
-                    struct ext2_inode *result_inode = (struct ext2_inode *) malloc(sb->inode_struct_size);
-                    if (ext2_read_inode(ext2, result_inode, dirent->ino) != 0) {
+                    struct ext2_inode_info *info = ext2_inode_info_get(ext2, dirent->ino);
+                    if (!info) {
                         return -EIO;
                     }
 
-                    out->fs_data = result_inode;
+                    vnode_t *out = (vnode_t *) malloc(sizeof(vnode_t));
+                    out->op = &ext2_vnode_ops;
+                    out->fs = ext2;
+                    out->fs_data = info;
                     out->fs_number = dirent->ino;
-                    out->type = ext2_inode_type(result_inode);
+                    out->type = ext2_inode_type(info->inode);
 
                     *res = out;
                     //printf("Lookup %s in ino %d = %d\n", name, vn->fs_number, out->fs_number);
@@ -123,40 +146,54 @@ static int ext2_vnode_open(vnode_t *vn, int opt) {
     return 0;
 }
 
-static int ext2_vnode_mkdir(vnode_t *at, const char *name, mode_t mode) {
+static int ext2_mkdir(vnode_t *at, const char *name, mode_t mode) {
     fs_t *ext2 = at->fs;
     assert(at->type == VN_DIR);
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
     char block_buffer[sb->block_size];
 
-    uint32_t new_ino, new_block_no;
+    uint32_t new_ino, new_block_no = 0, got;
+    int inline_dir = ext2_inline_enabled(ext2);
     int res;
 
-    // Allocate a new inode for the directory
-    if ((res = ext2_alloc_inode(ext2, &new_ino)) != 0) {
+    // Allocate a new inode for the directory, placed by the Orlov
+    // allocator
+    if ((res = ext2_alloc_inode(ext2, at->fs_number, VN_DIR, &new_ino)) != 0) {
         printf("ext2: Failed to allocate an inode\n");
         return res;
     }
 
-    // Allocate a block for "." and ".." entries
-    if ((res = ext2_alloc_block(ext2, &new_block_no)) < 0) {
+    struct ext2_inode *ent_inode = (struct ext2_inode *) malloc(sb->inode_struct_size);
+    memset(ent_inode, 0, sb->inode_struct_size);
+
+    // Allocate a block for "." and ".." entries in the directory's
+    // group, inline directories only get one once they outgrow the inode
+    if (!inline_dir && (res = ext2_alloc_blocks(ext2, ext2_inode_goal(ext2, ent_inode, new_ino, 0), 1,
+                                                &new_block_no, &got)) < 0) {
         printf("ext2: Failed to allocate a block\n");
+        free(ent_inode);
         return res;
     }
 
-    struct ext2_inode *ent_inode = (struct ext2_inode *) malloc(sb->inode_struct_size);
-
     // Now create an entry in parents dirent list
-    if ((res = ext2_dir_add_inode(ext2, at, name, new_ino)) < 0) {
+    if ((res = ext2_dir_add_inode(ext2, at, name, new_ino, VN_DIR)) < 0) {
+        free(ent_inode);
         return res;
     }
 
-    // Fill the inode
+    // ".." of the new directory links to the parent
+    ++ext2_vnode_inode(at)->hard_link_count;
+    if ((res = ext2_write_inode(ext2, ext2_vnode_inode(at), at->fs_number)) < 0) {
+        free(ent_inode);
+        return res;
+    }
+
+    // Fill the inode, linked from the parent and from its own "."
     ent_inode->flags = 0;
     ent_inode->dir_acl = 0;
     ent_inode->frag_block_addr = 0;
     ent_inode->gen_number = 0;
-    ent_inode->hard_link_count = 1;
+    ent_inode->hard_link_count = 2;
     ent_inode->acl = 0;
     ent_inode->os_value_1 = 0;
     memset(ent_inode->os_value_2, 0, sizeof(ent_inode->os_value_2));
@@ -167,18 +204,42 @@ static int ext2_vnode_mkdir(vnode_t *at, const char *name, mode_t mode) {
     ent_inode->dtime = 0;
 
     memset(ent_inode->direct_blocks, 0, sizeof(ent_inode->direct_blocks));
-    ent_inode->direct_blocks[0] = new_block_no;
     ent_inode->l1_indirect_block = 0;
     ent_inode->l2_indirect_block = 0;
     ent_inode->l3_indirect_block = 0;
+    if (!inline_dir) {
+        if (ext2_ext_enabled(ext2)) {
+            ext2_ext_init(ent_inode);
+        }
+        // Only changes i_block[] here
+        if ((res = ext2_inode_map_block(ext2, ent_inode, 0, new_block_no)) < 0) {
+            free(ent_inode);
+            return res;
+        }
+    }
 
     ent_inode->type_perm = (mode & 0x1FF) | EXT2_TYPE_DIR;
     // TODO: obtain these from process context in kernel
     ent_inode->uid = 0;
     ent_inode->gid = 0;
-    ent_inode->disk_sector_count = 0;
+    ent_inode->disk_sector_count = sb->block_size / 512;
     ent_inode->size_lower = sb->block_size;
 
+    if (inline_dir) {
+        // Parent inode number, then a single unused entry
+        struct ext2_dirent *dirent = (struct ext2_dirent *) &ext2_inode_block_ptrs(ent_inode)[1];
+
+        ext2_inline_init(ext2, ent_inode);
+        ent_inode->direct_blocks[0] = at->fs_number;
+        dirent->len = EXT2_INLINE_SIZE - 4;
+        ent_inode->disk_sector_count = 0;
+        ent_inode->size_lower = EXT2_INLINE_SIZE;
+
+        res = ext2_write_inode(ext2, ent_inode, new_ino);
+        free(ent_inode);
+        return res;
+    }
+
     memset(block_buffer, 0, sb->block_size);
     // "."
     struct ext2_dirent *dirent = (struct ext2_dirent *) block_buffer;
@@ -186,7 +247,7 @@ static int ext2_vnode_mkdir(vnode_t *at, const char *name, mode_t mode) {
     dirent->name_len = 1;
     dirent->len = (sizeof(struct ext2_dirent) + 4) & ~3;
     dirent->name[0] = '.';
-    dirent->type_ind = 0;
+    dirent->type_ind = ext2_dirent_type(ext2, VN_DIR);
 
     // ".."
     dirent = (struct ext2_dirent *) &block_buffer[dirent->len];
@@ -195,7 +256,7 @@ static int ext2_vnode_mkdir(vnode_t *at, const char *name, mode_t mode) {
     dirent->len = sb->block_size - ((sizeof(struct ext2_dirent) + 4) & ~3);
     dirent->name[0] = '.';
     dirent->name[1] = '.';
-    dirent->type_ind = 0;
+    dirent->type_ind = ext2_dirent_type(ext2, VN_DIR);
 
     // Write directory's first block
     if ((res = ext2_write_block(ext2, new_block_no, block_buffer)) < 0) {
@@ -210,7 +271,19 @@ static int ext2_vnode_mkdir(vnode_t *at, const char *name, mode_t mode) {
     return 0;
 }
 
-static int ext2_vnode_creat(vnode_t *at, struct vfs_ioctx *ctx, const char *name, mode_t mode, int opt, vnode_t **resvn) {
+// Each operation changing metadata is one journal handle, so that it
+// is never split between transactions
+static int ext2_vnode_mkdir(vnode_t *at, const char *name, mode_t mode) {
+    int res;
+
+    ext2_journal_start(at->fs);
+    res = ext2_mkdir(at, name, mode);
+    ext2_journal_stop(at->fs);
+
+    return res;
+}
+
+static int ext2_creat(vnode_t *at, struct vfs_ioctx *ctx, const char *name, mode_t mode, int opt, vnode_t **resvn) {
     fs_t *ext2 = at->fs;
     assert(at->type == VN_DIR);
     assert(/* Don't support making directories like this */ !(mode & O_DIRECTORY));
@@ -219,8 +292,8 @@ static int ext2_vnode_creat(vnode_t *at, struct vfs_ioctx *ctx, const char *name
     uint32_t new_ino;
     int res;
 
-    // Allocate new inode number
-    if ((res = ext2_alloc_inode(ext2, &new_ino)) != 0) {
+    // Allocate new inode number near the parent
+    if ((res = ext2_alloc_inode(ext2, at->fs_number, VN_REG, &new_ino)) != 0) {
         printf("Failed to allocate inode\n");
         return res;
     }
@@ -229,9 +302,10 @@ static int ext2_vnode_creat(vnode_t *at, struct vfs_ioctx *ctx, const char *name
 
     // Create an inode struct in memory
     struct ext2_inode *ent_inode = (struct ext2_inode *) malloc(sb->inode_struct_size);
+    memset(ent_inode, 0, sb->inode_struct_size);
 
     // Now create an entry in parents dirent list
-    if ((res = ext2_dir_add_inode(ext2, at, name, new_ino)) < 0) {
+    if ((res = ext2_dir_add_inode(ext2, at, name, new_ino, VN_REG)) < 0) {
         return res;
     }
 
@@ -261,16 +335,29 @@ static int ext2_vnode_creat(vnode_t *at, struct vfs_ioctx *ctx, const char *name
     ent_inode->type_perm = (mode & 0x1FF) | (EXT2_TYPE_REG);
     ent_inode->disk_sector_count = 0;
     ent_inode->size_lower = 0;
+    // Data goes to blocks once it outgrows the inode
+    if (ext2_inline_enabled(ext2)) {
+        ext2_inline_init(ext2, ent_inode);
+    } else if (ext2_ext_enabled(ext2)) {
+        ext2_ext_init(ent_inode);
+    }
 
     // Write the inode
-    if ((res = ext2_write_inode(ext2, ent_inode, new_ino)) < 0) {
+    res = ext2_write_inode(ext2, ent_inode, new_ino);
+    free(ent_inode);
+    if (res < 0) {
         return res;
     }
 
+    struct ext2_inode_info *info = ext2_inode_info_get(ext2, new_ino);
+    if (!info) {
+        return -EIO;
+    }
+
     // Create the resulting vnode
     vnode_t *vn = (vnode_t *) malloc(sizeof(vnode_t));
     vn->fs = ext2;
-    vn->fs_data = ent_inode;
+    vn->fs_data = info;
     vn->fs_number = new_ino;
     vn->op = &ext2_vnode_ops;
     vn->type = VN_REG;
@@ -280,213 +367,817 @@ static int ext2_vnode_creat(vnode_t *at, struct vfs_ioctx *ctx, const char *name
     return 0;
 }
 
+static int ext2_vnode_creat(vnode_t *at, struct vfs_ioctx *ctx, const char *name, mode_t mode, int opt, vnode_t **resvn) {
+    int res;
+
+    ext2_journal_start(at->fs);
+    res = ext2_creat(at, ctx, name, mode, opt, resvn);
+    ext2_journal_stop(at->fs);
+
+    return res;
+}
+
 #define MIN(x, y) ((x) > (y) ? (y) : (x))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
-static ssize_t ext2_vnode_read(struct ofile *fd, void *buf, size_t count) {
-    vnode_t *vn = fd->vnode;
-    struct ext2_inode *inode = (struct ext2_inode *) vn->fs_data;
-    struct ext2_extsb *sb = vn->fs->fs_private;
+// Copy the data at offset into the buffers, walking the blocks once.
+// Data is read through the cache, holes and unwritten blocks come back
+// as zeroes
+static ssize_t ext2_inode_readv(fs_t *ext2, struct ext2_inode_info *info, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t total = 0, done = 0;
+    size_t seg_off = 0;
+    int seg = 0;
+    int res;
 
-    size_t nread = MIN(inode->size_lower - fd->pos, count);
+    for (int i = 0; i < iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
 
-    if (nread == 0) {
-        return -1;
+    pthread_mutex_lock(&info->lock);
+
+    uint64_t size = ext2_inode_size(info->inode);
+    if (offset >= size) {
+        pthread_mutex_unlock(&info->lock);
+        return 0;
     }
 
-    size_t block_number = fd->pos / sb->block_size;
-    size_t nblocks = (nread + sb->block_size - 1) / sb->block_size;
-    char block_buffer[sb->block_size];
+    size_t nread = MIN(size - offset, total);
 
-    for (size_t i = 0; i < nblocks; ++i) {
-        if (ext2_read_inode_block(vn->fs, inode, i + block_number, block_buffer) < 0) {
-            fprintf(stderr, "Failed to read inode %d block #%zu\n", vn->fs_number, i + block_number);
-            return -EIO;
+    while (done < nread) {
+        size_t block_index = (offset + done) / sb->block_size;
+        size_t pos_in_block = (offset + done) % sb->block_size;
+        size_t ncpy = MIN(sb->block_size - pos_in_block, nread - done);
+        struct ext2_page *page;
+
+        if ((res = ext2_page_get(ext2, info, block_index, 1, &page)) < 0) {
+            fprintf(stderr, "Failed to read inode %u block #%zu\n", info->ino, block_index);
+            pthread_mutex_unlock(&info->lock);
+            return done ? (ssize_t) done : res;
         }
-        if (i == 0) {
-            size_t ncpy = MIN(sb->block_size - fd->pos % sb->block_size, nread);
-            memcpy(buf, block_buffer + fd->pos % sb->block_size, ncpy);
-        } else {
-            size_t ncpy = MIN(sb->block_size, nread - sb->block_size * i);
-            memcpy(buf + sb->block_size * i, block_buffer, ncpy);
+
+        // Scatter the block over the buffers
+        for (size_t k = 0; k < ncpy;) {
+            while (seg_off == iov[seg].iov_len) {
+                ++seg;
+                seg_off = 0;
+            }
+
+            size_t n = MIN(ncpy - k, iov[seg].iov_len - seg_off);
+            memcpy((char *) iov[seg].iov_base + seg_off, page->data + pos_in_block + k, n);
+            seg_off += n;
+            k += n;
         }
+
+        done += ncpy;
     }
 
-    return nread;
+    pthread_mutex_unlock(&info->lock);
+    return done;
 }
 
-static ssize_t ext2_vnode_write(struct ofile *fd, const void *buf, size_t count) {
+// fd->pos is advanced by the caller
+static ssize_t ext2_vnode_read(struct ofile *fd, void *buf, size_t count) {
+    struct iovec iov = { buf, count };
+    return ext2_inode_readv(fd->vnode->fs, ext2_vnode_info(fd->vnode), &iov, 1, fd->pos);
+}
+
+static ssize_t ext2_vnode_preadv(struct ofile *fd, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return ext2_inode_readv(fd->vnode->fs, ext2_vnode_info(fd->vnode), iov, iovcnt, offset);
+}
+
+// Pin the cached page at fd->pos and hand out its data. fd->pos is
+// advanced by the caller
+static ssize_t ext2_vnode_view(struct ofile *fd, size_t count, struct vfs_view *view) {
     vnode_t *vn = fd->vnode;
-    assert(vn);
-    struct ext2_inode *inode = (struct ext2_inode *) vn->fs_data;
-    fs_t *ext2 = vn->fs;
+    struct ext2_inode_info *info = ext2_vnode_info(vn);
+    struct ext2_extsb *sb = vn->fs->fs_private;
+    struct ext2_page *page;
+    int res;
+
+    pthread_mutex_lock(&info->lock);
+
+    uint64_t size = ext2_inode_size(info->inode);
+    if (fd->pos >= size) {
+        pthread_mutex_unlock(&info->lock);
+        return 0;
+    }
+
+    size_t pos_in_block = fd->pos % sb->block_size;
+    size_t length = MIN(MIN(size - fd->pos, count), sb->block_size - pos_in_block);
+
+    if ((res = ext2_page_get(vn->fs, info, fd->pos / sb->block_size, 1, &page)) < 0) {
+        pthread_mutex_unlock(&info->lock);
+        return res;
+    }
+    ++page->pins;
+
+    pthread_mutex_unlock(&info->lock);
+
+    view->data = page->data + pos_in_block;
+    view->length = length;
+    view->priv = page;
+
+    return length;
+}
+
+static void ext2_vnode_view_put(struct ofile *fd, struct vfs_view *view) {
+    struct ext2_inode_info *info = ext2_vnode_info(fd->vnode);
+
+    pthread_mutex_lock(&info->lock);
+    ext2_page_unpin((struct ext2_page *) view->priv);
+    pthread_mutex_unlock(&info->lock);
+}
+
+// Zero the part of the last block past EOF before the file grows, so
+// stale data does not reappear when the gap becomes readable
+static int ext2_inode_zero_tail(fs_t *ext2, struct ext2_inode_info *info) {
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode *inode = info->inode;
+    uint64_t size = ext2_inode_size(inode);
+    size_t pos_in_block = size % sb->block_size;
+    size_t block_index = size / sb->block_size;
     char block_buffer[sb->block_size];
+    struct ext2_page *page;
+    uint32_t block_no;
+    int uninit;
     int res;
 
-    if (fd->pos > inode->size_lower) {
-        // This shouldn't be possible, yeah?
-        return -ESPIPE;
+    if (!pos_in_block) {
+        return 0;
     }
 
-    // How many bytes can we write into the blocks already allocated
-    size_t size_blocks = (inode->size_lower + sb->block_size - 1) / sb->block_size;
-    size_t can_write = size_blocks * sb->block_size - inode->size_lower;
-    size_t current_block = fd->pos / sb->block_size;
-    size_t written = 0;
-    size_t remaining = count;
+    if ((page = ext2_page_find(info, block_index))) {
+        // The page goes to disk as a whole
+        memset(page->data + pos_in_block, 0, sb->block_size - pos_in_block);
+        if (page->dirty) {
+            return 0;
+        }
+    }
 
-    if (can_write) {
-        size_t can_write_blocks = (can_write + sb->block_size - 1) / sb->block_size;
+    if ((res = ext2_inode_lookup_block(ext2, inode, block_index, &block_no, &uninit)) < 0) {
+        return res;
+    }
+    if (!block_no || uninit) {
+        // A hole is zero already, and so is a block never written
+        return 0;
+    }
 
-        for (size_t i = 0; i < can_write_blocks; ++i) {
-            size_t block_index = current_block + i;
-            size_t pos_in_block = fd->pos % sb->block_size;
-            size_t need_write = MIN(remaining, sb->block_size - pos_in_block);
+    if ((res = ext2_read_block(ext2, block_no, block_buffer)) < 0) {
+        return res;
+    }
+    memset(block_buffer + pos_in_block, 0, sb->block_size - pos_in_block);
 
-            printf("Write %zuB to block %zu offset %zu\n", need_write, block_index, pos_in_block);
-            if (need_write == sb->block_size) {
-                // Can write block without reading it
-                // TODO: implement this
-                abort();
-            } else {
-                // Read the block to change its contents
-                // and write it back again
-                if ((res = ext2_read_inode_block(ext2, inode, block_index, block_buffer)) < 0) {
-                    break;
-                }
+    return ext2_write_blocks(ext2, block_no, 1, block_buffer);
+}
 
-                memcpy(block_buffer + pos_in_block, buf + written, need_write);
+// Make sure appends start at least at size. The caller holds info->lock
+static void ext2_append_end_raise(struct ext2_inode_info *info, uint64_t size) {
+    uint64_t end = atomic_load(&info->append_end);
 
-                if ((res = ext2_write_inode_block(ext2, inode, block_index, block_buffer)) < 0) {
-                    break;
-                }
+    while (end < size && !atomic_compare_exchange_weak(&info->append_end, &end, size));
+}
+
+// Copy data at pos into the cache, up to the end of the block. The
+// caller holds info->lock
+static ssize_t ext2_inode_write_block(fs_t *ext2, struct ext2_inode_info *info, uint64_t pos, const void *buf, size_t count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t block_index = pos / sb->block_size;
+    size_t pos_in_block = pos % sb->block_size;
+    size_t need_write = MIN(count, sb->block_size - pos_in_block);
+    struct ext2_page *page;
+    uint32_t block_no;
+    int mapped = 1;
+    int res;
+
+    if (pos >= sb->max_file_size) {
+        return -EFBIG;
+    }
+    need_write = MIN(need_write, sb->max_file_size - pos);
+    page = ext2_page_find(info, block_index);
+
+    if (!page || !page->dirty) {
+        if ((res = ext2_inode_get_block(ext2, info->inode, block_index, &block_no)) < 0) {
+            return res;
+        }
+        if (!block_no) {
+            // Filling a hole, make sure there will be a block for it
+            if ((res = ext2_page_reserve(ext2, info)) < 0) {
+                return res;
             }
+            mapped = 0;
+        }
+    }
 
-            written += need_write;
-            fd->pos += need_write;
-            remaining -= need_write;
+    if ((res = ext2_page_get(ext2, info, block_index, need_write != sb->block_size, &page)) < 0) {
+        return res;
+    }
+
+    memcpy(page->data + pos_in_block, buf, need_write);
+    ext2_page_dirty(ext2, info, page, mapped);
+
+    if (pos + need_write > ext2_inode_size(info->inode)) {
+        // Goes to disk with the pages
+        if ((res = ext2_inode_set_size(ext2, info->inode, pos + need_write)) < 0) {
+            return res;
         }
+        info->inode_dirty = 1;
+    }
+
+    return need_write;
+}
 
-        inode->size_lower = MAX(fd->pos, inode->size_lower);
-        current_block += can_write_blocks;
+// O_APPEND write. Appenders reserve their ranges by bumping append_end,
+// so they only contend for the lock block by block: a reader may see
+// zeroes in place of an append still in progress. Returns the offset
+// past the data written in end
+static ssize_t ext2_inode_appendv(fs_t *ext2, struct ext2_inode_info *info, const struct iovec *iov, int iovcnt, uint64_t *end) {
+    size_t count = 0, written = 0;
+    ssize_t res = 0;
+
+    // The length written has to fit the result
+    for (int i = 0; i < iovcnt; ++i) {
+        count += MIN(iov[i].iov_len, (size_t) SSIZE_MAX - count);
     }
 
-    if (remaining) {
-        // Need to allocate additional blocks
-        size_t need_blocks = (remaining + sb->block_size - 1) / sb->block_size;
+    uint64_t pos = atomic_fetch_add(&info->append_end, count);
 
-        for (size_t i = 0; i < need_blocks; ++i) {
-            size_t block_index = current_block + i;
-            size_t need_write = MIN(remaining, sb->block_size);
+    for (int i = 0; i < iovcnt && res >= 0 && written < count; ++i) {
+        for (size_t off = 0; off < iov[i].iov_len && written < count;) {
+            pthread_mutex_lock(&info->lock);
 
-            // Update the size here so it gets written when the block is allocated
-            // and inode struct is flushed
-            inode->size_lower += need_write;
-            // Allocate a block for the index
-            if ((res = ext2_inode_alloc_block(ext2, inode, vn->fs_number, block_index)) < 0) {
-                printf("Could not allocate a block for writing\n");
+            // Nothing is written past size yet, so only stale data is zeroed
+            if (pos + written > ext2_inode_size(info->inode) && (res = ext2_inode_zero_tail(ext2, info)) < 0) {
+                pthread_mutex_unlock(&info->lock);
                 break;
             }
 
+            res = ext2_inode_write_block(ext2, info, pos + written, (const char *) iov[i].iov_base + off,
+                                         MIN(iov[i].iov_len - off, count - written));
 
-            if (need_write == sb->block_size) {
-                // TODO: implement this
-                abort();
-            } else {
-                // Writing the last block
-                memcpy(block_buffer, buf + written, need_write);
+            pthread_mutex_unlock(&info->lock);
 
-                if ((res = ext2_write_inode_block(ext2, inode, block_index, block_buffer)) < 0) {
-                    break;
-                }
+            if (res < 0) {
+                break;
             }
+            off += res;
+            written += res;
+        }
+    }
+
+    if (written < count) {
+        // Give the rest of the range back unless someone appended after it
+        uint64_t reserved_end = pos + count;
+        atomic_compare_exchange_strong(&info->append_end, &reserved_end, pos + written);
+    }
+
+    *end = pos + written;
+
+    if (written) {
+        pthread_mutex_lock(&info->lock);
+        ext2_cache_throttle(ext2, info);
+        pthread_mutex_unlock(&info->lock);
+    }
+
+    return written ? (ssize_t) written : res;
+}
+
+// Writes only go to the cache: blocks for the new data are allocated
+// when the pages are written back, all at once. The caller holds
+// info->lock
+static ssize_t ext2_inode_writev(fs_t *ext2, struct ext2_inode_info *info, const struct iovec *iov, int iovcnt, uint64_t pos) {
+    size_t written = 0;
+    ssize_t res = 0;
+
+    // Writing past EOF leaves a hole between the old size and pos:
+    // only the blocks actually written to get allocated
+    if (pos > ext2_inode_size(info->inode) && (res = ext2_inode_zero_tail(ext2, info)) < 0) {
+        return res;
+    }
+
+    // The length written has to fit the result
+    for (int i = 0; i < iovcnt && res >= 0 && written < (size_t) SSIZE_MAX; ++i) {
+        for (size_t off = 0; off < iov[i].iov_len && written < (size_t) SSIZE_MAX;) {
+            res = ext2_inode_write_block(ext2, info, pos + written, (const char *) iov[i].iov_base + off,
+                                         MIN(iov[i].iov_len - off, (size_t) SSIZE_MAX - written));
+            if (res < 0) {
+                break;
+            }
+            off += res;
+            written += res;
+        }
+    }
+
+    ext2_append_end_raise(info, ext2_inode_size(info->inode));
+
+    // Write-back errors are reported on close
+    if (written) {
+        ext2_cache_throttle(ext2, info);
+    }
 
-            written += need_write;
-            fd->pos += need_write;
-            remaining -= need_write;
+    return written ? (ssize_t) written : res;
+}
+
+// The only writes moving fd->pos
+static ssize_t ext2_vnode_writev(struct ofile *fd, const struct iovec *iov, int iovcnt) {
+    vnode_t *vn = fd->vnode;
+    assert(vn);
+    struct ext2_inode_info *info = ext2_vnode_info(vn);
+    uint64_t end;
+    ssize_t res;
+
+    ext2_journal_start(vn->fs);
+    if (fd->flags & O_APPEND) {
+        if ((res = ext2_inode_appendv(vn->fs, info, iov, iovcnt, &end)) > 0) {
+            fd->pos = end;
         }
     } else {
-        if (written) {
-            // Flush inode struct to disk - size has changed
-            ext2_write_inode(ext2, inode, vn->fs_number);
+        pthread_mutex_lock(&info->lock);
+        if ((res = ext2_inode_writev(vn->fs, info, iov, iovcnt, fd->pos)) > 0) {
+            fd->pos += res;
         }
+        pthread_mutex_unlock(&info->lock);
     }
+    ext2_journal_stop(vn->fs);
 
-    return written;
+    return res;
 }
 
-static int ext2_vnode_truncate(struct ofile *fd, size_t length) {
-    vnode_t *vn = fd->vnode;
-    fs_t *ext2 = vn->fs;
-    struct ext2_inode *inode = (struct ext2_inode *) vn->fs_data;
-    struct ext2_extsb *sb = vn->fs->fs_private;
-    int res;
+static ssize_t ext2_vnode_write(struct ofile *fd, const void *buf, size_t count) {
+    struct iovec iov = { (void *) buf, count };
 
-    if (length == inode->size_lower) {
-        // Already good
+    if (!count) {
         return 0;
     }
 
-    size_t was_blocks = (inode->size_lower + sb->block_size - 1) / sb->block_size;
-    size_t now_blocks = (length + sb->block_size - 1) / sb->block_size;
-    ssize_t delta_blocks = now_blocks - was_blocks;
-
-    if (delta_blocks < 0) {
-        // Free truncated blocks
-        // XXX: reverse the loop
-        for (size_t i = now_blocks; i < was_blocks; ++i) {
-            // Modify inode right here because ext2_free_inode_block will
-            // flush these changes to disk so we don't have to write it
-            // twice
-            inode->size_lower -= sb->block_size;
-            if ((res = ext2_free_inode_block(ext2, inode, vn->fs_number, i)) < 0) {
-                // Put the block size back, couldn't free it
-                inode->size_lower += sb->block_size;
+    return ext2_vnode_writev(fd, &iov, 1);
+}
+
+static ssize_t ext2_vnode_pwritev(struct ofile *fd, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    struct ext2_inode_info *info = ext2_vnode_info(fd->vnode);
+    uint64_t end;
+    ssize_t res;
+
+    ext2_journal_start(fd->vnode->fs);
+    if (fd->flags & O_APPEND) {
+        res = ext2_inode_appendv(fd->vnode->fs, info, iov, iovcnt, &end);
+    } else {
+        pthread_mutex_lock(&info->lock);
+        res = ext2_inode_writev(fd->vnode->fs, info, iov, iovcnt, offset);
+        pthread_mutex_unlock(&info->lock);
+    }
+    ext2_journal_stop(fd->vnode->fs);
+
+    return res;
+}
+
+// Lock two inodes in ino order
+static void ext2_inode_lock2(struct ext2_inode_info *a, struct ext2_inode_info *b) {
+    if (a == b) {
+        pthread_mutex_lock(&a->lock);
+    } else if (a->ino < b->ino) {
+        pthread_mutex_lock(&a->lock);
+        pthread_mutex_lock(&b->lock);
+    } else {
+        pthread_mutex_lock(&b->lock);
+        pthread_mutex_lock(&a->lock);
+    }
+}
+
+static void ext2_inode_unlock2(struct ext2_inode_info *a, struct ext2_inode_info *b) {
+    pthread_mutex_unlock(&a->lock);
+    if (a != b) {
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+// Copy one chunk, up to the end of the source block. Whole holes copied
+// past the end of the destination stay holes. Both locks are held
+static ssize_t ext2_inode_copy_chunk(fs_t *ext2, struct ext2_inode_info *src, uint64_t src_pos,
+                                     struct ext2_inode_info *dst, uint64_t dst_pos, size_t count) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    size_t index = src_pos / sb->block_size;
+    size_t pos_in_block = src_pos % sb->block_size;
+    size_t n = MIN(count, sb->block_size - pos_in_block);
+    struct ext2_page *page;
+    uint32_t block_no;
+    int uninit;
+    ssize_t res;
+
+    uint64_t dst_size = ext2_inode_size(dst->inode);
+    if (dst_pos > dst_size && (res = ext2_inode_zero_tail(ext2, dst)) < 0) {
+        return res;
+    }
+
+    if (n == sb->block_size && dst_pos % sb->block_size == 0 && dst_pos >= dst_size &&
+        !ext2_page_find(src, index)) {
+        if ((res = ext2_inode_lookup_block(ext2, src->inode, index, &block_no, &uninit)) < 0) {
+            return res;
+        }
+        if (!block_no || uninit) {
+            if ((res = ext2_inode_set_size(ext2, dst->inode, dst_pos + n)) < 0) {
                 return res;
             }
+            dst->inode_dirty = 1;
+            return n;
         }
+    }
 
-        // All the blocks were successfully freed, can set proper file length
-        if (inode->size_lower != length) {
-            // If requested size is not block-aligned, we need to write inode
-            // struct to disk once again
-            inode->size_lower = length;
+    if ((res = ext2_page_get(ext2, src, index, 1, &page)) < 0) {
+        return res;
+    }
 
-            if ((res = ext2_write_inode(ext2, inode, vn->fs_number)) < 0) {
-                return res;
-            }
+    // Getting destination pages may evict others of the same file
+    ++page->pins;
+    res = ext2_inode_write_block(ext2, dst, dst_pos, page->data + pos_in_block, n);
+    ext2_page_unpin(page);
+
+    return res;
+}
+
+// Move the data from the source pages straight into the destination
+// ones, with no intermediate buffer
+static ssize_t ext2_vnode_copy_range(struct ofile *src, uint64_t src_off, struct ofile *dst, uint64_t dst_off, size_t count) {
+    fs_t *ext2 = dst->vnode->fs;
+    struct ext2_inode_info *src_info = ext2_vnode_info(src->vnode);
+    struct ext2_inode_info *dst_info = ext2_vnode_info(dst->vnode);
+    size_t done = 0;
+    ssize_t res = 0;
+
+    if (src->vnode->type != VN_REG) {
+        return -EINVAL;
+    }
+
+    ext2_journal_start(ext2);
+    while (done < count) {
+        ext2_inode_lock2(src_info, dst_info);
+
+        uint64_t size = ext2_inode_size(src_info->inode);
+        if (src_off + done >= size) {
+            ext2_inode_unlock2(src_info, dst_info);
+            break;
+        }
+
+        res = ext2_inode_copy_chunk(ext2, src_info, src_off + done, dst_info, dst_off + done,
+                                    MIN(count - done, size - src_off - done));
+
+        ext2_inode_unlock2(src_info, dst_info);
+
+        if (res < 0) {
+            break;
         }
+        done += res;
+    }
+
+    if (done) {
+        pthread_mutex_lock(&dst_info->lock);
+        ext2_append_end_raise(dst_info, ext2_inode_size(dst_info->inode));
+        ext2_cache_throttle(ext2, dst_info);
+        pthread_mutex_unlock(&dst_info->lock);
+    }
+    ext2_journal_stop(ext2);
+
+    return done ? (ssize_t) done : res;
+}
+
+static int ext2_inode_truncate(fs_t *ext2, struct ext2_inode_info *info, uint64_t length) {
+    struct ext2_inode *inode = info->inode;
+    struct ext2_extsb *sb = ext2->fs_private;
+    int res = 0;
 
+    pthread_mutex_lock(&info->lock);
+
+    uint64_t size = ext2_inode_size(inode);
+    if (length == size) {
+        // Already good
+        pthread_mutex_unlock(&info->lock);
         return 0;
-    } else {
-        fprintf(stderr, "ext2: truncate upwards not yet implemented\n");
+    }
+
+    if (ext2_inode_inline(inode) && !ext2_inline_fits(ext2, inode, length) &&
+        (res = ext2_inline_promote(ext2, info)) < 0) {
+        pthread_mutex_unlock(&info->lock);
+        return res;
+    }
+
+    if (length > size) {
+        // Growing the file just makes a hole at its end
+        if (length > sb->max_file_size) {
+            res = -EFBIG;
+        } else if ((res = ext2_inode_zero_tail(ext2, info)) == 0 &&
+                   (res = ext2_inode_set_size(ext2, inode, length)) == 0) {
+            atomic_store(&info->append_end, length);
+            res = ext2_write_inode(ext2, inode, info->ino);
+        }
+
+        pthread_mutex_unlock(&info->lock);
+        return res;
+    }
+
+    size_t was_blocks = (size + sb->block_size - 1) / sb->block_size;
+    size_t now_blocks = (length + sb->block_size - 1) / sb->block_size;
+
+    // Set the size first so that a failure halfway never leaves the
+    // size pointing past a freed block. Shrinking never fails
+    ext2_inode_set_size(ext2, inode, length);
+    atomic_store(&info->append_end, length);
+    ext2_pages_truncate(ext2, info, now_blocks);
+    ext2_rsv_discard(ext2, &info->rsv);
+
+    if (ext2_inode_inline(inode)) {
+        // Nothing past the size may show up if the file grows again
+        char *data = (char *) ext2_inode_block_ptrs(inode);
+        memset(data + length, 0, EXT2_INLINE_SIZE - length);
+        was_blocks = 0;
+    }
+
+    // Free truncated blocks, holes are skipped
+    if (was_blocks > now_blocks) {
+        res = ext2_free_inode_blocks(ext2, inode, now_blocks, was_blocks - now_blocks);
+    }
+
+    if (res == 0) {
+        res = ext2_write_inode(ext2, inode, info->ino);
+    }
+
+    pthread_mutex_unlock(&info->lock);
+    return res;
+}
+
+// Blocks of the range looked up at once by fallocate()
+#define EXT2_FALLOC_CHUNK       4096
+
+// The allocated run from block_no could not be mapped at index, or only
+// partly: the blocks not mapped are freed, the others count for the
+// inode. blocks has room for count entries
+static void ext2_falloc_undo(fs_t *ext2, struct ext2_inode *inode, uint32_t index, uint32_t block_no,
+                             uint32_t count, uint32_t *blocks) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_free_batch batch = { 0 };
+
+    // Can't tell what got mapped, leak it all rather than free it
+    if (ext2_inode_lookup_blocks(ext2, inode, index, count, blocks, NULL) < 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        if (blocks[i] == block_no + i) {
+            inode->disk_sector_count += sb->block_size / 512;
+        } else if (ext2_free_batch_add(ext2, &batch, block_no + i, 1) < 0) {
+            break;
+        }
+    }
+    ext2_free_batch_apply(ext2, &batch);
+    free(batch.runs);
+}
+
+// Allocate blocks for the range up front, as contiguous as possible.
+// Extent-mapped files get them as uninitialized extents, which read back
+// as zeroes until written and cost no I/O. A block map has no way to
+// tell, so the blocks are zeroed before they are mapped. The map is
+// looked up a chunk at a time, and only once if the range fits in one
+static int ext2_inode_fallocate(fs_t *ext2, struct ext2_inode_info *info, int mode, uint64_t offset, uint64_t length) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    struct ext2_inode *inode = info->inode;
+    uint32_t ptrs = sb->block_size / 4;
+    uint32_t offsets[4];
+    uint32_t *blocks;
+    uint32_t block_no, goal = 0;
+    size_t holes = 0;
+    int mapped = 0;
+    int res = 0;
+
+    if (!length) {
         return -EINVAL;
     }
+
+    if (offset + length > sb->max_file_size || offset + length < offset) {
+        return -EFBIG;
+    }
+
+    // Space is only reserved in blocks
+    if (ext2_inode_inline(inode) && (res = ext2_inline_promote(ext2, info)) < 0) {
+        return res;
+    }
+
+    // Blocks past the end of a block map look like corruption to fsck
+    if (!ext2_inode_extents(inode) && (mode & VFS_FALLOC_KEEP_SIZE) &&
+            offset + length > ext2_inode_size(inode)) {
+        return -EOPNOTSUPP;
+    }
+
+    size_t first = offset / sb->block_size;
+    size_t last = (offset + length - 1) / sb->block_size;
+    size_t chunk = MIN(last - first + 1, EXT2_FALLOC_CHUNK);
+
+    if (!ext2_inode_extents(inode) && ext2_block_map_path(ext2, last, offsets) < 0) {
+        return -EFBIG;
+    }
+
+    if (!(blocks = (uint32_t *) malloc(chunk * sizeof(uint32_t)))) {
+        return -ENOMEM;
+    }
+
+    // Count the blocks to allocate, including the worst case of
+    // indirect blocks, so running out of space is reported before
+    // anything is allocated
+    for (size_t c = first; c <= last; c += chunk) {
+        size_t n = MIN(chunk, last + 1 - c);
+
+        if ((res = ext2_inode_lookup_blocks(ext2, inode, c, n, blocks, NULL)) < 0) {
+            goto out;
+        }
+        for (size_t j = 0; j < n; ++j) {
+            if (!blocks[j]) {
+                ++holes;
+            }
+        }
+    }
+    if (holes) {
+        size_t need = holes + holes / ptrs + holes / ((size_t) ptrs * ptrs) + 3;
+        if (need > ext2_free_blocks_count(ext2)) {
+            res = -ENOSPC;
+            goto out;
+        }
+    }
+
+    // Continue right after the block preceding the range
+    if (first && (res = ext2_inode_get_block(ext2, inode, first - 1, &goal)) < 0) {
+        goto out;
+    }
+    if (goal) {
+        ++goal;
+    }
+
+    for (size_t c = first; c <= last && holes; c += chunk) {
+        size_t n = MIN(chunk, last + 1 - c);
+
+        // A single chunk was looked up above already
+        if (chunk <= last - first && (res = ext2_inode_lookup_blocks(ext2, inode, c, n, blocks, NULL)) < 0) {
+            goto out;
+        }
+
+        for (size_t j = 0; j < n && holes;) {
+            if (blocks[j]) {
+                goal = blocks[j] + 1;
+                ++j;
+                continue;
+            }
+
+            // Length of this hole
+            size_t run = 1;
+            while (j + run < n && !blocks[j + run]) {
+                ++run;
+            }
+
+            while (run) {
+                uint32_t got;
+
+                if ((res = ext2_alloc_blocks(ext2, goal, run, &block_no, &got)) < 0) {
+                    goto out;
+                }
+
+                if (ext2_inode_extents(inode)) {
+                    res = ext2_ext_map_blocks(ext2, inode, c + j, block_no, got, 1);
+                } else if ((res = ext2_zero_blocks(ext2, block_no, got)) == 0) {
+                    res = ext2_inode_map_blocks(ext2, inode, c + j, block_no, got);
+                }
+                mapped = 1;
+                if (res < 0) {
+                    // The entries of the hole are not needed anymore
+                    ext2_falloc_undo(ext2, inode, c + j, block_no, got, &blocks[j]);
+                    goto out;
+                }
+                inode->disk_sector_count += got * (sb->block_size / 512);
+
+                goal = block_no + got;
+                holes -= got;
+                run -= got;
+                j += got;
+            }
+        }
+    }
+
+    if (!(mode & VFS_FALLOC_KEEP_SIZE) && offset + length > ext2_inode_size(inode)) {
+        if ((res = ext2_inode_zero_tail(ext2, info)) < 0) {
+            goto out;
+        }
+        if ((res = ext2_inode_set_size(ext2, inode, offset + length)) < 0) {
+            goto out;
+        }
+        ext2_append_end_raise(info, offset + length);
+    }
+
+    res = ext2_write_inode(ext2, inode, info->ino);
+
+out:
+    // The blocks mapped before the failure stay allocated
+    if (res < 0 && mapped) {
+        ext2_write_inode(ext2, inode, info->ino);
+    }
+    free(blocks);
+    return res;
+}
+
+static int ext2_vnode_truncate(struct ofile *fd, uint64_t length) {
+    int res;
+
+    ext2_journal_start(fd->vnode->fs);
+    res = ext2_inode_truncate(fd->vnode->fs, ext2_vnode_info(fd->vnode), length);
+    ext2_journal_stop(fd->vnode->fs);
+
+    return res;
+}
+
+static int ext2_vnode_fallocate(struct ofile *fd, int mode, uint64_t offset, uint64_t length) {
+    struct ext2_inode_info *info = ext2_vnode_info(fd->vnode);
+    int res;
+
+    ext2_journal_start(fd->vnode->fs);
+    pthread_mutex_lock(&info->lock);
+    res = ext2_inode_fallocate(fd->vnode->fs, info, mode, offset, length);
+    pthread_mutex_unlock(&info->lock);
+    ext2_journal_stop(fd->vnode->fs);
+
+    return res;
+}
+
+// Write back the file once it's closed
+static void ext2_vnode_close(struct ofile *fd) {
+    vnode_t *vn = fd->vnode;
+    struct ext2_inode_info *info = ext2_vnode_info(vn);
+
+    if (vn->type != VN_REG) {
+        return;
+    }
+
+    ext2_journal_start(vn->fs);
+    pthread_mutex_lock(&info->lock);
+    if (ext2_inode_flush(vn->fs, info) < 0) {
+        fprintf(stderr, "ext2: write-back of inode %u failed\n", info->ino);
+    }
+    pthread_mutex_unlock(&info->lock);
+    ext2_journal_stop(vn->fs);
+}
+
+// Write back the data, then the inode which refers to it. With datasync
+// the free counts are not written, they are not needed to read the data
+static int ext2_vnode_fsync(struct ofile *fd, int datasync) {
+    vnode_t *vn = fd->vnode;
+    fs_t *ext2 = vn->fs;
+    struct ext2_inode_info *info = ext2_vnode_info(vn);
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int res;
+
+    ext2_journal_start(ext2);
+    pthread_mutex_lock(&info->lock);
+
+    if ((res = ext2_inode_flush_pages(ext2, info)) == 0 && info->inode_dirty) {
+        // The data has to be durable before the inode points to it. A
+        // journal commit flushes the data before its commit block
+        if ((sb->journal || (res = blk_flush(ext2->blk)) == 0) &&
+            (res = ext2_write_inode(ext2, info->inode, info->ino)) == 0) {
+            info->inode_dirty = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&info->lock);
+
+    if (res == 0 && !datasync) {
+        res = ext2_write_meta(ext2);
+    }
+    ext2_journal_stop(ext2);
+
+    if (res < 0) {
+        return res;
+    }
+    if ((res = ext2_journal_commit(ext2)) != 0) {
+        return res < 0 ? res : 0;
+    }
+
+    return blk_flush(ext2->blk);
 }
 
-// TODO: replace this with getdents
 static int ext2_vnode_readdir(struct ofile *fd) {
     vnode_t *vn = fd->vnode;
-    struct ext2_inode *inode = (struct ext2_inode *) vn->fs_data;
+    struct ext2_inode *inode = ext2_vnode_inode(vn);
     struct ext2_extsb *sb = vn->fs->fs_private;
 
-    if (fd->pos >= inode->size_lower) {
+    if (fd->pos >= ext2_dir_size(vn->fs, inode)) {
         return -1;
     }
 
     size_t block_number = fd->pos / sb->block_size;
     char block_buffer[sb->block_size];
 
-    if (ext2_read_inode_block(vn->fs, inode, block_number, block_buffer) < 0) {
+    if (ext2_dir_read_block(vn->fs, vn, block_number, block_buffer) < 0) {
         return -EIO;
     }
 
     size_t block_offset = fd->pos % sb->block_size;
     struct ext2_dirent *ext2dir = (struct ext2_dirent *) &block_buffer[block_offset];
 
-    if (ext2dir->len == 0) {
-        // If entry size is zero, guess we're finished - align the fd->pos up to block size
-        fd->pos = (fd->pos + sb->block_size - 1) / sb->block_size;
+    if (!ext2_dirent_valid(vn->fs, block_buffer, block_offset)) {
+        // Not at an entry, guess we're finished - align the fd->pos up to block size
+        fd->pos = ((fd->pos + sb->block_size - 1) / sb->block_size) * sb->block_size;
         return -1;
     }
 
@@ -496,7 +1187,7 @@ static int ext2_vnode_readdir(struct ofile *fd) {
     strncpy(vfsdir->d_name, ext2dir->name, ext2dir->name_len);
     vfsdir->d_name[ext2dir->name_len] = 0;
     vfsdir->d_reclen = ext2dir->len;
-    vfsdir->d_type = ext2dir->type_ind;
+    vfsdir->d_type = ext2_dirent_dtype(vn->fs, ext2dir);
     // Not implemented, I guess
     vfsdir->d_off = 0;
 
@@ -505,18 +1196,241 @@ static int ext2_vnode_readdir(struct ofile *fd) {
     return 0;
 }
 
+static ssize_t ext2_vnode_getdents(struct ofile *fd, void *buf, size_t count) {
+    vnode_t *vn = fd->vnode;
+    struct ext2_inode *inode = ext2_vnode_inode(vn);
+    struct ext2_extsb *sb = vn->fs->fs_private;
+    char block_buffer[sb->block_size];
+    size_t written = 0;
+
+    while (fd->pos < ext2_dir_size(vn->fs, inode)) {
+        size_t block_number = fd->pos / sb->block_size;
+        size_t block_offset = fd->pos % sb->block_size;
+
+        // Each directory block is read only once per call - all the
+        // entries it contains are packed into the buffer from here
+        if (ext2_dir_read_block(vn->fs, vn, block_number, block_buffer) < 0) {
+            return written ? (ssize_t) written : -EIO;
+        }
+
+        while (block_offset < sb->block_size) {
+            struct ext2_dirent *ext2dir = (struct ext2_dirent *) &block_buffer[block_offset];
+
+            if (!ext2_dirent_valid(vn->fs, block_buffer, block_offset)) {
+                // Not at an entry, skip the rest of the block
+                break;
+            }
+
+            if (ext2dir->ino) {
+                size_t reclen = VFS_DIRENT_RECLEN(ext2dir->name_len);
+
+                if (written + reclen > count) {
+                    // Buffer is full, continue from this entry next time
+                    fd->pos = block_number * sb->block_size + block_offset;
+                    return written ? (ssize_t) written : -EINVAL;
+                }
+
+                struct dirent *vfsdir = (struct dirent *) ((char *) buf + written);
+
+                vfsdir->d_ino = ext2dir->ino;
+                memcpy(vfsdir->d_name, ext2dir->name, ext2dir->name_len);
+                vfsdir->d_name[ext2dir->name_len] = 0;
+                vfsdir->d_reclen = reclen;
+                vfsdir->d_type = ext2_dirent_dtype(vn->fs, ext2dir);
+                vfsdir->d_off = block_number * sb->block_size + block_offset + ext2dir->len;
+
+                written += reclen;
+            }
+
+            block_offset += ext2dir->len;
+        }
+
+        fd->pos = (block_number + 1) * sb->block_size;
+    }
+
+    return written;
+}
+
+// Max. number of inode table blocks loaded with one request
+// when filling the stats for readdirplus()
+#define EXT2_PLUS_TABLE_RUN     16
+
+struct ext2_plus_ent {
+    uint32_t block_no;
+    uint32_t offset;
+    uint32_t ino;
+    struct dirent_plus *rec;
+};
+
+static void ext2_inode_stat(struct ext2_extsb *sb, const struct ext2_inode *inode, uint32_t ino, struct stat *st);
+
+static int ext2_plus_ent_cmp(const void *a, const void *b) {
+    const struct ext2_plus_ent *e0 = a, *e1 = b;
+    if (e0->block_no != e1->block_no) {
+        return e0->block_no < e1->block_no ? -1 : 1;
+    }
+    return e0->offset < e1->offset ? -1 : (e0->offset > e1->offset);
+}
+
+// Fill the stats of collected entries, reading every inode table block
+// they need only once and adjacent blocks with a single request
+static int ext2_plus_fill_stats(fs_t *ext2, struct ext2_plus_ent *ents, size_t nents, char *table) {
+    struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
+    int res;
+
+    qsort(ents, nents, sizeof(struct ext2_plus_ent), ext2_plus_ent_cmp);
+
+    for (size_t i = 0; i < nents;) {
+        uint32_t first = ents[i].block_no;
+        uint32_t nblocks = 1;
+        size_t j = i + 1;
+
+        while (j < nents) {
+            if (ents[j].block_no == first + nblocks - 1) {
+                ++j;
+            } else if (ents[j].block_no == first + nblocks && nblocks < EXT2_PLUS_TABLE_RUN) {
+                ++nblocks;
+                ++j;
+            } else {
+                break;
+            }
+        }
+
+        if ((res = ext2_read_blocks(ext2, first, nblocks, table)) < 0) {
+            return -EIO;
+        }
+
+        for (; i < j; ++i) {
+            struct ext2_inode *inode = (struct ext2_inode *)
+                &table[(ents[i].block_no - first) * sb->block_size + ents[i].offset];
+            // Inodes in use may have changes not written back yet
+            ext2_inode_info_copy(ext2, ents[i].ino, inode);
+            ext2_inode_stat(sb, inode, ents[i].ino, &ents[i].rec->dp_stat);
+        }
+    }
+
+    return 0;
+}
+
+static ssize_t ext2_vnode_readdirplus(struct ofile *fd, void *buf, size_t count) {
+    vnode_t *vn = fd->vnode;
+    fs_t *ext2 = vn->fs;
+    struct ext2_inode *inode = ext2_vnode_inode(vn);
+    struct ext2_extsb *sb = ext2->fs_private;
+    char block_buffer[sb->block_size];
+    // Entries are at least 8 bytes long
+    size_t max_ents = sb->block_size / sizeof(struct ext2_dirent);
+    struct ext2_plus_ent *ents;
+    char *table;
+    size_t written = 0;
+    int res;
+
+    if (fd->pos >= ext2_dir_size(ext2, inode)) {
+        return 0;
+    }
+
+    // The entries of a block go after the inode table run
+    if (!(table = malloc(EXT2_PLUS_TABLE_RUN * sb->block_size + max_ents * sizeof(struct ext2_plus_ent)))) {
+        return -ENOMEM;
+    }
+    ents = (struct ext2_plus_ent *) &table[EXT2_PLUS_TABLE_RUN * sb->block_size];
+
+    while (fd->pos < ext2_dir_size(ext2, inode)) {
+        size_t block_number = fd->pos / sb->block_size;
+        size_t block_offset = fd->pos % sb->block_size;
+        size_t nents = 0;
+        int full = 0;
+
+        if (ext2_dir_read_block(ext2, vn, block_number, block_buffer) < 0) {
+            free(table);
+            return written ? (ssize_t) written : -EIO;
+        }
+
+        while (block_offset < sb->block_size) {
+            struct ext2_dirent *ext2dir = (struct ext2_dirent *) &block_buffer[block_offset];
+
+            // The inode number indexes the group descriptors
+            if (!ext2_dirent_valid(ext2, block_buffer, block_offset) || ext2dir->ino > sb->sb.inode_count) {
+                fprintf(stderr, "ext2: bad directory entry in inode %u, block %zu offset %zu\n",
+                        vn->fs_number, block_number, block_offset);
+                free(table);
+                return -EIO;
+            }
+
+            if (ext2dir->ino) {
+                size_t reclen = VFS_DIRENT_PLUS_RECLEN(ext2dir->name_len);
+
+                if (written + reclen > count) {
+                    full = 1;
+                    break;
+                }
+
+                struct dirent_plus *rec = (struct dirent_plus *) ((char *) buf + written);
+
+                rec->dp_dirent.d_ino = ext2dir->ino;
+                memcpy(rec->dp_dirent.d_name, ext2dir->name, ext2dir->name_len);
+                rec->dp_dirent.d_name[ext2dir->name_len] = 0;
+                rec->dp_dirent.d_reclen = reclen;
+                rec->dp_dirent.d_type = ext2_dirent_dtype(ext2, ext2dir);
+                rec->dp_dirent.d_off = block_number * sb->block_size + block_offset + ext2dir->len;
+
+                ents[nents].ino = ext2dir->ino;
+                ents[nents].rec = rec;
+                if ((res = ext2_inode_location(ext2, ext2dir->ino, &ents[nents].block_no, &ents[nents].offset)) < 0) {
+                    free(table);
+                    return res;
+                }
+                ++nents;
+
+                written += reclen;
+            }
+
+            block_offset += ext2dir->len;
+        }
+
+        // Load all the inodes referenced from this block at once
+        if ((res = ext2_plus_fill_stats(ext2, ents, nents, table)) < 0) {
+            free(table);
+            return res;
+        }
+
+        if (full) {
+            fd->pos = block_number * sb->block_size + block_offset;
+            free(table);
+            return written ? (ssize_t) written : -EINVAL;
+        }
+
+        fd->pos = (block_number + 1) * sb->block_size;
+    }
+
+    free(table);
+    return written;
+}
+
 static void ext2_vnode_destroy(vnode_t *vn) {
-    // Release inode struct
-    free(vn->fs_data);
+    struct ext2_inode_info *info = ext2_vnode_info(vn);
+    assert(info);
+
+    ext2_journal_start(vn->fs);
+    if (ext2_inode_info_put(vn->fs, info) < 0) {
+        fprintf(stderr, "ext2: failed to write back inode %u\n", vn->fs_number);
+    }
+    ext2_journal_stop(vn->fs);
 }
 
 static int ext2_vnode_stat(vnode_t *vn, struct stat *st) {
     assert(vn && vn->fs);
-    struct ext2_inode *inode = (struct ext2_inode *) vn->fs_data;
+    struct ext2_inode *inode = ext2_vnode_inode(vn);
     assert(inode);
     struct ext2_extsb *sb = (struct ext2_extsb *) vn->fs->fs_private;
     assert(sb);
 
+    ext2_inode_stat(sb, inode, vn->fs_number, st);
+
+    return 0;
+}
+
+static void ext2_inode_stat(struct ext2_extsb *sb, const struct ext2_inode *inode, uint32_t ino, struct stat *st) {
     st->st_atime = inode->atime;
     st->st_ctime = inode->ctime;
     st->st_mtime = inode->mtime;
@@ -525,41 +1439,55 @@ static int ext2_vnode_stat(vnode_t *vn, struct stat *st) {
     st->st_gid = inode->gid;
     st->st_uid = inode->uid;
     st->st_mode = inode->type_perm;
-    st->st_size = inode->size_lower;
-    st->st_blocks = (inode->size_lower + sb->block_size - 1) / sb->block_size;
+    st->st_size = ext2_inode_size(inode);
+    st->st_blocks = inode->disk_sector_count;
     st->st_blksize = sb->block_size;
     st->st_nlink = 0;
-    st->st_ino = vn->fs_number;
-
-    return 0;
+    st->st_ino = ino;
 }
 
 static int ext2_vnode_chmod(vnode_t *vn, mode_t mode) {
     assert(vn && vn->fs && vn->fs_data);
-    struct ext2_inode *inode = (struct ext2_inode *) vn->fs_data;
+    struct ext2_inode_info *info = ext2_vnode_info(vn);
+    int res;
+
+    ext2_journal_start(vn->fs);
+    pthread_mutex_lock(&info->lock);
 
     // Update only access mode
-    inode->type_perm &= ~0x1FF;
-    inode->type_perm |= mode & 0x1FF;
+    info->inode->type_perm &= ~0x1FF;
+    info->inode->type_perm |= mode & 0x1FF;
 
     // Write the inode back
-    return ext2_write_inode(vn->fs, inode, vn->fs_number);
+    res = ext2_write_inode(vn->fs, info->inode, vn->fs_number);
+
+    pthread_mutex_unlock(&info->lock);
+    ext2_journal_stop(vn->fs);
+    return res;
 }
 
 static int ext2_vnode_chown(vnode_t *vn, uid_t uid, gid_t gid) {
     assert(vn && vn->fs && vn->fs_data);
-    struct ext2_inode *inode = (struct ext2_inode *) vn->fs_data;
+    struct ext2_inode_info *info = ext2_vnode_info(vn);
+    int res;
+
+    ext2_journal_start(vn->fs);
+    pthread_mutex_lock(&info->lock);
 
-    inode->gid = gid;
-    inode->uid = uid;
+    info->inode->gid = gid;
+    info->inode->uid = uid;
 
     // Write the inode back
-    return ext2_write_inode(vn->fs, inode, vn->fs_number);
+    res = ext2_write_inode(vn->fs, info->inode, vn->fs_number);
+
+    pthread_mutex_unlock(&info->lock);
+    ext2_journal_stop(vn->fs);
+    return res;
 }
 
-static int ext2_vnode_unlink(vnode_t *at, vnode_t *vn, const char *name) {
-    struct ext2_inode *inode = vn->fs_data;
-    struct ext2_inode *at_inode = at->fs_data;
+static int ext2_unlink(vnode_t *at, vnode_t *vn, const char *name) {
+    struct ext2_inode *inode = ext2_vnode_inode(vn);
+    struct ext2_inode *at_inode = ext2_vnode_inode(at);
     fs_t *ext2 = vn->fs;
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
     uint32_t ino = vn->fs_number;
@@ -567,68 +1495,73 @@ static int ext2_vnode_unlink(vnode_t *at, vnode_t *vn, const char *name) {
 
     if (vn->type == VN_DIR) {
         // Check if the directory we're unlinking has any entries besides
-        // . and ..
-        // Can tell this just by looking at the first block
-        if (inode->size_lower > sb->block_size) {
-            // Directory size is more than one block - totally
-            // has something inside
-            return -EISDIR;
-        }
+        // . and .. Extent-mapped directories may keep blocks with no
+        // entries, so all of them are looked at
+        size_t dir_blocks = (ext2_dir_size(ext2, inode) + sb->block_size - 1) / sb->block_size;
         char block_buffer[sb->block_size];
-        size_t off = 0;
 
-        if ((res = ext2_read_inode_block(ext2, inode, 0, block_buffer)) < 0) {
-            return res;
-        }
+        for (size_t i = 0; i < dir_blocks; ++i) {
+            size_t off = 0;
 
-        while (off < sb->block_size) {
-            struct ext2_dirent *ent = (struct ext2_dirent *) &block_buffer[off];
-            if (!ent->ino) {
-                break;
-            }
-            if (ent->name_len == 1 && ent->name[0] == '.') {
-                off += ent->len;
-                continue;
+            if ((res = ext2_dir_read_block(ext2, vn, i, block_buffer)) < 0) {
+                return res;
             }
-            if (ent->name_len == 2 && ent->name[1] == '.' && ent->name[0] == '.') {
+
+            while (off < sb->block_size) {
+                struct ext2_dirent *ent = (struct ext2_dirent *) &block_buffer[off];
+                if (!ent->len) {
+                    break;
+                }
                 off += ent->len;
-                continue;
-            }
 
-            return -EISDIR;
+                if (!ent->ino) {
+                    continue;
+                }
+                if (ent->name_len == 1 && ent->name[0] == '.') {
+                    continue;
+                }
+                if (ent->name_len == 2 && ent->name[1] == '.' && ent->name[0] == '.') {
+                    continue;
+                }
+
+                return -EISDIR;
+            }
         }
     }
 
-    // Free blocks used by the inode - truncate the file to zero
-    size_t nblocks = (inode->size_lower + sb->block_size - 1) / sb->block_size;
+    // The entry goes first: failing past it leaves an inode nothing
+    // links to, which fsck can reclaim, rather than an entry to a freed one
+    if ((res = ext2_dir_remove_inode(ext2, at, name, ino)) < 0) {
+        return res;
+    }
 
-    inode->size_lower = nblocks * sb->block_size;
-    for (ssize_t i = nblocks - 1; i >= 0; --i) {
-        inode->size_lower -= sb->block_size;
-        if ((res = ext2_free_inode_block(ext2, inode, ino, i)) < 0) {
+    // The parent loses the link of ".."
+    if (vn->type == VN_DIR) {
+        --at_inode->hard_link_count;
+        if ((res = ext2_write_inode(ext2, at_inode, at->fs_number)) < 0) {
             return res;
         }
     }
 
-    // inode->size_lower is now 0
-    assert(inode->size_lower == 0);
+    // The blocks and the inode itself are freed in the background once
+    // the inode is not used anymore, open files can still be read and
+    // written until then
+    return ext2_orphan_add(ext2, ext2_vnode_info(vn));
+}
 
-    // Free the inode itself
-    if ((res = ext2_free_inode(ext2, ino)) < 0) {
-        return res;
-    }
+static int ext2_vnode_unlink(vnode_t *at, vnode_t *vn, const char *name) {
+    int res;
 
-    // Now remove the entry from directory
-    if ((res = ext2_dir_remove_inode(ext2, at, name, ino)) < 0) {
-        return res;
-    }
+    ext2_journal_start(at->fs);
+    res = ext2_unlink(at, vn, name);
+    ext2_journal_stop(at->fs);
 
-    return 0;
+    return res;
 }
 
 static int ext2_vnode_access(vnode_t *vn, uid_t *uid, gid_t *gid, mode_t *mode) {
     assert(vn && vn->fs_data);
-    struct ext2_inode *inode = vn->fs_data;
+    struct ext2_inode *inode = ext2_vnode_inode(vn);
 
     *uid = inode->uid;
     *gid = inode->gid;
@@ -639,7 +1572,7 @@ static int ext2_vnode_access(vnode_t *vn, uid_t *uid, gid_t *gid, mode_t *mode)
 
 static int ext2_vnode_readlink(vnode_t *vn, char *dst) {
     assert(vn && vn->fs_data);
-    struct ext2_inode *inode = vn->fs_data;
+    struct ext2_inode *inode = ext2_vnode_inode(vn);
     fs_t *ext2 = vn->fs;
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
 
@@ -662,17 +1595,17 @@ static int ext2_vnode_readlink(vnode_t *vn, char *dst) {
     return 0;
 }
 
-static int ext2_vnode_symlink(vnode_t *at, struct vfs_ioctx *ctx, const char *name, const char *dst) {
+static int ext2_symlink(vnode_t *at, struct vfs_ioctx *ctx, const char *name, const char *dst) {
     assert(at && at->fs && at->fs_data);
-    struct ext2_inode *inode = at->fs_data;
+    struct ext2_inode *inode = ext2_vnode_inode(at);
     fs_t *ext2 = at->fs;
     struct ext2_extsb *sb = (struct ext2_extsb *) ext2->fs_private;
 
     uint32_t new_ino;
     int res;
 
-    // Allocate new inode number
-    if ((res = ext2_alloc_inode(ext2, &new_ino)) != 0) {
+    // Allocate new inode number near the parent
+    if ((res = ext2_alloc_inode(ext2, at->fs_number, VN_LNK, &new_ino)) != 0) {
         printf("Failed to allocate inode\n");
         return res;
     }
@@ -681,9 +1614,10 @@ static int ext2_vnode_symlink(vnode_t *at, struct vfs_ioctx *ctx, const char *na
 
     // Create an inode struct in memory
     struct ext2_inode *ent_inode = (struct ext2_inode *) malloc(sb->inode_struct_size);
+    memset(ent_inode, 0, sb->inode_struct_size);
 
     // Now create an entry in parents dirent list
-    if ((res = ext2_dir_add_inode(ext2, at, name, new_ino)) < 0) {
+    if ((res = ext2_dir_add_inode(ext2, at, name, new_ino, VN_LNK)) < 0) {
         return res;
     }
 
@@ -730,6 +1664,7 @@ static int ext2_vnode_symlink(vnode_t *at, struct vfs_ioctx *ctx, const char *na
         ent_inode->l3_indirect_block = 0;
 
         ent_inode->direct_blocks[0] = block_no;
+        ent_inode->disk_sector_count = sb->block_size / 512;
     }
 
     ent_inode->uid = ctx->uid;
@@ -743,3 +1678,13 @@ static int ext2_vnode_symlink(vnode_t *at, struct vfs_ioctx *ctx, const char *na
 
     return 0;
 }
+
+static int ext2_vnode_symlink(vnode_t *at, struct vfs_ioctx *ctx, const char *name, const char *dst) {
+    int res;
+
+    ext2_journal_start(at->fs);
+    res = ext2_symlink(at, ctx, name, dst);
+    ext2_journal_stop(at->fs);
+
+    return res;
+}
@@ -2,9 +2,11 @@
 #include <assert.h>
 #include <stdio.h>
 #include "vfs.h"
+#include "walk.h"
 #include "ext2.h"
 #include "testblk.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
@@ -76,7 +78,7 @@ static void dumpstat(char *buf, const struct stat *st) {
         break;
     }
 
-    sprintf(buf, "%c%c%c%c%c%c%c%c%c%c % 5d % 5d %u %u", t,
+    sprintf(buf, "%c%c%c%c%c%c%c%c%c%c % 5d % 5d %llu %u", t,
         (st->st_mode & S_IRUSR) ? 'r' : '-',
         (st->st_mode & S_IWUSR) ? 'w' : '-',
         (st->st_mode & S_IXUSR) ? 'x' : '-',
@@ -88,7 +90,7 @@ static void dumpstat(char *buf, const struct stat *st) {
         (st->st_mode & S_IXOTH) ? 'x' : '-',
         st->st_uid,
         st->st_gid,
-        st->st_size,
+        (unsigned long long) st->st_size,
         st->st_ino);
 }
 
@@ -128,55 +130,77 @@ static int shell_ls(const char *arg) {
         return res;
     }
 
-    struct dirent *ent;
-    while ((ent = vfs_readdir(&ioctx, &fd))) {
-        printf("dirent %s\n", ent->d_name);
+    char buf[4096];
+    ssize_t nr;
+    while ((nr = vfs_getdents(&ioctx, &fd, buf, sizeof(buf))) > 0) {
+        for (size_t off = 0; off < (size_t) nr;) {
+            struct dirent *ent = (struct dirent *) &buf[off];
+            printf("dirent %s%s\n", ent->d_name, ent->d_type == DT_DIR ? "/" : "");
+            off += ent->d_reclen;
+        }
     }
 
     vfs_close(&ioctx, &fd);
 
-    return res;
+    return nr < 0 ? nr : 0;
 }
 
 static int shell_ls_detail(const char *arg) {
     struct ofile fd;
-    struct dirent *ent;
-    struct stat st;
+    char buf[8192];
     char fullp[512];
     char linkp[1024];
+    ssize_t nr;
     int res;
 
     if ((res = vfs_open(&ioctx, &fd, arg, 0, O_DIRECTORY | O_RDONLY)) < 0) {
         return res;
     }
 
-    while ((ent = vfs_readdir(&ioctx, &fd))) {
-        if (ent->d_name[0] == '.') {
-            continue;
-        }
+    while ((nr = vfs_readdirplus(&ioctx, &fd, buf, sizeof(buf))) > 0) {
+        for (size_t off = 0; off < (size_t) nr;) {
+            struct dirent_plus *ent = (struct dirent_plus *) &buf[off];
+            off += ent->dp_dirent.d_reclen;
 
-        if ((res = vfs_statat(&ioctx, fd.vnode, ent->d_name, &st)) < 0) {
-            return res;
-        }
+            if (ent->dp_dirent.d_name[0] == '.') {
+                continue;
+            }
 
-        dumpstat(fullp, &st);
+            dumpstat(fullp, &ent->dp_stat);
 
-        if ((st.st_mode & S_IFMT) == S_IFLNK) {
-            // Try to read the link
-            if ((res = vfs_readlinkat(&ioctx, fd.vnode, ent->d_name, linkp)) < 0) {
-                return res;
-            }
+            if ((ent->dp_stat.st_mode & S_IFMT) == S_IFLNK) {
+                // Try to read the link
+                if ((res = vfs_readlinkat(&ioctx, fd.vnode, ent->dp_dirent.d_name, linkp)) < 0) {
+                    vfs_close(&ioctx, &fd);
+                    return res;
+                }
 
-            printf("%s\t%s -> %s\n", fullp, ent->d_name, linkp);
-        } else {
-            printf("%s\t%s\n", fullp, ent->d_name);
+                printf("%s\t%s -> %s\n", fullp, ent->dp_dirent.d_name, linkp);
+            } else {
+                printf("%s\t%s\n", fullp, ent->dp_dirent.d_name);
+            }
         }
     }
 
     vfs_close(&ioctx, &fd);
+    return nr < 0 ? nr : 0;
+}
+
+// The walk argument is not used, vfs_walk_fn dictates the signature
+static int shell_find_pre(const struct vfs_walk_ent *ent, void *arg) {
+    (void) arg;
+    printf("%c %s\n", ent->type == DT_DIR ? 'd' : (ent->type == DT_LNK ? 'l' : '-'), ent->path);
     return 0;
 }
 
+static int shell_find(const char *arg) {
+    return vfs_walk(&ioctx, *arg ? arg : ".", 0, 1, shell_find_pre, NULL, NULL);
+}
+
+static int shell_pfind(const char *arg) {
+    return vfs_walk(&ioctx, *arg ? arg : ".", VFS_WALK_PARALLEL, 4, shell_find_pre, NULL, NULL);
+}
+
 static int shell_cat(const char *arg) {
     struct ofile fd;
     int res;
@@ -187,11 +211,22 @@ static int shell_cat(const char *arg) {
         return res;
     }
 
-    while ((res = vfs_read(&ioctx, &fd, buf, sizeof(buf))) > 0) {
-        fwrite(buf, 1, res, stdout);
+    struct vfs_view view;
+
+    // Write out the cached data directly when possible
+    while ((res = vfs_view(&ioctx, &fd, SIZE_MAX, &view)) > 0) {
+        fwrite(view.data, 1, view.length, stdout);
+        vfs_view_put(&ioctx, &fd, &view);
         bread += res;
     }
 
+    if (res == -EOPNOTSUPP) {
+        while ((res = vfs_read(&ioctx, &fd, buf, sizeof(buf))) > 0) {
+            fwrite(buf, 1, res, stdout);
+            bread += res;
+        }
+    }
+
     vfs_close(&ioctx, &fd);
 
     printf("\n%zuB total\n", bread);
@@ -242,6 +277,62 @@ static int shell_hello(const char *arg) {
     return 0;
 }
 
+static int shell_poke(const char *arg) {
+    struct ofile fd;
+    int res;
+    char linebuf[512];
+    long offset;
+
+    printf("offset = ");
+    if (!fgets(linebuf, sizeof(linebuf), stdin)) {
+        return -1;
+    }
+    offset = strtol(linebuf, NULL, 0);
+
+    printf("= ");
+    if (!fgets(linebuf, sizeof(linebuf), stdin)) {
+        return -1;
+    }
+
+    if ((res = vfs_open(&ioctx, &fd, arg, 0644, O_CREAT | O_WRONLY)) < 0) {
+        return res;
+    }
+
+    // Writing past the end of file leaves a hole
+    if ((res = vfs_lseek(&ioctx, &fd, offset, SEEK_SET)) >= 0) {
+        res = vfs_write(&ioctx, &fd, linebuf, strlen(linebuf));
+    }
+
+    vfs_close(&ioctx, &fd);
+
+    return res < 0 ? res : 0;
+}
+
+static int shell_falloc(const char *arg) {
+    struct ofile fd;
+    int res;
+    char linebuf[64];
+    size_t offset, length;
+
+    printf("offset length = ");
+    if (!fgets(linebuf, sizeof(linebuf), stdin)) {
+        return -1;
+    }
+    if (sscanf(linebuf, "%zi %zi", &offset, &length) != 2) {
+        return -EINVAL;
+    }
+
+    if ((res = vfs_open(&ioctx, &fd, arg, 0644, O_CREAT | O_WRONLY)) < 0) {
+        return res;
+    }
+
+    res = vfs_fallocate(&ioctx, &fd, 0, offset, length);
+
+    vfs_close(&ioctx, &fd);
+
+    return res;
+}
+
 static int shell_trunc(const char *arg) {
     struct ofile fd;
     int res;
@@ -354,6 +445,60 @@ static int shell_me(const char *arg) {
     return 0;
 }
 
+static int shell_cp(const char *arg) {
+    struct ofile src, dst;
+    char buf[1024];
+    size_t total = 0;
+    ssize_t res;
+
+    printf("dst = ");
+    if (!fgets(buf, sizeof(buf), stdin)) {
+        return -1;
+    }
+
+    size_t l = strlen(buf);
+    while (l && (!buf[l] || buf[l] == '\n')) {
+        buf[l--] = 0;
+    }
+
+    if ((res = vfs_open(&ioctx, &src, arg, 0, O_RDONLY)) < 0) {
+        return res;
+    }
+    if ((res = vfs_open(&ioctx, &dst, buf, 0644, O_CREAT | O_TRUNC | O_WRONLY)) < 0) {
+        vfs_close(&ioctx, &src);
+        return res;
+    }
+
+    while ((res = vfs_copy_file_range(&ioctx, &src, NULL, &dst, NULL, SIZE_MAX, 0)) > 0) {
+        total += res;
+    }
+
+    vfs_close(&ioctx, &dst);
+    vfs_close(&ioctx, &src);
+
+    printf("%zuB copied\n", total);
+    return res;
+}
+
+// sync: everything, sync <path>: just the file
+static int shell_sync(const char *arg) {
+    struct ofile fd;
+    int res;
+
+    if (!*arg) {
+        return vfs_sync(&ioctx);
+    }
+
+    if ((res = vfs_open(&ioctx, &fd, arg, 0, O_RDONLY)) < 0) {
+        return res;
+    }
+
+    res = vfs_fsync(&ioctx, &fd);
+    vfs_close(&ioctx, &fd);
+
+    return res;
+}
+
 static int shell_df(const char *arg) {
     struct statvfs st;
     int res;
@@ -428,6 +573,8 @@ static struct {
 } shell_cmds[] = {
     { "stat", shell_stat },
     { "tree", shell_tree },
+    { "find", shell_find },
+    { "pfind", shell_pfind },
     { "cat", shell_cat },
     { "ll", shell_ls_detail },
     { "ls", shell_ls },
@@ -435,6 +582,8 @@ static struct {
     { "touch", shell_touch },
     { "hello", shell_hello },
     { "trunc", shell_trunc },
+    { "poke", shell_poke },
+    { "falloc", shell_falloc },
     { "unlink", shell_unlink },
     { "mkdir", shell_mkdir },
     { "chmod", shell_chmod },
@@ -445,6 +594,8 @@ static struct {
     { "readlink", shell_readlink },
     { "symlink", shell_symlink },
     { "df", shell_df },
+    { "sync", shell_sync },
+    { "cp", shell_cp },
     { "me", shell_me },
     { "cd", shell_cd },
 };
@@ -500,8 +651,8 @@ found:
 }
 
 int main(int argc, const char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <image-file>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <image-file> [mount-options]\n", argv[0]);
         return -1;
     }
 
@@ -521,7 +672,7 @@ int main(int argc, const char **argv) {
     testblk_init(argv[1]);
 
     // Mount ext2 as rootfs
-    if ((res = vfs_mount(&ioctx, "/", &testblk_dev, "ext2", NULL)) != 0) {
+    if ((res = vfs_mount(&ioctx, "/", &testblk_dev, "ext2", argc == 3 ? argv[2] : NULL)) != 0) {
         fprintf(stderr, "Failed to mount rootfs\n");
         return -1;
     }
@@ -0,0 +1,278 @@
+#include "rbtree.h"
+
+static void rb_rotate_left(rb_tree_t *t, struct rb_node *x) {
+    struct rb_node *y = x->right;
+
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    y->parent = x->parent;
+    if (!x->parent) {
+        t->root = y;
+    } else if (x == x->parent->left) {
+        x->parent->left = y;
+    } else {
+        x->parent->right = y;
+    }
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(rb_tree_t *t, struct rb_node *x) {
+    struct rb_node *y = x->left;
+
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    y->parent = x->parent;
+    if (!x->parent) {
+        t->root = y;
+    } else if (x == x->parent->right) {
+        x->parent->right = y;
+    } else {
+        x->parent->left = y;
+    }
+    y->right = x;
+    x->parent = y;
+}
+
+void rb_link(rb_tree_t *t, struct rb_node *node, struct rb_node *parent, int left) {
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = 1;
+
+    if (!parent) {
+        t->root = node;
+    } else if (left) {
+        parent->left = node;
+    } else {
+        parent->right = node;
+    }
+
+    // A red node may not have a red parent
+    while ((parent = node->parent) && parent->red) {
+        struct rb_node *gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            struct rb_node *uncle = gparent->right;
+
+            if (uncle && uncle->red) {
+                parent->red = 0;
+                uncle->red = 0;
+                gparent->red = 1;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_rotate_left(t, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = 0;
+            gparent->red = 1;
+            rb_rotate_right(t, gparent);
+        } else {
+            struct rb_node *uncle = gparent->left;
+
+            if (uncle && uncle->red) {
+                parent->red = 0;
+                uncle->red = 0;
+                gparent->red = 1;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_rotate_right(t, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = 0;
+            gparent->red = 1;
+            rb_rotate_left(t, gparent);
+        }
+    }
+
+    t->root->red = 0;
+}
+
+void rb_insert(rb_tree_t *t, struct rb_node *node, int (*cmp) (const struct rb_node *, const struct rb_node *)) {
+    struct rb_node *parent = NULL;
+    struct rb_node **it = &t->root;
+    int left = 0;
+
+    while (*it) {
+        parent = *it;
+        left = cmp(node, parent) < 0;
+        it = left ? &parent->left : &parent->right;
+    }
+
+    rb_link(t, node, parent, left);
+}
+
+// Put v where u was, the caller deals with u's children
+static void rb_transplant(rb_tree_t *t, struct rb_node *u, struct rb_node *v) {
+    if (!u->parent) {
+        t->root = v;
+    } else if (u == u->parent->left) {
+        u->parent->left = v;
+    } else {
+        u->parent->right = v;
+    }
+    if (v) {
+        v->parent = u->parent;
+    }
+}
+
+void rb_erase(rb_tree_t *t, struct rb_node *node) {
+    struct rb_node *child, *parent;
+    int red = node->red;
+
+    if (!node->left) {
+        child = node->right;
+        parent = node->parent;
+        rb_transplant(t, node, child);
+    } else if (!node->right) {
+        child = node->left;
+        parent = node->parent;
+        rb_transplant(t, node, child);
+    } else {
+        // Replace the node with its successor
+        struct rb_node *next = node->right;
+
+        while (next->left) {
+            next = next->left;
+        }
+        red = next->red;
+        child = next->right;
+
+        if (next->parent == node) {
+            parent = next;
+        } else {
+            parent = next->parent;
+            rb_transplant(t, next, child);
+            next->right = node->right;
+            next->right->parent = next;
+        }
+        rb_transplant(t, node, next);
+        next->left = node->left;
+        next->left->parent = next;
+        next->red = node->red;
+    }
+
+    if (red) {
+        return;
+    }
+
+    // A black node was removed: the paths through child are one black
+    // node short
+    while (child != t->root && (!child || !child->red)) {
+        if (child == parent->left) {
+            struct rb_node *sibling = parent->right;
+
+            if (sibling->red) {
+                sibling->red = 0;
+                parent->red = 1;
+                rb_rotate_left(t, parent);
+                sibling = parent->right;
+            }
+            if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red)) {
+                sibling->red = 1;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!sibling->right || !sibling->right->red) {
+                sibling->left->red = 0;
+                sibling->red = 1;
+                rb_rotate_right(t, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = 0;
+            sibling->right->red = 0;
+            rb_rotate_left(t, parent);
+        } else {
+            struct rb_node *sibling = parent->left;
+
+            if (sibling->red) {
+                sibling->red = 0;
+                parent->red = 1;
+                rb_rotate_right(t, parent);
+                sibling = parent->left;
+            }
+            if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red)) {
+                sibling->red = 1;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!sibling->left || !sibling->left->red) {
+                sibling->right->red = 0;
+                sibling->red = 1;
+                rb_rotate_left(t, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = 0;
+            sibling->left->red = 0;
+            rb_rotate_right(t, parent);
+        }
+        child = t->root;
+        break;
+    }
+
+    if (child) {
+        child->red = 0;
+    }
+}
+
+struct rb_node *rb_first(const rb_tree_t *t) {
+    struct rb_node *node = t->root;
+
+    while (node && node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+struct rb_node *rb_last(const rb_tree_t *t) {
+    struct rb_node *node = t->root;
+
+    while (node && node->right) {
+        node = node->right;
+    }
+    return node;
+}
+
+struct rb_node *rb_next(const struct rb_node *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return (struct rb_node *) node;
+    }
+
+    while (node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node) {
+    if (node->left) {
+        node = node->left;
+        while (node->right) {
+            node = node->right;
+        }
+        return (struct rb_node *) node;
+    }
+
+    while (node->parent && node == node->parent->left) {
+        node = node->parent;
+    }
+    return node->parent;
+}
@@ -2,6 +2,8 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
 
 static void blk_dump(const char *bytes, size_t siz) {
     size_t j = 0;
@@ -26,26 +28,28 @@ static void blk_dump(const char *bytes, size_t siz) {
     printf("-----\n");
 }
 
-static ssize_t testblk_dev_read(struct blkdev *blk, void *buf, size_t off, size_t count) {
-    if (fseek(blk->dev_data, off, SEEK_SET) != 0) {
-        return -1;
-    }
-    ssize_t res = fread(buf, 1, count, blk->dev_data);
+// Positional I/O is used so that the device can be accessed
+// from several threads at once
+static ssize_t testblk_dev_read(struct blkdev *blk, void *buf, uint64_t off, size_t count) {
+    ssize_t res = pread(fileno(blk->dev_data), buf, count, off);
     return res;
 }
 
-static ssize_t testblk_dev_write(struct blkdev *blk, const void *buf, size_t off, size_t count) {
-    if (fseek(blk->dev_data, off, SEEK_SET) != 0) {
-        return -1;
-    }
-    ssize_t res = fwrite(buf, 1, count, blk->dev_data);
-    fflush(blk->dev_data);
-    if (res == 0) {
+static ssize_t testblk_dev_write(struct blkdev *blk, const void *buf, uint64_t off, size_t count) {
+    ssize_t res = pwrite(fileno(blk->dev_data), buf, count, off);
+    if (res <= 0) {
         printf("NO DATA WRITTEN\n");
     }
     return res;
 }
 
+static int testblk_dev_flush(struct blkdev *blk) {
+    if (fdatasync(fileno(blk->dev_data)) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
 static void testblk_dev_destroy(struct blkdev *blk) {
     printf("Closing device\n");
     fclose(blk->dev_data);
@@ -56,6 +60,7 @@ struct blkdev testblk_dev = {
 
     .read = testblk_dev_read,
     .write = testblk_dev_write,
+    .flush = testblk_dev_flush,
     .destroy = testblk_dev_destroy
 };
 
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <stdio.h>
 
@@ -541,9 +542,14 @@ int vfs_umount(struct vfs_ioctx *ctx, const char *target) {
         // Umounting the cwd
         ctx->cwd_vnode = NULL;
     }
+    fs_t *fs = at_vnode->fs;
     at_vnode->refcount = 0;
     vnode_free(at_vnode);
 
+    if (fs->cls->umount) {
+        return fs->cls->umount(fs);
+    }
+
     return 0;
 }
 
@@ -757,8 +763,9 @@ int vfs_open(struct vfs_ioctx *ctx, struct ofile *of, const char *path, int mode
     return 0;
 }
 
+// With O_APPEND, the filesystem's write() takes the position from the
+// file size at the time of each write
 int vfs_open_node(struct vfs_ioctx *ctx, struct ofile *of, vnode_t *vn, int opt) {
-    // TODO: O_APPEND
     assert(vn && vn->op && of);
     int res;
 
@@ -788,6 +795,8 @@ int vfs_open_node(struct vfs_ioctx *ctx, struct ofile *of, vnode_t *vn, int opt)
         of->flags = opt;
         of->vnode = vn;
         of->pos = 0;
+        of->dirent_off = 0;
+        of->dirent_len = 0;
 
         return res;
     }
@@ -813,14 +822,6 @@ int vfs_open_node(struct vfs_ioctx *ctx, struct ofile *of, vnode_t *vn, int opt)
     of->flags = opt;
     of->pos = 0;
 
-    if (opt & O_APPEND) {
-        // TODO: rewrite open() to accept struct ofile *
-        // instead of vnode so that open() function of the
-        // vnode can properly set of->pos
-        fprintf(stderr, "O_APPEND not yet implemented\n");
-        return -EINVAL;
-    }
-
     // Check if file has to be truncated before opening it
     if (opt & O_TRUNC) {
         if (!vn->op->truncate) {
@@ -895,7 +896,7 @@ int vfs_stat(struct vfs_ioctx *ctx, const char *path, struct stat *st) {
     return res;
 }
 
-ssize_t vfs_read(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t count) {
+static int vfs_read_check(struct vfs_ioctx *ctx, struct ofile *fd) {
     assert(fd);
     vnode_t *vn = fd->vnode;
     assert(vn && vn->op);
@@ -910,6 +911,52 @@ ssize_t vfs_read(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t coun
     if ((fd->flags & O_ACCMODE) == O_WRONLY) {
         return -EINVAL;
     }
+
+    return 0;
+}
+
+static int vfs_write_check(struct vfs_ioctx *ctx, struct ofile *fd) {
+    assert(fd);
+    vnode_t *vn = fd->vnode;
+    assert(vn && vn->op);
+    // XXX: should these be checked on every write?
+    if (vfs_vnode_access(ctx, vn, W_OK) < 0) {
+        return -EACCES;
+    }
+
+    if (fd->flags & O_DIRECTORY) {
+        return -EISDIR;
+    }
+    if ((fd->flags & O_ACCMODE) == O_RDONLY) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int vfs_iov_check(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+
+    if (iovcnt < 0 || iovcnt > VFS_IOV_MAX) {
+        return -EINVAL;
+    }
+    for (int i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len > SSIZE_MAX - total) {
+            return -EINVAL;
+        }
+        total += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+ssize_t vfs_read(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t count) {
+    vnode_t *vn = fd->vnode;
+    int res;
+
+    if ((res = vfs_read_check(ctx, fd)) < 0) {
+        return res;
+    }
     if (vn->op->read == NULL) {
         return -EINVAL;
     }
@@ -923,22 +970,52 @@ ssize_t vfs_read(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t coun
     return nr;
 }
 
-ssize_t vfs_write(struct vfs_ioctx *ctx, struct ofile *fd, const void *buf, size_t count) {
-    assert(fd);
+// Like vfs_read(), but instead of copying the data, pins it in the
+// filesystem's cache and returns a view of it. May return less than
+// count even before EOF (up to the end of the cached block). The view
+// has to be released with vfs_view_put() before the file is closed
+ssize_t vfs_view(struct vfs_ioctx *ctx, struct ofile *fd, size_t count, struct vfs_view *view) {
+    assert(fd && view);
     vnode_t *vn = fd->vnode;
     assert(vn && vn->op);
-
-    // XXX: should these be checked on every write?
-    if (vfs_vnode_access(ctx, vn, W_OK) < 0) {
+    if (vfs_vnode_access(ctx, vn, R_OK) < 0) {
         return -EACCES;
     }
 
     if (fd->flags & O_DIRECTORY) {
         return -EISDIR;
     }
-    if ((fd->flags & O_ACCMODE) == O_RDONLY) {
+    if ((fd->flags & O_ACCMODE) == O_WRONLY) {
         return -EINVAL;
     }
+    if (vn->op->view == NULL) {
+        return -EOPNOTSUPP;
+    }
+
+    ssize_t nr = vn->op->view(fd, count, view);
+
+    if (nr > 0) {
+        fd->pos += nr;
+    }
+
+    return nr;
+}
+
+void vfs_view_put(struct vfs_ioctx *ctx, struct ofile *fd, struct vfs_view *view) {
+    assert(fd && view);
+    vnode_t *vn = fd->vnode;
+    assert(vn && vn->op && vn->op->view_put);
+
+    vn->op->view_put(fd, view);
+}
+
+ssize_t vfs_write(struct vfs_ioctx *ctx, struct ofile *fd, const void *buf, size_t count) {
+    vnode_t *vn = fd->vnode;
+    int res;
+
+    if ((res = vfs_write_check(ctx, fd)) < 0) {
+        return res;
+    }
     if (vn->op->write == NULL) {
         return -EINVAL;
     }
@@ -946,8 +1023,172 @@ ssize_t vfs_write(struct vfs_ioctx *ctx, struct ofile *fd, const void *buf, size
     return vn->op->write(fd, buf, count);
 }
 
-int vfs_truncate(struct vfs_ioctx *ctx, struct ofile *of, size_t length) {
+// Positional reads and writes neither use nor change fd->pos, so
+// threads sharing a file don't need to serialize. The exception is
+// a write to an O_APPEND file: it appends, as write() does
+ssize_t vfs_pread(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t count, off_t offset) {
+    struct iovec iov = { buf, count };
+    vnode_t *vn = fd->vnode;
+    int res;
+
+    if ((res = vfs_read_check(ctx, fd)) < 0) {
+        return res;
+    }
+    if (offset < 0) {
+        return -EINVAL;
+    }
+    if (vn->op->preadv == NULL) {
+        return -EOPNOTSUPP;
+    }
+
+    return vn->op->preadv(fd, &iov, 1, offset);
+}
+
+ssize_t vfs_pwrite(struct vfs_ioctx *ctx, struct ofile *fd, const void *buf, size_t count, off_t offset) {
+    struct iovec iov = { (void *) buf, count };
+    vnode_t *vn = fd->vnode;
+    int res;
+
+    if ((res = vfs_write_check(ctx, fd)) < 0) {
+        return res;
+    }
+    if (offset < 0) {
+        return -EINVAL;
+    }
+    if (vn->op->pwritev == NULL) {
+        return -EOPNOTSUPP;
+    }
+
+    return vn->op->pwritev(fd, &iov, 1, offset);
+}
+
+// Scatter the data at fd->pos over the buffers. Filesystems without
+// vectored I/O get one read() per buffer
+ssize_t vfs_readv(struct vfs_ioctx *ctx, struct ofile *fd, const struct iovec *iov, int iovcnt) {
+    vnode_t *vn = fd->vnode;
+    ssize_t res;
+
+    if ((res = vfs_read_check(ctx, fd)) < 0) {
+        return res;
+    }
+    if ((res = vfs_iov_check(iov, iovcnt)) < 0) {
+        return res;
+    }
+
+    if (vn->op->preadv) {
+        if ((res = vn->op->preadv(fd, iov, iovcnt, fd->pos)) > 0) {
+            fd->pos += res;
+        }
+        return res;
+    }
+
+    if (vn->op->read == NULL) {
+        return -EINVAL;
+    }
+
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if ((res = vn->op->read(fd, iov[i].iov_base, iov[i].iov_len)) <= 0) {
+            break;
+        }
+        fd->pos += res;
+        done += res;
+        if ((size_t) res < iov[i].iov_len) {
+            break;
+        }
+    }
+
+    return done ? (ssize_t) done : res;
+}
+
+// Gather the buffers and write them at fd->pos as one write
+ssize_t vfs_writev(struct vfs_ioctx *ctx, struct ofile *fd, const struct iovec *iov, int iovcnt) {
+    vnode_t *vn = fd->vnode;
+    ssize_t res;
+
+    if ((res = vfs_write_check(ctx, fd)) < 0) {
+        return res;
+    }
+    if ((res = vfs_iov_check(iov, iovcnt)) < 0) {
+        return res;
+    }
+
+    if (vn->op->writev) {
+        return vn->op->writev(fd, iov, iovcnt);
+    }
+    // Where an append ends up is only known to the filesystem
+    if (vn->op->pwritev && !(fd->flags & O_APPEND)) {
+        if ((res = vn->op->pwritev(fd, iov, iovcnt, fd->pos)) > 0) {
+            fd->pos += res;
+        }
+        return res;
+    }
+
+    if (vn->op->write == NULL) {
+        return -EINVAL;
+    }
+
+    // Each write() advances fd->pos by itself
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if ((res = vn->op->write(fd, iov[i].iov_base, iov[i].iov_len)) <= 0) {
+            break;
+        }
+        done += res;
+        if ((size_t) res < iov[i].iov_len) {
+            break;
+        }
+    }
+
+    return done ? (ssize_t) done : res;
+}
+
+off_t vfs_lseek(struct vfs_ioctx *ctx, struct ofile *fd, off_t offset, int whence) {
+    assert(fd);
+    vnode_t *vn = fd->vnode;
+    assert(vn && vn->op);
+    struct stat st;
+    off_t base;
+    int res;
+
+    if (fd->flags & O_DIRECTORY) {
+        return -EISDIR;
+    }
+
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = fd->pos;
+        break;
+    case SEEK_END:
+        if (!vn->op->stat) {
+            return -EINVAL;
+        }
+        if ((res = vn->op->stat(vn, &st)) < 0) {
+            return res;
+        }
+        base = st.st_size;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    // Seeking past the end is fine, a write there leaves a hole
+    if (offset < -base) {
+        return -EINVAL;
+    }
+
+    fd->pos = base + offset;
+    return fd->pos;
+}
+
+int vfs_truncate(struct vfs_ioctx *ctx, struct ofile *of, off_t length) {
     assert(of);
+    if (length < 0) {
+        return -EINVAL;
+    }
     if ((of->flags & O_ACCMODE) == O_RDONLY) {
         return -EINVAL;
     }
@@ -968,6 +1209,179 @@ int vfs_truncate(struct vfs_ioctx *ctx, struct ofile *of, size_t length) {
     return vn->op->truncate(of, length);
 }
 
+int vfs_fallocate(struct vfs_ioctx *ctx, struct ofile *of, int mode, off_t offset, off_t length) {
+    assert(of);
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if ((of->flags & O_ACCMODE) == O_RDONLY) {
+        return -EINVAL;
+    }
+    if ((of->flags & O_DIRECTORY)) {
+        return -EISDIR;
+    }
+    if (mode & ~VFS_FALLOC_KEEP_SIZE) {
+        return -EINVAL;
+    }
+    vnode_t *vn = of->vnode;
+    assert(vn && vn->op);
+    if (vfs_vnode_access(ctx, vn, W_OK) < 0) {
+        return -EACCES;
+    }
+
+    if (!vn->op->fallocate) {
+        return -EOPNOTSUPP;
+    }
+
+    return vn->op->fallocate(of, mode, offset, length);
+}
+
+// Copy through a buffer when the filesystems can't do it themselves
+static ssize_t vfs_copy_bounce(struct ofile *src, uint64_t src_off, struct ofile *dst, uint64_t dst_off, size_t count) {
+    vnode_t *src_vn = src->vnode, *dst_vn = dst->vnode;
+    size_t bufsize = count < VFS_COPY_BUFSIZE ? count : VFS_COPY_BUFSIZE;
+    struct iovec iov;
+    size_t done = 0;
+    ssize_t res = 0;
+
+    if (!src_vn->op->preadv || !dst_vn->op->pwritev) {
+        return -EOPNOTSUPP;
+    }
+    if (!(iov.iov_base = malloc(bufsize))) {
+        return -ENOMEM;
+    }
+
+    while (done < count) {
+        iov.iov_len = count - done < bufsize ? count - done : bufsize;
+
+        if ((res = src_vn->op->preadv(src, &iov, 1, src_off + done)) <= 0) {
+            break;
+        }
+        iov.iov_len = res;
+        if ((res = dst_vn->op->pwritev(dst, &iov, 1, dst_off + done)) <= 0) {
+            break;
+        }
+        done += res;
+        if ((size_t) res < iov.iov_len) {
+            break;
+        }
+    }
+
+    free(iov.iov_base);
+    return done ? (ssize_t) done : res;
+}
+
+// Copy data between files without passing it through the caller.
+// NULL offsets mean fd->pos of the file, which is advanced then.
+// Returns less than count at the end of src
+ssize_t vfs_copy_file_range(struct vfs_ioctx *ctx, struct ofile *src, off_t *src_off,
+                            struct ofile *dst, off_t *dst_off, size_t count, int flags) {
+    vnode_t *src_vn = src->vnode, *dst_vn = dst->vnode;
+    uint64_t src_pos, dst_pos;
+    ssize_t res;
+
+    if ((res = vfs_read_check(ctx, src)) < 0 || (res = vfs_write_check(ctx, dst)) < 0) {
+        return res;
+    }
+    if (flags) {
+        return -EINVAL;
+    }
+    if (dst->flags & O_APPEND) {
+        return -EBADF;
+    }
+    if ((src_off && *src_off < 0) || (dst_off && *dst_off < 0)) {
+        return -EINVAL;
+    }
+
+    src_pos = src_off ? (uint64_t) *src_off : src->pos;
+    dst_pos = dst_off ? (uint64_t) *dst_off : dst->pos;
+
+    if (count > SSIZE_MAX) {
+        count = SSIZE_MAX;
+    }
+    if (src_vn == dst_vn && src_pos < dst_pos + count && dst_pos < src_pos + count) {
+        // Overlapping ranges of the same file
+        return -EINVAL;
+    }
+
+    if (src_vn->fs == dst_vn->fs && dst_vn->op->copy_range) {
+        res = dst_vn->op->copy_range(src, src_pos, dst, dst_pos, count);
+    } else {
+        res = vfs_copy_bounce(src, src_pos, dst, dst_pos, count);
+    }
+
+    if (res > 0) {
+        if (src_off) {
+            *src_off += res;
+        } else {
+            src->pos += res;
+        }
+        if (dst_off) {
+            *dst_off += res;
+        } else {
+            dst->pos += res;
+        }
+    }
+
+    return res;
+}
+
+static int vfs_fsync_internal(struct ofile *of, int datasync) {
+    assert(of);
+    vnode_t *vn = of->vnode;
+    assert(vn && vn->op && vn->fs);
+
+    if (!vn->op->fsync) {
+        // Nothing is cached by the filesystem
+        return blk_flush(vn->fs->blk);
+    }
+
+    return vn->op->fsync(of, datasync);
+}
+
+// Make the file's data and metadata durable
+int vfs_fsync(struct vfs_ioctx *ctx, struct ofile *of) {
+    return vfs_fsync_internal(of, 0);
+}
+
+// Same as vfs_fsync(), but metadata is only written if it's needed
+// to read the data back
+int vfs_fdatasync(struct vfs_ioctx *ctx, struct ofile *of) {
+    return vfs_fsync_internal(of, 1);
+}
+
+static int vfs_sync_node(struct vfs_node *node) {
+    int res = 0, err;
+
+    if (node->ismount) {
+        fs_t *fs = node->vnode->fs;
+        assert(fs && fs->cls);
+
+        if (fs->cls->sync) {
+            res = fs->cls->sync(fs);
+        } else {
+            res = blk_flush(fs->blk);
+        }
+    }
+
+    for (struct vfs_node *it = node->child; it; it = it->cdr) {
+        if ((err = vfs_sync_node(it)) < 0 && !res) {
+            res = err;
+        }
+    }
+
+    return res;
+}
+
+// Make everything written so far durable on all the mounted filesystems
+int vfs_sync(struct vfs_ioctx *ctx) {
+    if (!vfs_root_node.vnode) {
+        return 0;
+    }
+
+    return vfs_sync_node(&vfs_root_node);
+}
+
 // XXX: Linux seems to differentiate between
 //      unlink() and rmdir(). I think just
 //      passing a flag whether sys_rmdir or
@@ -1128,6 +1542,25 @@ struct dirent *vfs_readdir(struct vfs_ioctx *ctx, struct ofile *fd) {
         return NULL;
     }
 
+    if (vn->op->getdents) {
+        // Refill the dirent buffer with as many entries as the
+        // filesystem can provide at once
+        if (fd->dirent_off >= fd->dirent_len) {
+            ssize_t nr = vn->op->getdents(fd, fd->dirent_buf, sizeof(fd->dirent_buf));
+
+            if (nr <= 0) {
+                return NULL;
+            }
+
+            fd->dirent_off = 0;
+            fd->dirent_len = nr;
+        }
+
+        struct dirent *ent = (struct dirent *) &fd->dirent_buf[fd->dirent_off];
+        fd->dirent_off += ent->d_reclen;
+        return ent;
+    }
+
     if (!vn->op->readdir) {
         return NULL;
     }
@@ -1139,6 +1572,44 @@ struct dirent *vfs_readdir(struct vfs_ioctx *ctx, struct ofile *fd) {
     return NULL;
 }
 
+ssize_t vfs_getdents(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t count) {
+    assert(fd && buf);
+    if (!(fd->flags & O_DIRECTORY)) {
+        return -ENOTDIR;
+    }
+    vnode_t *vn = fd->vnode;
+    assert(vn && vn->op);
+
+    if (vfs_vnode_access(ctx, vn, R_OK) < 0) {
+        return -EACCES;
+    }
+
+    if (!vn->op->getdents) {
+        return -EINVAL;
+    }
+
+    return vn->op->getdents(fd, buf, count);
+}
+
+ssize_t vfs_readdirplus(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t count) {
+    assert(fd && buf);
+    if (!(fd->flags & O_DIRECTORY)) {
+        return -ENOTDIR;
+    }
+    vnode_t *vn = fd->vnode;
+    assert(vn && vn->op);
+
+    if (vfs_vnode_access(ctx, vn, R_OK) < 0) {
+        return -EACCES;
+    }
+
+    if (!vn->op->readdirplus) {
+        return -EINVAL;
+    }
+
+    return vn->op->readdirplus(fd, buf, count);
+}
+
 int vfs_mkdir(struct vfs_ioctx *ctx, const char *path, mode_t mode) {
     vnode_t *parent_vnode = NULL;
     vnode_t *vnode = NULL;
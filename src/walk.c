@@ -0,0 +1,486 @@
+// Recursive directory tree walker
+#include "walk.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#define WALK_BUF_SIZE       16384
+#define WALK_MAX_THREADS    64
+
+struct walk_dir {
+    char *path;
+    // Points into path
+    const char *name;
+    int depth;
+    unsigned char type;
+    int has_st;
+    struct stat st;
+
+    // Directory vnode, referenced from the moment it's opened until
+    // the post callback is done so the children can be resolved
+    // relative to it
+    vnode_t *vnode;
+    struct walk_dir *parent;
+    // Children not finished yet plus one for listing the directory itself
+    atomic_int pending;
+};
+
+// Work queue of a worker: the owner pushes and pops at the bottom,
+// other workers steal from the top
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_dir **items;
+    size_t top, bottom, cap;
+};
+
+struct walk {
+    struct vfs_ioctx *ctx;
+    int flags;
+    vfs_walk_fn pre, post;
+    void *arg;
+
+    size_t nworkers;
+    struct walk_deque *queues;
+    // Directories queued or being listed
+    atomic_size_t outstanding;
+    // First error encountered, aborts the walk
+    atomic_int error;
+
+    // The VFS path tree is not thread-safe, all the lookups and
+    // refcount changes go through this lock. Reading the directories
+    // themselves is done without it
+    pthread_mutex_t vfs_lock;
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+struct walk_worker {
+    struct walk *w;
+    size_t index;
+    pthread_t thread;
+};
+
+static unsigned char walk_mode_dtype(mode_t mode) {
+    switch (mode & S_IFMT) {
+    case S_IFDIR:
+        return DT_DIR;
+    case S_IFREG:
+        return DT_REG;
+    case S_IFLNK:
+        return DT_LNK;
+    case S_IFBLK:
+        return DT_BLK;
+    case S_IFCHR:
+        return DT_CHR;
+    case S_IFIFO:
+        return DT_FIFO;
+    case S_IFSOCK:
+        return DT_SOCK;
+    default:
+        return DT_UNKNOWN;
+    }
+}
+
+static char *walk_path_join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+
+    memcpy(path, dir, dir_len);
+    if (dir_len && dir[dir_len - 1] != '/') {
+        path[dir_len++] = '/';
+    }
+    memcpy(path + dir_len, name, name_len + 1);
+
+    return path;
+}
+
+static void walk_fail(struct walk *w, int res) {
+    int none = 0;
+    atomic_compare_exchange_strong(&w->error, &none, res);
+}
+
+static void walk_push(struct walk *w, size_t index, struct walk_dir *d) {
+    struct walk_deque *q = &w->queues[index];
+
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom == q->cap) {
+        if (q->top) {
+            memmove(q->items, &q->items[q->top], (q->bottom - q->top) * sizeof(struct walk_dir *));
+            q->bottom -= q->top;
+            q->top = 0;
+        } else {
+            q->cap = q->cap ? q->cap * 2 : 64;
+            q->items = realloc(q->items, q->cap * sizeof(struct walk_dir *));
+            assert(q->items);
+        }
+    }
+    q->items[q->bottom++] = d;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_cond_signal(&w->idle_cond);
+}
+
+static struct walk_dir *walk_pop(struct walk *w, size_t index) {
+    struct walk_deque *q = &w->queues[index];
+    struct walk_dir *d = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom > q->top) {
+        d = q->items[--q->bottom];
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return d;
+}
+
+static struct walk_dir *walk_steal(struct walk *w, size_t index) {
+    for (size_t i = 1; i < w->nworkers; ++i) {
+        struct walk_deque *q = &w->queues[(index + i) % w->nworkers];
+        struct walk_dir *d = NULL;
+
+        pthread_mutex_lock(&q->lock);
+        if (q->bottom > q->top) {
+            // Take the oldest entry - it's likely the largest subtree
+            d = q->items[q->top++];
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if (d) {
+            return d;
+        }
+    }
+
+    return NULL;
+}
+
+// Drop a reference to the directory, calling post for it (and possibly
+// its parents) once everything beneath it is done
+static void walk_dir_put(struct walk *w, struct walk_dir *d) {
+    while (d && atomic_fetch_sub(&d->pending, 1) == 1) {
+        struct walk_dir *parent = d->parent;
+        int res;
+
+        if (w->post && !atomic_load(&w->error)) {
+            struct vfs_walk_ent ent = {
+                .path = d->path,
+                .name = d->name,
+                .depth = d->depth,
+                .type = d->type,
+                .st = d->has_st ? &d->st : NULL
+            };
+
+            if ((res = w->post(&ent, w->arg)) < 0) {
+                walk_fail(w, res);
+            }
+        }
+
+        if (d->vnode) {
+            pthread_mutex_lock(&w->vfs_lock);
+            vnode_unref(d->vnode);
+            pthread_mutex_unlock(&w->vfs_lock);
+        }
+
+        free(d->path);
+        free(d);
+
+        d = parent;
+    }
+}
+
+static int walk_list(struct walk *w, size_t index, struct walk_dir *d, char *buf) {
+    struct vfs_ioctx ctx = *w->ctx;
+    struct ofile fd;
+    int use_plus;
+    ssize_t nr;
+    int res;
+
+    pthread_mutex_lock(&w->vfs_lock);
+    if (d->parent) {
+        // Only look up the last path element - parent is kept referenced
+        ctx.cwd_vnode = d->parent->vnode;
+        res = vfs_open(&ctx, &fd, d->name, 0, O_DIRECTORY | O_RDONLY);
+    } else {
+        res = vfs_open(&ctx, &fd, d->path, 0, O_DIRECTORY | O_RDONLY);
+    }
+    if (res == 0) {
+        d->vnode = fd.vnode;
+        vnode_ref(d->vnode);
+    }
+    pthread_mutex_unlock(&w->vfs_lock);
+
+    if (res < 0) {
+        // Unreadable directories are just not descended into
+        return res == -EACCES ? 0 : res;
+    }
+
+    use_plus = (w->flags & VFS_WALK_STAT) && fd.vnode->op->readdirplus;
+
+    while (1) {
+        if (use_plus) {
+            nr = vfs_readdirplus(&ctx, &fd, buf, WALK_BUF_SIZE);
+        } else {
+            nr = vfs_getdents(&ctx, &fd, buf, WALK_BUF_SIZE);
+        }
+
+        if (nr <= 0) {
+            res = nr;
+            break;
+        }
+
+        for (size_t off = 0; off < (size_t) nr && !atomic_load(&w->error);) {
+            const struct stat *st = NULL;
+            struct dirent *ent;
+            struct stat stbuf;
+
+            if (use_plus) {
+                struct dirent_plus *ent_plus = (struct dirent_plus *) &buf[off];
+                ent = &ent_plus->dp_dirent;
+                st = &ent_plus->dp_stat;
+            } else {
+                ent = (struct dirent *) &buf[off];
+            }
+            off += ent->d_reclen;
+
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+                continue;
+            }
+
+            unsigned char type = ent->d_type;
+
+            if (type == DT_UNKNOWN && st) {
+                type = walk_mode_dtype(st->st_mode);
+            }
+
+            // Only stat the entry if asked to or if the fs cannot tell
+            // whether it's a directory
+            if ((!st && (w->flags & VFS_WALK_STAT)) || type == DT_UNKNOWN) {
+                pthread_mutex_lock(&w->vfs_lock);
+                res = vfs_statat(&ctx, fd.vnode, ent->d_name, &stbuf);
+                pthread_mutex_unlock(&w->vfs_lock);
+
+                if (res < 0) {
+                    walk_fail(w, res);
+                    break;
+                }
+
+                if (w->flags & VFS_WALK_STAT) {
+                    st = &stbuf;
+                }
+                type = walk_mode_dtype(stbuf.st_mode);
+            }
+
+            char *path = walk_path_join(d->path, ent->d_name);
+            const char *name = path + strlen(path) - strlen(ent->d_name);
+
+            if (w->pre) {
+                struct vfs_walk_ent went = {
+                    .path = path,
+                    .name = name,
+                    .depth = d->depth + 1,
+                    .type = type,
+                    .st = st
+                };
+
+                if ((res = w->pre(&went, w->arg)) < 0) {
+                    free(path);
+                    walk_fail(w, res);
+                    break;
+                }
+            } else {
+                res = 0;
+            }
+
+            if (type != DT_DIR || res == VFS_WALK_SKIP) {
+                free(path);
+                continue;
+            }
+
+            struct walk_dir *child = calloc(1, sizeof(struct walk_dir));
+            child->path = path;
+            child->name = name;
+            child->depth = d->depth + 1;
+            child->type = type;
+            child->parent = d;
+            if (st) {
+                child->st = *st;
+                child->has_st = 1;
+            }
+            atomic_init(&child->pending, 1);
+
+            atomic_fetch_add(&d->pending, 1);
+            atomic_fetch_add(&w->outstanding, 1);
+            walk_push(w, index, child);
+        }
+
+        if (atomic_load(&w->error)) {
+            res = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&w->vfs_lock);
+    vfs_close(&ctx, &fd);
+    pthread_mutex_unlock(&w->vfs_lock);
+
+    return res;
+}
+
+static void *walk_worker(void *arg) {
+    struct walk_worker *wk = arg;
+    struct walk *w = wk->w;
+    char *buf = malloc(WALK_BUF_SIZE);
+    int res;
+
+    while (1) {
+        struct walk_dir *d = walk_pop(w, wk->index);
+
+        if (!d) {
+            d = walk_steal(w, wk->index);
+        }
+
+        if (!d) {
+            if (atomic_load(&w->outstanding) == 0) {
+                break;
+            }
+
+            // Someone is still listing a directory, wait for it to
+            // either push more work or finish
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_nsec -= 1000000000;
+                ++ts.tv_sec;
+            }
+
+            pthread_mutex_lock(&w->idle_lock);
+            if (atomic_load(&w->outstanding) != 0) {
+                pthread_cond_timedwait(&w->idle_cond, &w->idle_lock, &ts);
+            }
+            pthread_mutex_unlock(&w->idle_lock);
+            continue;
+        }
+
+        // After an error the queued directories are only released
+        if (!atomic_load(&w->error)) {
+            if ((res = walk_list(w, wk->index, d, buf)) < 0) {
+                walk_fail(w, res);
+            }
+        }
+
+        walk_dir_put(w, d);
+
+        if (atomic_fetch_sub(&w->outstanding, 1) == 1) {
+            pthread_cond_broadcast(&w->idle_cond);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int vfs_walk(struct vfs_ioctx *ctx, const char *path, int flags, int nthreads,
+             vfs_walk_fn pre, vfs_walk_fn post, void *arg) {
+    assert(ctx && path);
+    struct walk_worker workers[WALK_MAX_THREADS];
+    struct walk w;
+    struct stat st;
+    int res;
+
+    if ((res = vfs_stat(ctx, path, &st)) < 0) {
+        return res;
+    }
+
+    struct walk_dir *root = calloc(1, sizeof(struct walk_dir));
+    root->path = strdup(path);
+    root->name = root->path;
+    root->type = walk_mode_dtype(st.st_mode);
+    if (flags & VFS_WALK_STAT) {
+        root->st = st;
+        root->has_st = 1;
+    }
+    atomic_init(&root->pending, 1);
+
+    if (pre) {
+        struct vfs_walk_ent ent = {
+            .path = root->path,
+            .name = root->name,
+            .depth = 0,
+            .type = root->type,
+            .st = root->has_st ? &root->st : NULL
+        };
+
+        res = pre(&ent, arg);
+    }
+
+    if (res < 0 || root->type != DT_DIR || res == VFS_WALK_SKIP) {
+        free(root->path);
+        free(root);
+        return res < 0 ? res : 0;
+    }
+
+    w.ctx = ctx;
+    w.flags = flags;
+    w.pre = pre;
+    w.post = post;
+    w.arg = arg;
+    w.nworkers = 1;
+    if (flags & VFS_WALK_PARALLEL) {
+        if (nthreads > WALK_MAX_THREADS) {
+            nthreads = WALK_MAX_THREADS;
+        }
+        if (nthreads > 1) {
+            w.nworkers = nthreads;
+        }
+    }
+    atomic_init(&w.outstanding, 1);
+    atomic_init(&w.error, 0);
+    pthread_mutex_init(&w.vfs_lock, NULL);
+    pthread_mutex_init(&w.idle_lock, NULL);
+    pthread_cond_init(&w.idle_cond, NULL);
+
+    w.queues = calloc(w.nworkers, sizeof(struct walk_deque));
+    for (size_t i = 0; i < w.nworkers; ++i) {
+        pthread_mutex_init(&w.queues[i].lock, NULL);
+    }
+
+    walk_push(&w, 0, root);
+
+    // The calling thread is worker #0
+    for (size_t i = 0; i < w.nworkers; ++i) {
+        workers[i].w = &w;
+        workers[i].index = i;
+    }
+    size_t nstarted = 1;
+    for (; nstarted < w.nworkers; ++nstarted) {
+        if (pthread_create(&workers[nstarted].thread, NULL, walk_worker, &workers[nstarted]) != 0) {
+            // Go on with the workers started so far, their queues
+            // are only filled by their owners anyway
+            break;
+        }
+    }
+    walk_worker(&workers[0]);
+    for (size_t i = 1; i < nstarted; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    res = atomic_load(&w.error);
+
+    for (size_t i = 0; i < w.nworkers; ++i) {
+        pthread_mutex_destroy(&w.queues[i].lock);
+        free(w.queues[i].items);
+    }
+    free(w.queues);
+    pthread_mutex_destroy(&w.vfs_lock);
+    pthread_mutex_destroy(&w.idle_lock);
+    pthread_cond_destroy(&w.idle_cond);
+
+    return res;
+}